@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2014 Isracoin Developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+import binascii
+import hashlib
+import json
+import queue
+import socket
+import struct
+import sys
+import threading
+
+DIFF1_TARGET = 0x0000ffff << 224
+NONCES_PER_CHECK = 4096
+
+class StratumClient:
+	def __init__(self, host, port):
+		self.sock = socket.create_connection((host, port))
+		self.file = self.sock.makefile('r')
+		self.nextid = 0
+		self.replies = queue.Queue()
+		self.notifications = queue.Queue()
+		reader = threading.Thread(target=self.readloop)
+		reader.daemon = True
+		reader.start()
+
+	def readloop(self):
+		for line in self.file:
+			msg = json.loads(line)
+			if msg.get('method') is None:
+				self.replies.put(msg)
+			else:
+				self.notifications.put(msg)
+		self.replies.put(None)
+		self.notifications.put(None)
+
+	def call(self, method, params):
+		self.nextid += 1
+		msg = { 'id' : self.nextid, 'method' : method, 'params' : params }
+		self.sock.sendall((json.dumps(msg) + '\n').encode())
+		while True:
+			msg = self.replies.get()
+			if msg is None:
+				raise EOFError('connection closed')
+			if msg.get('id') == self.nextid:
+				return msg
+
+	def poll(self, wait):
+		"""Notifications received so far, waiting for one if wait is set"""
+		msgs = []
+		try:
+			msgs.append(self.notifications.get(wait))
+			while True:
+				msgs.append(self.notifications.get(False))
+		except queue.Empty:
+			pass
+		if None in msgs:
+			raise EOFError('connection closed')
+		return msgs
+
+def sha256d(data):
+	return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+def scrypt(header):
+	return hashlib.scrypt(header, salt=header, n=1024, r=1, p=1, dklen=32)
+
+def prevhash_bytes(prevhash):
+	# Each 32-bit word of the header's previous block hash comes byte-swapped
+	raw = binascii.unhexlify(prevhash)
+	return b''.join(raw[i:i+4][::-1] for i in range(0, len(raw), 4))
+
+def header_prefix(job, extranonce1, extranonce2):
+	(jobid, prevhash, coinb1, coinb2, branch, version, nbits, ntime, clean) = job
+	coinbase = binascii.unhexlify(coinb1 + extranonce1 + extranonce2 + coinb2)
+	root = sha256d(coinbase)
+	for h in branch:
+		root = sha256d(root + binascii.unhexlify(h))
+	return (struct.pack('<I', int(version, 16)) + prevhash_bytes(prevhash) + root +
+		struct.pack('<II', int(ntime, 16), int(nbits, 16)))
+
+def main():
+	host = sys.argv[1] if len(sys.argv) > 1 else '127.0.0.1'
+	port = int(sys.argv[2]) if len(sys.argv) > 2 else 3333
+	worker = sys.argv[3] if len(sys.argv) > 3 else 'stratumminer'
+	maxshares = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+
+	client = StratumClient(host, port)
+	result = client.call('mining.subscribe', ['stratumminer/0.1'])['result']
+	extranonce1, extranonce2_size = result[1], result[2]
+	print('subscribed, extranonce1 %s' % extranonce1)
+	print('authorize: %s' % client.call('mining.authorize', [worker, 'x'])['result'])
+
+	target = DIFF1_TARGET
+	job = None
+	extranonce2 = 0
+	shares = 0
+	while shares < maxshares:
+		for msg in client.poll(job is None):
+			if msg.get('method') == 'mining.set_difficulty':
+				target = int(DIFF1_TARGET / msg['params'][0])
+				print('difficulty %s' % msg['params'][0])
+			elif msg.get('method') == 'mining.notify':
+				if job is None or msg['params'][8]:
+					extranonce2 = 0
+				job = msg['params']
+				nonce = 0
+				print('job %s on %s' % (job[0], job[1]))
+		if job is None:
+			continue
+
+		en2 = ('%0*x' % (extranonce2_size * 2, extranonce2))
+		prefix = header_prefix(job, extranonce1, en2)
+		for n in range(nonce, nonce + NONCES_PER_CHECK):
+			header = prefix + struct.pack('<I', n)
+			if int.from_bytes(scrypt(header), 'little') <= target:
+				reply = client.call('mining.submit', [worker, job[0], en2, job[7], '%08x' % n])
+				shares += 1
+				print('share %s: %s %s' % (sha256d(header)[::-1].hex(), reply['result'], reply.get('error')))
+		nonce += NONCES_PER_CHECK
+		if nonce >= 1 << 32:
+			extranonce2 += 1
+			nonce = 0
+
+if __name__ == '__main__':
+	main()
@@ -262,6 +262,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/netbase.h \
     src/clientversion.h \
     src/txdb.h \
+    src/blockstore.h \
+    src/blockfilter.h \
+    src/blockimport.h \
+    src/stratum.h \
     src/leveldb.h \
     src/threadsafety.h \
     src/limitedmap.h \
@@ -336,6 +340,10 @@ SOURCES += src/qt/bitcoin.cpp \
     src/noui.cpp \
     src/leveldb.cpp \
     src/txdb.cpp \
+    src/blockstore.cpp \
+    src/blockfilter.cpp \
+    src/blockimport.cpp \
+    src/stratum.cpp \
     src/qt/splashscreen.cpp \
     src/json/json_spirit_value.cpp
 
@@ -0,0 +1,270 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "hash.h"
+#include "main.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+/** Appends bits, most significant first, to a byte vector */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char chBuffer;
+    int nBufferBits;
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), chBuffer(0), nBufferBits(0) {}
+
+    void Write(uint64 nValue, int nBits)
+    {
+        for (int i = nBits - 1; i >= 0; i--) {
+            chBuffer = (chBuffer << 1) | ((nValue >> i) & 1);
+            if (++nBufferBits == 8) {
+                vch.push_back(chBuffer);
+                chBuffer = 0;
+                nBufferBits = 0;
+            }
+        }
+    }
+
+    // pads the last byte with zero bits
+    void Flush()
+    {
+        if (nBufferBits > 0)
+            vch.push_back(chBuffer << (8 - nBufferBits));
+        chBuffer = 0;
+        nBufferBits = 0;
+    }
+};
+
+/** Reads bits, most significant first, from a byte range */
+class CBitReader
+{
+private:
+    const unsigned char* pcur;
+    const unsigned char* pend;
+    unsigned char chBuffer;
+    int nBufferBits;
+
+public:
+    CBitReader(const unsigned char* pbegin, const unsigned char* pendIn) : pcur(pbegin), pend(pendIn), chBuffer(0), nBufferBits(0) {}
+
+    uint64 Read(int nBits)
+    {
+        uint64 nValue = 0;
+        while (nBits--) {
+            if (nBufferBits == 0) {
+                if (pcur == pend)
+                    throw std::ios_base::failure("CBitReader::Read() : end of data");
+                chBuffer = *pcur++;
+                nBufferBits = 8;
+            }
+            nValue = (nValue << 1) | ((chBuffer >> --nBufferBits) & 1);
+        }
+        return nValue;
+    }
+};
+
+void GolombRiceEncode(CBitWriter& writer, int nP, uint64 nValue)
+{
+    // quotient in unary (q ones and a terminating zero), remainder in nP bits
+    uint64 q = nValue >> nP;
+    while (q > 0) {
+        int nBits = q <= 64 ? (int)q : 64;
+        writer.Write(~(uint64)0, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(nValue, nP);
+}
+
+uint64 GolombRiceDecode(CBitReader& reader, int nP)
+{
+    uint64 q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    return (q << nP) + reader.Read(nP);
+}
+
+/** (x * n) >> 64: maps a uniform 64-bit value into [0, n) without a division */
+uint64 MapIntoRange(uint64 x, uint64 n)
+{
+    uint64 x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64 n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+
+    uint64 ac = x_hi * n_hi;
+    uint64 ad = x_hi * n_lo;
+    uint64 bc = x_lo * n_hi;
+    uint64 bd = x_lo * n_lo;
+
+    uint64 mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+}
+
+uint64 ReadLE64(const unsigned char* p)
+{
+    uint64 n = 0;
+    for (int i = 7; i >= 0; i--)
+        n = (n << 8) | p[i];
+    return n;
+}
+
+} // anon namespace
+
+CGolombCodedSet::CGolombCodedSet(uint64 nSipHashK0In, uint64 nSipHashK1In, int nPIn, uint32_t nMIn) :
+    nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn), nN(0), nF(0)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nN);
+    vchEncoded.assign(ss.begin(), ss.end());
+}
+
+CGolombCodedSet::CGolombCodedSet(uint64 nSipHashK0In, uint64 nSipHashK1In, int nPIn, uint32_t nMIn, const ElementSet& elements) :
+    nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("CGolombCodedSet : too many elements");
+    nN = elements.size();
+    nF = (uint64)nN * nM;
+
+    std::vector<uint64> vHashed;
+    vHashed.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vHashed.push_back(HashToRange(element));
+    std::sort(vHashed.begin(), vHashed.end());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nN);
+    vchEncoded.assign(ss.begin(), ss.end());
+
+    CBitWriter writer(vchEncoded);
+    uint64 nLast = 0;
+    BOOST_FOREACH(uint64 nValue, vHashed) {
+        GolombRiceEncode(writer, nP, nValue - nLast);
+        nLast = nValue;
+    }
+    writer.Flush();
+}
+
+CGolombCodedSet::CGolombCodedSet(uint64 nSipHashK0In, uint64 nSipHashK1In, int nPIn, uint32_t nMIn, const std::vector<unsigned char>& vchEncodedIn) :
+    nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn), vchEncoded(vchEncodedIn)
+{
+    if (vchEncoded.empty())
+        throw std::ios_base::failure("CGolombCodedSet : empty encoding");
+    CBufferReader reader((const char*)&vchEncoded[0], (const char*)&vchEncoded[0] + vchEncoded.size(), SER_NETWORK, PROTOCOL_VERSION);
+    uint64 nSize = ReadCompactSize(reader);
+    if (nSize > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("CGolombCodedSet : N too large");
+    nN = nSize;
+    nF = (uint64)nN * nM;
+
+    // Make sure all N values can be decoded, and nothing but padding follows
+    const unsigned char* pdata = (const unsigned char*)reader.pos();
+    CBitReader bits(pdata, pdata + reader.size());
+    uint64 nBits = 0;
+    for (uint32_t i = 0; i < nN; i++) {
+        uint64 nDelta = GolombRiceDecode(bits, nP);
+        nBits += (nDelta >> nP) + 1 + nP;
+    }
+    if ((nBits + 7) / 8 != reader.size())
+        throw std::ios_base::failure("CGolombCodedSet : encoded size mismatch");
+}
+
+uint64 CGolombCodedSet::HashToRange(const Element& element) const
+{
+    CSipHasher hasher(nSipHashK0, nSipHashK1);
+    if (!element.empty())
+        hasher.Write(&element[0], element.size());
+    return MapIntoRange(hasher.Finalize(), nF);
+}
+
+bool CGolombCodedSet::MatchInternal(const std::vector<uint64>& vQuery) const
+{
+    CBufferReader reader((const char*)&vchEncoded[0], (const char*)&vchEncoded[0] + vchEncoded.size(), SER_NETWORK, PROTOCOL_VERSION);
+    ReadCompactSize(reader);
+    const unsigned char* pdata = (const unsigned char*)reader.pos();
+    CBitReader bits(pdata, pdata + reader.size());
+
+    // Both the set and the query are sorted: walk them in parallel
+    uint64 nValue = 0;
+    std::vector<uint64>::const_iterator it = vQuery.begin();
+    for (uint32_t i = 0; i < nN; i++) {
+        nValue += GolombRiceDecode(bits, nP);
+        while (it != vQuery.end() && *it < nValue)
+            it++;
+        if (it == vQuery.end())
+            return false;
+        if (*it == nValue)
+            return true;
+    }
+    return false;
+}
+
+bool CGolombCodedSet::Match(const Element& element) const
+{
+    std::vector<uint64> vQuery(1, HashToRange(element));
+    return MatchInternal(vQuery);
+}
+
+bool CGolombCodedSet::MatchAny(const ElementSet& elements) const
+{
+    std::vector<uint64> vQuery;
+    vQuery.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vQuery.push_back(HashToRange(element));
+    std::sort(vQuery.begin(), vQuery.end());
+    return MatchInternal(vQuery);
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vchFilter) :
+    hashBlock(hashBlockIn),
+    filter(ReadLE64(hashBlockIn.begin()), ReadLE64(hashBlockIn.begin() + 8), BASIC_FILTER_P, BASIC_FILTER_M, vchFilter)
+{
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo* pblockundo) : hashBlock(block.GetHash())
+{
+    CGolombCodedSet::ElementSet elements;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(CGolombCodedSet::Element(script.begin(), script.end()));
+        }
+    }
+
+    if (pblockundo) {
+        BOOST_FOREACH(const CTxUndo& txundo, pblockundo->vtxundo) {
+            BOOST_FOREACH(const CTxInUndo& txinundo, txundo.vprevout) {
+                const CScript& script = txinundo.txout.scriptPubKey;
+                if (script.empty())
+                    continue;
+                elements.insert(CGolombCodedSet::Element(script.begin(), script.end()));
+            }
+        }
+    }
+
+    filter = CGolombCodedSet(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8), BASIC_FILTER_P, BASIC_FILTER_M, elements);
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vch = GetEncoded();
+    return Hash(vch.begin(), vch.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/** Golomb-Rice parameter and false positive rate (1/M) of basic block filters (BIP158) */
+static const int BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+/** Filter types served by getcfilters, getcfheaders and getcfcheckpt (BIP157) */
+enum BlockFilterType
+{
+    BLOCK_FILTER_BASIC = 0,
+};
+
+/** Maximum number of blocks covered by one getcfilters request */
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of blocks covered by one getcfheaders request */
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+/** Distance between the filter headers returned by getcfcheckpt */
+static const int CFCHECKPT_INTERVAL = 1000;
+
+/** Golomb-coded set: a compact, probabilistic set of byte strings.
+ *
+ * Elements are hashed with SipHash into [0, N * M), sorted, and the
+ * differences between successive values are Golomb-Rice coded with
+ * parameter P. The encoding starts with N as a compact size.
+ */
+class CGolombCodedSet
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+private:
+    uint64 nSipHashK0;
+    uint64 nSipHashK1;
+    int nP;
+    uint32_t nM;
+    uint32_t nN;
+    uint64 nF;
+    std::vector<unsigned char> vchEncoded;
+
+    uint64 HashToRange(const Element& element) const;
+    bool MatchInternal(const std::vector<uint64>& vQuery) const;
+
+public:
+    CGolombCodedSet(uint64 nSipHashK0In = 0, uint64 nSipHashK1In = 0, int nPIn = BASIC_FILTER_P, uint32_t nMIn = BASIC_FILTER_M);
+    /** Build the set from its elements */
+    CGolombCodedSet(uint64 nSipHashK0In, uint64 nSipHashK1In, int nPIn, uint32_t nMIn, const ElementSet& elements);
+    /** Load an encoded set; throws std::ios_base::failure if it is malformed */
+    CGolombCodedSet(uint64 nSipHashK0In, uint64 nSipHashK1In, int nPIn, uint32_t nMIn, const std::vector<unsigned char>& vchEncodedIn);
+
+    uint32_t GetN() const { return nN; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchEncoded; }
+
+    /** Check whether element is (probably) in the set */
+    bool Match(const Element& element) const;
+    /** Check whether any of the elements is (probably) in the set */
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+/** Basic block filter (BIP158): a Golomb-coded set of the output scripts a
+ * block creates and the output scripts its inputs spend, keyed by the block hash.
+ */
+class CBlockFilter
+{
+private:
+    uint256 hashBlock;
+    CGolombCodedSet filter;
+
+public:
+    CBlockFilter() : hashBlock(0) {}
+    CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vchFilter);
+    /** Build the filter of block; blockundo holds the outputs spent by it (unused for the genesis block) */
+    CBlockFilter(const CBlock& block, const CBlockUndo* pblockundo);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const CGolombCodedSet& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncoded() const { return filter.GetEncoded(); }
+
+    /** Double SHA-256 of the encoded filter */
+    uint256 GetHash() const;
+    /** Filter header: the filter hash committed together with the previous block's filter header */
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
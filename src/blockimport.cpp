@@ -0,0 +1,496 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+#include "main.h"
+#include "txdb.h"
+#include "ui_interface.h"
+
+#include <deque>
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace {
+
+/** A block found in one of the imported files */
+struct CImportedBlock
+{
+    uint256 hash;
+    uint256 hashPrev;
+    size_t nSource;      // position in the list of files
+    uint64 nPos;         // offset of the block in its file
+    unsigned int nSize;
+    CBlock* pblock;      // NULL once dropped from memory
+
+    CImportedBlock() : nSource(0), nPos(0), nSize(0), pblock(NULL) {}
+
+    uint64 GetRecordPos() const { return nPos - 8; } // of the magic and size in front of the block
+};
+
+} // anon namespace
+
+class CImportPipeline
+{
+private:
+    const std::vector<CImportFile> *pvFiles;
+    std::vector<CImportProgress> vProgress;
+    std::vector<uint64> vStartByte;   // skip the part of a block file that is already indexed
+    std::vector<uint64> vWatermark;   // last watermark written to the block index
+
+    boost::mutex mutex;
+    boost::condition_variable condQueued;   // blocks to check, or shutting down
+    boost::condition_variable condChecked;  // checked blocks, or everything finished
+    boost::condition_variable condRoom;     // room for more blocks
+    size_t nNextFile;
+    int nScanning;      // scanner threads still running
+    int nChecking;      // blocks being checked right now
+    std::deque<CImportedBlock> queueCheck;
+    std::deque<CImportedBlock> queueChecked;
+    std::string strError;
+    bool fStop;         // end the current import
+    bool fShutdown;     // end the checker threads
+
+    // blocks waiting for their parent, by parent hash
+    std::multimap<uint256, CImportedBlock> mapUnknownParent;
+    uint64 nUnknownParentSize;
+
+    void ScanFile(size_t nSource);
+    bool ReadBlock(const CImportedBlock &item, CBlock &block);
+    bool ProcessImported(CImportedBlock &item, int &nLoaded);
+    void Done(const CImportedBlock &item);
+    void WriteWatermarks();
+
+public:
+    CImportPipeline();
+    ~CImportPipeline();
+
+    void Begin(const std::vector<CImportFile> &vFilesIn, int nScanners);
+    void Stop();
+    void End();
+    void Shutdown();
+
+    void ThreadScan();
+    void ThreadCheck();
+    int Connect();
+};
+
+CImportPipeline::CImportPipeline() :
+    pvFiles(NULL), nNextFile(0), nScanning(0), nChecking(0), fStop(false), fShutdown(false), nUnknownParentSize(0)
+{
+}
+
+CImportPipeline::~CImportPipeline()
+{
+    End();
+}
+
+void CImportPipeline::Begin(const std::vector<CImportFile> &vFilesIn, int nScanners)
+{
+    pvFiles = &vFilesIn;
+    vStartByte.assign(vFilesIn.size(), 0);
+    for (size_t i = 0; i < vFilesIn.size(); i++) {
+        if (vFilesIn[i].nFile >= 0)
+            pblocktree->ReadReindexPos(vFilesIn[i].nFile, vStartByte[i]);
+    }
+    vWatermark = vStartByte;
+    vProgress.clear();
+    for (size_t i = 0; i < vFilesIn.size(); i++)
+        vProgress.push_back(CImportProgress(vStartByte[i]));
+
+    boost::mutex::scoped_lock lock(mutex);
+    nNextFile = 0;
+    nScanning = nScanners;
+    strError = "";
+    fStop = false;
+}
+
+// Drop whatever the current import left, once its scanner threads are gone
+void CImportPipeline::End()
+{
+    boost::this_thread::disable_interruption di;
+    boost::mutex::scoped_lock lock(mutex);
+    BOOST_FOREACH(CImportedBlock &item, queueCheck)
+        delete item.pblock;
+    queueCheck.clear();
+    while (nChecking > 0)
+        condChecked.wait(lock);
+    BOOST_FOREACH(CImportedBlock &item, queueChecked)
+        delete item.pblock;
+    queueChecked.clear();
+    for (std::multimap<uint256, CImportedBlock>::iterator it = mapUnknownParent.begin(); it != mapUnknownParent.end(); it++)
+        delete it->second.pblock;
+    mapUnknownParent.clear();
+    nUnknownParentSize = 0;
+    pvFiles = NULL;
+}
+
+void CImportPipeline::Stop()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    fStop = true;
+    condQueued.notify_all();
+    condChecked.notify_all();
+    condRoom.notify_all();
+}
+
+void CImportPipeline::Shutdown()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    fStop = true;
+    fShutdown = true;
+    condQueued.notify_all();
+    condChecked.notify_all();
+    condRoom.notify_all();
+}
+
+void CImportPipeline::Done(const CImportedBlock &item)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    vProgress[item.nSource].Done(item.GetRecordPos());
+}
+
+// Record how far each reindexed file is done. Blocks get written to the block index
+// as they are processed, before this, so the watermark never gets ahead of them.
+void CImportPipeline::WriteWatermarks()
+{
+    for (size_t i = 0; i < pvFiles->size(); i++) {
+        if ((*pvFiles)[i].nFile < 0)
+            continue;
+        uint64 nWatermark;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            nWatermark = vProgress[i].GetWatermark();
+        }
+        if (nWatermark > vWatermark[i] && pblocktree->WriteReindexPos((*pvFiles)[i].nFile, nWatermark))
+            vWatermark[i] = nWatermark;
+    }
+}
+
+void CImportPipeline::ScanFile(size_t nSource)
+{
+    const CImportFile &source = (*pvFiles)[nSource];
+    FILE* fileIn = fopen(source.path.string().c_str(), "rb");
+    if (!fileIn) {
+        printf("ImportBlocks() : unable to open %s\n", source.path.string().c_str());
+        return;
+    }
+    if (source.nFile >= 0)
+        printf("Reindexing block file blk%05u.dat...\n", (unsigned int)source.nFile);
+    else
+        printf("Importing %s...\n", source.path.string().c_str());
+
+    try {
+        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        uint64 nStartByte = vStartByte[nSource];
+        if (nStartByte > 0)
+            blkdat.Seek(nStartByte);
+        uint64 nRewind = blkdat.GetPos();
+        while (blkdat.good() && !blkdat.eof()) {
+            boost::this_thread::interruption_point();
+
+            blkdat.SetPos(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[4];
+                blkdat.FindByte(pchMessageStart[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, pchMessageStart, 4))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                    continue;
+            } catch (std::exception &e) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read block
+                uint64 nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                std::auto_ptr<CBlock> pblock(new CBlock());
+                blkdat >> *pblock;
+                nRewind = blkdat.GetPos();
+                if (nBlockPos < nStartByte)
+                    continue;
+
+                CImportedBlock item;
+                item.hash = pblock->GetHash();
+                item.hashPrev = pblock->hashPrevBlock;
+                item.nSource = nSource;
+                item.nPos = nBlockPos;
+                item.nSize = nSize;
+
+                // hand it to the checker threads, waiting while too many blocks are in flight
+                boost::mutex::scoped_lock lock(mutex);
+                while (!fStop && queueCheck.size() + nChecking + queueChecked.size() >= MAX_IMPORT_QUEUE)
+                    condRoom.wait(lock);
+                if (fStop)
+                    break;
+                item.pblock = pblock.release();
+                vProgress[nSource].Found(item.GetRecordPos(), nRewind);
+                queueCheck.push_back(item);
+                condQueued.notify_one();
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+        }
+    } catch (std::runtime_error &e) {
+        boost::mutex::scoped_lock lock(mutex);
+        strError = e.what();
+    } catch (...) {
+        fclose(fileIn);
+        throw;
+    }
+    fclose(fileIn);
+}
+
+void CImportPipeline::ThreadScan()
+{
+    RenameThread("isracoin-loadscan");
+    try {
+        while (true) {
+            size_t nSource;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                if (fStop || !strError.empty() || nNextFile >= pvFiles->size())
+                    break;
+                nSource = nNextFile++;
+            }
+            ScanFile(nSource);
+        }
+    } catch (boost::thread_interrupted&) {
+    }
+
+    boost::mutex::scoped_lock lock(mutex);
+    nScanning--;
+    condQueued.notify_all();
+    condChecked.notify_all();
+}
+
+void CImportPipeline::ThreadCheck()
+{
+    RenameThread("isracoin-loadchk");
+    boost::mutex::scoped_lock lock(mutex);
+    while (true) {
+        while (!fShutdown && queueCheck.empty())
+            condQueued.wait(lock);
+        if (fShutdown)
+            return;
+        CImportedBlock item = queueCheck.front();
+        queueCheck.pop_front();
+        nChecking++;
+
+        lock.unlock();
+        CValidationState state;
+        bool fValid = item.pblock->CheckBlock(state);
+        lock.lock();
+
+        nChecking--;
+        if (fValid) {
+            queueChecked.push_back(item);
+        } else {
+            printf("ImportBlocks() : skipping invalid block %s\n", item.hash.ToString().c_str());
+            vProgress[item.nSource].Done(item.GetRecordPos());
+            delete item.pblock;
+            condRoom.notify_one();
+        }
+        condChecked.notify_all();
+    }
+}
+
+// Read a block that was dropped from memory again
+bool CImportPipeline::ReadBlock(const CImportedBlock &item, CBlock &block)
+{
+    const CImportFile &source = (*pvFiles)[item.nSource];
+    CAutoFile filein = CAutoFile(fopen(source.path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ImportBlocks() : unable to open %s", source.path.string().c_str());
+    if (fseek(filein, item.nPos, SEEK_SET))
+        return error("ImportBlocks() : unable to seek to position %"PRI64u" of %s", item.nPos, source.path.string().c_str());
+    try {
+        filein >> block;
+    } catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    return block.GetHash() == item.hash;
+}
+
+// Returns false if the import has to stop
+bool CImportPipeline::ProcessImported(CImportedBlock &item, int &nLoaded)
+{
+    CBlock block;
+    std::auto_ptr<CBlock> pblock(item.pblock);
+    item.pblock = NULL;
+    if (!pblock.get()) {
+        if (!ReadBlock(item, block))
+            return true;
+        pblock.reset(new CBlock(block));
+    }
+
+    LOCK(cs_main);
+    if (mapBlockIndex.count(item.hash))
+        return true; // duplicate
+    CDiskBlockPos pos((*pvFiles)[item.nSource].nFile, item.nPos);
+    CValidationState state;
+    ProcessBlock(state, NULL, pblock.get(), pos.nFile >= 0 ? &pos : NULL);
+    if (mapBlockIndex.count(item.hash))
+        nLoaded++;
+    return !state.IsError();
+}
+
+int CImportPipeline::Connect()
+{
+    int nLoaded = 0;
+    while (true) {
+        std::vector<CImportedBlock> vChecked;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            while (!fStop && strError.empty() && queueChecked.empty() && (nScanning > 0 || nChecking > 0 || !queueCheck.empty()))
+                condChecked.wait(lock);
+            if (fStop || queueChecked.empty())
+                break;
+            vChecked.assign(queueChecked.begin(), queueChecked.end());
+            queueChecked.clear();
+            condRoom.notify_all();
+        }
+
+        for (size_t i = 0; i < vChecked.size(); i++) {
+            CImportedBlock &item = vChecked[i];
+            bool fParentKnown;
+            {
+                LOCK(cs_main);
+                fParentKnown = item.hash == hashGenesisBlock || mapBlockIndex.count(item.hashPrev);
+            }
+            if (!fParentKnown) {
+                // wait for the parent, without keeping too much in memory
+                if (nUnknownParentSize + item.nSize > MAX_IMPORT_UNKNOWN_PARENT_SIZE) {
+                    delete item.pblock;
+                    item.pblock = NULL;
+                } else
+                    nUnknownParentSize += item.nSize;
+                mapUnknownParent.insert(make_pair(item.hashPrev, item));
+                continue;
+            }
+
+            // connect it, and then whatever was waiting for it
+            std::deque<CImportedBlock> queueConnect(1, item);
+            while (!queueConnect.empty()) {
+                CImportedBlock itemConnect = queueConnect.front();
+                queueConnect.pop_front();
+                bool fContinue = ProcessImported(itemConnect, nLoaded);
+                if (fContinue)
+                    Done(itemConnect);
+                else {
+                    BOOST_FOREACH(CImportedBlock &itemLeft, queueConnect)
+                        delete itemLeft.pblock;
+                    for (size_t j = i + 1; j < vChecked.size(); j++)
+                        delete vChecked[j].pblock;
+                    WriteWatermarks();
+                    return nLoaded;
+                }
+
+                std::pair<std::multimap<uint256, CImportedBlock>::iterator, std::multimap<uint256, CImportedBlock>::iterator> range = mapUnknownParent.equal_range(itemConnect.hash);
+                for (std::multimap<uint256, CImportedBlock>::iterator it = range.first; it != range.second; it++) {
+                    if (it->second.pblock)
+                        nUnknownParentSize -= it->second.nSize;
+                    queueConnect.push_back(it->second);
+                }
+                mapUnknownParent.erase(range.first, range.second);
+            }
+        }
+        WriteWatermarks();
+    }
+    WriteWatermarks(); // for the blocks the checker threads dropped last
+
+    std::string strErrorCopy;
+    bool fStopped;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        strErrorCopy = strError;
+        fStopped = fStop;
+    }
+
+    // Blocks whose parent never turned up become orphans, as if received from a peer, and are
+    // connected once the parent arrives from the network. They are not done with for the
+    // watermark, as orphans only live in memory.
+    uint64 nOrphanSize = 0;
+    std::multimap<uint256, CImportedBlock>::iterator it = mapUnknownParent.begin();
+    while (!fStopped && strErrorCopy.empty() && it != mapUnknownParent.end() &&
+           nOrphanSize + it->second.nSize <= MAX_IMPORT_UNKNOWN_PARENT_SIZE) {
+        nOrphanSize += it->second.nSize;
+        if (it->second.pblock)
+            nUnknownParentSize -= it->second.nSize;
+        bool fContinue = ProcessImported(it->second, nLoaded);
+        mapUnknownParent.erase(it++);
+        if (!fContinue)
+            break;
+    }
+    if (!strErrorCopy.empty())
+        AbortNode(_("Error: system error: ") + strErrorCopy);
+    if (!mapUnknownParent.empty())
+        printf("ImportBlocks() : %"PRIszu" blocks without a known parent were not kept as orphans\n", mapUnknownParent.size());
+    return nLoaded;
+}
+
+CBlockImporter::CBlockImporter()
+{
+    ppipeline = new CImportPipeline();
+    pthreadsCheck = new boost::thread_group();
+    int nCheckers = std::max(1, std::min((int)boost::thread::hardware_concurrency(), 8));
+    for (int i = 0; i < nCheckers; i++)
+        pthreadsCheck->create_thread(boost::bind(&CImportPipeline::ThreadCheck, ppipeline));
+}
+
+CBlockImporter::~CBlockImporter()
+{
+    ppipeline->Shutdown();
+    pthreadsCheck->interrupt_all();
+    pthreadsCheck->join_all();
+    delete pthreadsCheck;
+    delete ppipeline;
+}
+
+int CBlockImporter::Import(const std::vector<CImportFile> &vFiles)
+{
+    if (vFiles.empty())
+        return 0;
+    int64 nStart = GetTimeMillis();
+
+    int nScanners = std::min((size_t)IMPORT_SCAN_THREADS, vFiles.size());
+    ppipeline->Begin(vFiles, nScanners);
+    boost::thread_group threadsScan;
+    for (int i = 0; i < nScanners; i++)
+        threadsScan.create_thread(boost::bind(&CImportPipeline::ThreadScan, ppipeline));
+
+    int nLoaded = 0;
+    try {
+        nLoaded = ppipeline->Connect();
+    } catch (...) {
+        ppipeline->Stop();
+        threadsScan.interrupt_all();
+        threadsScan.join_all();
+        ppipeline->End();
+        throw;
+    }
+    ppipeline->Stop();
+    threadsScan.join_all();
+    ppipeline->End();
+
+    if (nLoaded > 0)
+        printf("Loaded %i blocks from %"PRIszu" file(s) in %"PRI64d"ms\n", nLoaded, vFiles.size(), GetTimeMillis() - nStart);
+    return nLoaded;
+}
+
+int ImportBlocks(const std::vector<CImportFile> &vFiles)
+{
+    CBlockImporter importer;
+    return importer.Import(vFiles);
+}
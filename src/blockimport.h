@@ -0,0 +1,86 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include "util.h"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+namespace boost { class thread_group; }
+class CImportPipeline;
+
+/** Number of files scanned for blocks at the same time */
+static const unsigned int IMPORT_SCAN_THREADS = 2;
+/** Maximum number of blocks read from the files but not yet handed to ProcessBlock */
+static const unsigned int MAX_IMPORT_QUEUE = 256;
+/** Maximum total size of the blocks kept in memory while their parent has not been seen yet */
+static const unsigned int MAX_IMPORT_UNKNOWN_PARENT_SIZE = 256 * 1024 * 1024;
+
+/** A file to import blocks from, in the block file format */
+struct CImportFile
+{
+    boost::filesystem::path path;
+    int nFile; // block file being reindexed, or -1 for an external file whose blocks are copied into the block files
+
+    CImportFile(const boost::filesystem::path &pathIn, int nFileIn = -1) : path(pathIn), nFile(nFileIn) {}
+};
+
+/** Progress through one imported file. Blocks are done (handed to ProcessBlock, or
+ *  dropped) out of order, so the watermark, up to which every block found is done,
+ *  trails the scan. An interrupted reindex resumes from there. */
+class CImportProgress
+{
+private:
+    std::set<uint64> setPending; // record positions of the blocks found but not done
+    uint64 nScanned;             // position up to which the file was scanned
+
+public:
+    CImportProgress(uint64 nStart = 0) : nScanned(nStart) {}
+
+    // The block record at nRecordPos, ending at nEnd, was found
+    void Found(uint64 nRecordPos, uint64 nEnd) { setPending.insert(nRecordPos); nScanned = std::max(nScanned, nEnd); }
+    void Done(uint64 nRecordPos) { setPending.erase(nRecordPos); }
+    uint64 GetWatermark() const { return setPending.empty() ? nScanned : *setPending.begin(); }
+};
+
+/** Imports all blocks stored in a list of files (-reindex, bootstrap.dat and -loadblock).
+ *
+ * The files are scanned IMPORT_SCAN_THREADS at a time, and the blocks found
+ * are checked (proof of work, merkle root, transactions) on a pool of worker
+ * threads, which is started once and kept for every list imported. The calling
+ * thread hands the blocks to ProcessBlock parents first. Blocks whose parent has
+ * not been imported yet wait in an index of their positions, and are read again
+ * from there if they had to be dropped from memory. Those whose parent is not
+ * in the files at all end up as orphans, like blocks received from a peer.
+ *
+ * While reindexing, the watermark of each block file is written to the block
+ * index along with the blocks, so an interrupted reindex does not skip any.
+ */
+class CBlockImporter
+{
+private:
+    CImportPipeline *ppipeline;
+    boost::thread_group *pthreadsCheck;
+
+    // no copying
+    CBlockImporter(const CBlockImporter&);
+    void operator=(const CBlockImporter&);
+
+public:
+    CBlockImporter();
+    ~CBlockImporter();
+
+    /** Import the blocks in vFiles. Returns the number of blocks added to the block index. */
+    int Import(const std::vector<CImportFile> &vFiles);
+};
+
+/** Import the blocks in vFiles with a CBlockImporter of its own */
+int ImportBlocks(const std::vector<CImportFile> &vFiles);
+
+#endif // BITCOIN_BLOCKIMPORT_H
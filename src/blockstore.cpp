@@ -0,0 +1,195 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+#include "main.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+CBlockFileMapCache blockfilemaps(DEFAULT_BLOCKFILE_MAPPINGS);
+
+CMappedFile::CMappedFile() : pdata(NULL), nSize(0)
+{
+#ifdef WIN32
+    hFile = INVALID_HANDLE_VALUE;
+    hMapping = NULL;
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+bool CMappedFile::Open(const boost::filesystem::path &path)
+{
+    Close();
+#ifdef WIN32
+    hFile = CreateFileA(path.string().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER nFileSize;
+    if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart == 0 || (uint64)nFileSize.QuadPart > (uint64)std::numeric_limits<size_t>::max()) {
+        Close();
+        return false;
+    }
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL) {
+        Close();
+        return false;
+    }
+    pdata = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pdata == NULL) {
+        Close();
+        return false;
+    }
+    nSize = (size_t)nFileSize.QuadPart;
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || (uint64)st.st_size > (uint64)std::numeric_limits<size_t>::max()) {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (p == MAP_FAILED)
+        return false;
+    pdata = (const char*)p;
+    nSize = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void CMappedFile::Close()
+{
+#ifdef WIN32
+    if (pdata)
+        UnmapViewOfFile(pdata);
+    if (hMapping)
+        CloseHandle(hMapping);
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+    hMapping = NULL;
+    hFile = INVALID_HANDLE_VALUE;
+#else
+    if (pdata)
+        munmap((void*)pdata, nSize);
+#endif
+    pdata = NULL;
+    nSize = 0;
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileMapCache::Get(char chType, int nFile)
+{
+    boost::shared_ptr<CMappedFile> pfile;
+    if (nMaxFiles == 0)
+        return pfile;
+
+    // Files still being written to may change under a mapping
+    {
+        LOCK(cs_LastBlockFile);
+        if (nFile >= nLastBlockFile)
+            return pfile;
+    }
+
+    LOCK(cs);
+    Key key(chType, nFile);
+    std::map<Key, list_type::iterator>::iterator mi = mapMapped.find(key);
+    if (mi != mapMapped.end()) {
+        listMapped.splice(listMapped.begin(), listMapped, (*mi).second);
+        return listMapped.front().second;
+    }
+
+    pfile.reset(new CMappedFile());
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", chType == 'b' ? "blk" : "rev", nFile);
+    if (!pfile->Open(path)) {
+        printf("CBlockFileMapCache::Get() : unable to map %s\n", path.string().c_str());
+        pfile.reset();
+        return pfile;
+    }
+
+    while (listMapped.size() >= nMaxFiles) {
+        mapMapped.erase(listMapped.back().first);
+        listMapped.pop_back();
+    }
+    listMapped.push_front(make_pair(key, pfile));
+    mapMapped[key] = listMapped.begin();
+    return pfile;
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileMapCache::MapRecord(const CDiskBlockPos &pos, char chType, unsigned int nTrailer, const char* &pbegin, const char* &pend)
+{
+    boost::shared_ptr<CMappedFile> pfile;
+    if (pos.IsNull() || pos.nPos < 8)
+        return pfile;
+    pfile = Get(chType, pos.nFile);
+    if (!pfile)
+        return pfile;
+
+    // Every record is preceded by the network magic and its size
+    if (pos.nPos > pfile->size() || memcmp(pfile->begin() + pos.nPos - 8, pchMessageStart, sizeof(pchMessageStart)) != 0) {
+        pfile.reset();
+        return pfile;
+    }
+    unsigned int nSize;
+    memcpy(&nSize, pfile->begin() + pos.nPos - 4, sizeof(nSize));
+    if (nSize > MAX_SIZE || (uint64)pos.nPos + nSize + nTrailer > pfile->size()) {
+        pfile.reset();
+        return pfile;
+    }
+
+    pbegin = pfile->begin() + pos.nPos;
+    pend = pbegin + nSize + nTrailer;
+    return pfile;
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileMapCache::MapBlock(const CDiskBlockPos &pos, const char* &pbegin, const char* &pend)
+{
+    return MapRecord(pos, 'b', 0, pbegin, pend);
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileMapCache::MapUndo(const CDiskBlockPos &pos, const char* &pbegin, const char* &pend)
+{
+    return MapRecord(pos, 'r', sizeof(uint256), pbegin, pend);
+}
+
+void CBlockFileMapCache::SetMaxFiles(unsigned int nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    while (listMapped.size() > nMaxFiles) {
+        mapMapped.erase(listMapped.back().first);
+        listMapped.pop_back();
+    }
+}
+
+void CBlockFileMapCache::Invalidate(int nFile)
+{
+    LOCK(cs);
+    for (int i = 0; i < 2; i++) {
+        std::map<Key, list_type::iterator>::iterator mi = mapMapped.find(Key(i == 0 ? 'b' : 'r', nFile));
+        if (mi != mapMapped.end()) {
+            listMapped.erase((*mi).second);
+            mapMapped.erase(mi);
+        }
+    }
+}
+
+void CBlockFileMapCache::Clear()
+{
+    LOCK(cs);
+    mapMapped.clear();
+    listMapped.clear();
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "sync.h"
+
+#include <limits>
+#include <list>
+#include <map>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+/** Default for -blockmaps, the number of block and undo file mappings kept open */
+static const unsigned int DEFAULT_BLOCKFILE_MAPPINGS = 8;
+
+/** Read-only memory mapping of a complete file */
+class CMappedFile
+{
+private:
+    const char* pdata;
+    size_t nSize;
+#ifdef WIN32
+    void* hFile;
+    void* hMapping;
+#endif
+
+    // no copying
+    CMappedFile(const CMappedFile&);
+    void operator=(const CMappedFile&);
+
+public:
+    CMappedFile();
+    ~CMappedFile();
+
+    bool Open(const boost::filesystem::path &path);
+    void Close();
+
+    bool IsOpen() const { return pdata != NULL; }
+    const char* begin() const { return pdata; }
+    const char* end() const { return pdata + nSize; }
+    size_t size() const { return nSize; }
+};
+
+/** Memory mappings of finalized block (blk?????.dat) and undo (rev?????.dat) files.
+ *
+ * Only files before nLastBlockFile are mapped, as their blocks are not
+ * appended to or truncated anymore. Undo data can still be appended to their
+ * rev files when a block stored there is connected, so FindUndoPos drops the
+ * mappings of the file it writes to. At most nMaxFiles mappings are kept
+ * open; the least recently used one is dropped when a new one is needed.
+ * Readers hold a reference to the mapping while deserializing from it, so
+ * eviction never pulls memory from under them.
+ */
+class CBlockFileMapCache
+{
+private:
+    typedef std::pair<char, int> Key; // ('b' or 'r', file number)
+    typedef std::list<std::pair<Key, boost::shared_ptr<CMappedFile> > > list_type;
+
+    CCriticalSection cs;
+    unsigned int nMaxFiles;
+    list_type listMapped; // most recently used first
+    std::map<Key, list_type::iterator> mapMapped;
+
+    boost::shared_ptr<CMappedFile> Get(char chType, int nFile);
+    boost::shared_ptr<CMappedFile> MapRecord(const CDiskBlockPos &pos, char chType, unsigned int nTrailer, const char* &pbegin, const char* &pend);
+
+public:
+    CBlockFileMapCache(unsigned int nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    void SetMaxFiles(unsigned int nMaxFilesIn);
+
+    /** Point [pbegin, pend) at the block stored at pos, valid while the returned mapping is held.
+     *  Returns NULL if it cannot be served from a mapping. */
+    boost::shared_ptr<CMappedFile> MapBlock(const CDiskBlockPos &pos, const char* &pbegin, const char* &pend);
+    /** As MapBlock, for the undo data stored at pos followed by its checksum */
+    boost::shared_ptr<CMappedFile> MapUndo(const CDiskBlockPos &pos, const char* &pbegin, const char* &pend);
+
+    /** Drop the mappings of block and undo file nFile (before it is modified or deleted) */
+    void Invalidate(int nFile);
+    void Clear();
+};
+
+extern CBlockFileMapCache blockfilemaps;
+
+#endif // BITCOIN_BLOCKSTORE_H
@@ -7,8 +7,12 @@
 
 #include <map>
 
+#include <boost/unordered_map.hpp>
+
 class uint256;
 class CBlockIndex;
+struct BlockHasher;
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
  * They are updated every release or three.
@@ -22,7 +26,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     double GuessVerificationProgress(CBlockIndex *pindex);
 }
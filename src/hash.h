@@ -124,4 +124,18 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4, a keyed 64-bit hash (see https://131002.net/siphash/) */
+class CSipHasher
+{
+private:
+    uint64 v[4];
+    uint64 tmp;
+    int count;
+
+public:
+    CSipHasher(uint64 k0, uint64 k1);
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    uint64 Finalize() const;
+};
+
 #endif
@@ -5,6 +5,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "txdb.h"
+#include "blockimport.h"
+#include "stratum.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
 #include "net.h"
@@ -88,6 +90,17 @@ bool ShutdownRequested()
 }
 
 static CCoinsViewDB *pcoinsdbview;
+static boost::thread *pthreadCompact = NULL;
+
+void StopCompactDatabases()
+{
+    if (pthreadCompact == NULL)
+        return;
+    pthreadCompact->interrupt();
+    pthreadCompact->join();
+    delete pthreadCompact;
+    pthreadCompact = NULL;
+}
 
 void Shutdown()
 {
@@ -99,22 +112,32 @@ void Shutdown()
     RenameThread("isracoin-shutoff");
     nTransactionsUpdated++;
     StopRPCThreads();
+    StopStratumServer();
     ShutdownRPCMining();
     if (pwalletMain)
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL);
     StopNode();
+    StopVerifyDB();
+    StopCompactDatabases();
+    if (GetBoolArg("-persistmempool", true))
+        DumpMempool();
     {
         LOCK(cs_main);
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-        if (pblocktree)
-            pblocktree->Flush();
-        if (pcoinsTip)
-            pcoinsTip->Flush();
+        bool fFlushed = false;
+        if (pblocktree && pcoinsTip) {
+            CValidationState state;
+            fFlushed = CommitChainState(state, true);
+        }
+        // Let the next startup skip -checkblocks verification
+        if (fFlushed && pblocktree && pcoinsTip && pindexBest && pcoinsTip->GetBestBlock() == pindexBest)
+            pblocktree->WriteVerifiedTip(pindexBest->GetBlockHash());
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
+        delete pblockfilterdb; pblockfilterdb = NULL;
     }
     if (pwalletMain)
         bitdb.Flush(true);
@@ -305,6 +328,11 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n" +
+        "  -dbopt=<db>:<opt>=<n>  " + _("Tune database <db> (chainstate, index or filter): blockcache and writebuffer (percent of its cache), maxopenfiles, bloombits, compression, compactionthreads or subcompactions") + "\n" +
+        "  -syncinterval=<n>      " + _("Commit new blocks and the chain state to disk at most every <n> milliseconds (default: 1000, 0 = every block)") + "\n" +
+        "  -syncbuffer=<n>        " + _("Commit early once <n> MiB of block data were written since the last commit (default: 16)") + "\n" +
+        "  -dbcompactionthreads=<n> " + _("Number of compactions each database runs at the same time (1-16, default: 2)") + "\n" +
+        "  -dbcompact             " + _("Compact the block index and coin databases once the initial block download is done (default: 1)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -328,6 +356,9 @@ std::string HelpMessage()
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
         "  -bloomfilters          " + _("Allow peers to set bloom filters (default: 1)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> MiB, evicting the lowest fee rates first (default: 300)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Drop transactions from the memory pool after <n> hours (default: 72)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and every 15 minutes, and load it on startup (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -371,8 +402,13 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of the outputs and inputs of every address (default: 0)") + "\n" +
+        "  -blockfilterindex      " + _("Maintain compact block filters (BIP158) and serve them to peers (default: 0)") + "\n" +
+        "  -blockmaps=<n>         " + _("Number of finalized block and undo files to keep memory mapped for reading (default: 8, 0 = disable)") + "\n" +
+        "  -prune=<n>             " + _("Reduce storage requirements by deleting old block and undo files, keeping at most <n> MiB of them (default: 0 = disabled, minimum: 550)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
+        "  -reindex-chainstate    " + _("Rebuild the chain state only, by reconnecting the indexed blocks from the blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
@@ -380,6 +416,13 @@ std::string HelpMessage()
         "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n" +
         "  -blockprioritysize=<n> "   + _("Set maximum size of high-priority/low-fee transactions in bytes (default: 27000)") + "\n" +
 
+        "\n" + _("Stratum mining server options:") + "\n" +
+        "  -stratum               "   + _("Accept Stratum mining connections (default: 0)") + "\n" +
+        "  -stratumport=<port>    "   + _("Listen for Stratum connections on <port> (default: 3333)") + "\n" +
+        "  -stratumbind=<addr>    "   + _("Bind the Stratum server to the given address. It has no authentication, so only bind to addresses reachable by trusted miners (default: 127.0.0.1)") + "\n" +
+        "  -stratumaddress=<addr> "   + _("Pay the blocks found through Stratum to <addr> (default: a new wallet key)") + "\n" +
+        "  -stratumdifficulty=<n> "   + _("Share difficulty new Stratum connections start at (default: 1)") + "\n" +
+
         "\n" + _("SSL options: (see the Isracoin Wiki for SSL setup instructions)") + "\n" +
         "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n" +
         "  -rpcsslcertificatechainfile=<file.cert>  " + _("Server certificate file (default: server.cert)") + "\n" +
@@ -406,19 +449,21 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("bitcoin-loadblk");
 
+    // The checker threads serve all imports below
+    CBlockImporter importer;
+
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
+        std::vector<CImportFile> vBlockFiles;
         while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
+            int nFile = vBlockFiles.size();
+            filesystem::path pathBlockFile = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+            if (!filesystem::exists(pathBlockFile))
                 break;
-            printf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
+            vBlockFiles.push_back(CImportFile(pathBlockFile, nFile));
         }
+        importer.Import(vBlockFiles);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         printf("Reindexing finished\n");
@@ -426,27 +471,59 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         InitBlockIndex();
     }
 
+    // Connect the best indexed chain where the chain state lags behind it: after
+    // -reindex-chainstate, or when an earlier attempt at that was interrupted
+    {
+        CImportingNow imp;
+        CValidationState state;
+        if (!ReconnectBestChain(state))
+            printf("ThreadImport() : reconnecting the best chain failed\n");
+    }
+
     // hardcoded $DATADIR/bootstrap.dat
     filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
     if (filesystem::exists(pathBootstrap)) {
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            CImportingNow imp;
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            printf("Importing bootstrap.dat...\n");
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
-        }
+        CImportingNow imp;
+        filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+        importer.Import(std::vector<CImportFile>(1, CImportFile(pathBootstrap)));
+        RenameOver(pathBootstrap, pathBootstrapOld);
     }
 
     // -loadblock=
-    BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
-        FILE *file = fopen(path.string().c_str(), "rb");
-        if (file) {
-            CImportingNow imp;
-            printf("Importing %s...\n", path.string().c_str());
-            LoadExternalBlockFile(file);
+    if (!vImportFiles.empty()) {
+        CImportingNow imp;
+        std::vector<CImportFile> vFiles;
+        BOOST_FOREACH(boost::filesystem::path &path, vImportFiles)
+            vFiles.push_back(CImportFile(path));
+        importer.Import(vFiles);
+    }
+
+    // Reload the memory pool once the chain it builds on is in place
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
+}
+
+// The initial block download leaves the databases with many overlapping
+// files; compact them once it is done, while the node keeps running
+void ThreadCompactDatabases()
+{
+    RenameThread("isracoin-compact");
+    try {
+        while (true) {
+            {
+                LOCK(cs_main);
+                if (!IsInitialBlockDownload())
+                    break;
+            }
+            MilliSleep(10000);
         }
+        printf("Compacting databases after the initial block download\n");
+        pblocktree->Compact();
+        pcoinsdbview->Compact();
+    } catch (boost::thread_interrupted&) {
+        printf("ThreadCompactDatabases() : interrupted\n");
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadCompactDatabases()");
     }
 }
 
@@ -511,6 +588,31 @@ bool AppInit2(boost::thread_group& threadGroup)
     fBloomFilters = GetBoolArg("-bloomfilters", true);
     if (fBloomFilters)
         nLocalServices |= NODE_BLOOM;
+    if (GetBoolArg("-blockfilterindex", false))
+        nLocalServices |= NODE_COMPACT_FILTERS;
+
+    nSyncInterval = std::max((int64)0, GetArg("-syncinterval", DEFAULT_SYNC_INTERVAL));
+    nSyncBuffer = (uint64)std::max((int64)0, GetArg("-syncbuffer", DEFAULT_SYNC_BUFFER)) << 20;
+
+    int64 nMaxMempoolArg = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE);
+    if (nMaxMempoolArg < 5)
+        return InitError(_("The memory pool cannot be limited to less than 5 MiB."));
+    nMaxMempoolSize = (uint64)nMaxMempoolArg << 20;
+    nMempoolExpiry = std::max((int64)1, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY)) * 60 * 60;
+
+    int64 nPruneArg = GetArg("-prune", 0);
+    if (nPruneArg < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64)nPruneArg << 20;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB. Please use a higher number."), (int)(MIN_DISK_SPACE_FOR_BLOCK_FILES >> 20)));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        fPruneMode = true;
+        // We cannot serve the full block chain to other nodes anymore
+        nLocalServices &= ~NODE_NETWORK;
+    }
 
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
@@ -829,6 +931,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     // ********************************************************* Step 7: load block chain
 
     fReindex = GetBoolArg("-reindex");
+    bool fReindexChainState = GetBoolArg("-reindex-chainstate");
 
     // Upgrading to 0.8; hard-link the old blknnnn.dat files into /blocks/
     filesystem::path blocksDir = GetDataDir() / "blocks";
@@ -862,13 +965,20 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nTotalCache < (1 << 22))
         nTotalCache = (1 << 22); // total cache cannot be less than 4 MiB
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addressindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nBlockFilterDBCache = 0;
+    if (GetBoolArg("-blockfilterindex", false)) {
+        nBlockFilterDBCache = std::min(nTotalCache / 8, (size_t)(1 << 24)); // at most 16 MiB; filters are mostly read once
+        nTotalCache -= nBlockFilterDBCache;
+    }
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
 
+    blockfilemaps.SetMaxFiles(std::max((int64)0, GetArg("-blockmaps", DEFAULT_BLOCKFILE_MAPPINGS)));
+
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
@@ -883,9 +993,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsTip;
                 delete pcoinsdbview;
                 delete pblocktree;
+                delete pblockfilterdb; pblockfilterdb = NULL;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                if (GetBoolArg("-blockfilterindex", false))
+                    pblockfilterdb = new CBlockFilterDB(nBlockFilterDBCache, false, fReindex);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
 
                 if (fReindex)
@@ -913,12 +1026,46 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                uiInterface.InitMessage(_("Verifying blocks..."));
-                if (!VerifyDB(GetArg("-checklevel", 3),
-                              GetArg( "-checkblocks", 288))) {
-                    strLoadError = _("Corrupted block database detected");
+                // Check for changed -addressindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+
+                // Check for changed -blockfilterindex state
+                if (fBlockFilterIndex != GetBoolArg("-blockfilterindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -blockfilterindex");
+                    break;
+                }
+
+                // Rebuilding the chain state needs every block of the chain
+                if (fReindexChainState && fHavePruned) {
+                    strLoadError = _("Block files have been pruned, the chain state cannot be rebuilt from them; use -reindex instead");
+                    break;
+                }
+
+                // Pruned block files cannot be brought back without downloading them again
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode. This will redownload the entire block chain");
                     break;
                 }
+
+                // After a clean shutdown the tip was recorded; blocks below it were
+                // verified before or connected in full, so there is nothing to redo
+                // unless the checks are asked for explicitly
+                uint256 hashVerifiedTip;
+                bool fVerified = pblocktree->ReadVerifiedTip(hashVerifiedTip) && pindexBest && hashVerifiedTip == pindexBest->GetBlockHash();
+                pblocktree->EraseVerifiedTip();
+                if (fVerified && !mapArgs.count("-checkblocks") && !mapArgs.count("-checklevel")) {
+                    printf("Best block %s was verified before the last clean shutdown, skipping verification\n", hashVerifiedTip.ToString().c_str());
+                } else {
+                    uiInterface.InitMessage(_("Verifying blocks..."));
+                    if (!VerifyDB(GetArg("-checklevel", 3),
+                                  GetArg( "-checkblocks", 288))) {
+                        strLoadError = _("Corrupted block database detected");
+                        break;
+                    }
+                }
             } catch(std::exception &e) {
                 strLoadError = _("Error opening block database");
                 break;
@@ -965,7 +1112,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1068,6 +1215,15 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
         if (pindexBest && pindexBest != pindexRescan)
         {
+            // The rescan needs every block from pindexRescan on
+            if (fHavePruned) {
+                CBlockIndex *pindex = pindexBest;
+                while (pindex && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA) && pindex != pindexRescan)
+                    pindex = pindex->pprev;
+                if (pindex != pindexRescan)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole block chain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -1085,6 +1241,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!ConnectBestBlock(state))
         strErrors << "Failed to connect best block";
 
+    // The address index is written ahead of the coin database, and connecting the best chain
+    // replays the blocks it got ahead by. If that chain does not pass its tip, it is out of step.
+    uint256 hashAddressTip;
+    if (fAddressIndex && pblocktree->ReadAddressIndexTip(hashAddressTip)) {
+        BlockMap::iterator mi = mapBlockIndex.find(hashAddressTip);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            return InitError(_("The address index does not match the block chain. Restart with -reindex to rebuild it."));
+    }
+
     std::vector<boost::filesystem::path> vImportFiles;
     if (mapArgs.count("-loadblock"))
     {
@@ -1092,6 +1257,17 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (nSyncInterval > 0)
+        threadGroup.create_thread(&ThreadCommitChainState);
+    if (GetBoolArg("-persistmempool", true))
+        threadGroup.create_thread(boost::bind(&LoopForever<bool (*)()>, "dumpmempool", &DumpMempool, MEMPOOL_DUMP_INTERVAL * 1000));
+
+    // Only a node that starts out syncing has anything worth compacting
+    if (GetBoolArg("-dbcompact", true)) {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            pthreadCompact = new boost::thread(&ThreadCompactDatabases);
+    }
 
     // ********************************************************* Step 10: load peers
 
@@ -1132,6 +1308,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    if (GetBoolArg("-stratum", false)) {
+        std::string strError;
+        if (!StartStratumServer(strError))
+            return InitError(strError);
+    }
+
     // Generate coins in the background
     if (pwalletMain)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
@@ -12,6 +12,11 @@
 #include <memenv/memenv.h>
 
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include <set>
+#include <sstream>
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     if (status.ok())
@@ -25,23 +30,86 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+void CLatencyHistogram::Add(int64 nMicros) {
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && nMicros >= ((int64)1 << nBucket))
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotalMicros += nMicros;
+}
+
+CLevelDBProfile GetLevelDBProfile(const std::string &strName) {
+    CLevelDBProfile profile;
+    profile.nCompactionThreads = std::max(1, std::min(16, (int)GetArg("-dbcompactionthreads", DEFAULT_DB_COMPACTION_THREADS)));
+    profile.nSubcompactions = profile.nCompactionThreads;
+
+    // -dbopt=<name>:<option>=<value>
+    BOOST_FOREACH(const std::string &strOpt, mapMultiArgs["-dbopt"]) {
+        size_t nColon = strOpt.find(':');
+        size_t nEquals = strOpt.find('=', nColon);
+        if (nColon == std::string::npos || nEquals == std::string::npos) {
+            printf("Ignoring malformed -dbopt=%s\n", strOpt.c_str());
+            continue;
+        }
+        if (strOpt.substr(0, nColon) != strName)
+            continue;
+        std::string strKey = strOpt.substr(nColon + 1, nEquals - nColon - 1);
+        int nValue = atoi(strOpt.substr(nEquals + 1));
+        if (strKey == "blockcache")
+            profile.nBlockCachePercent = std::max(1, std::min(100, nValue));
+        else if (strKey == "writebuffer")
+            profile.nWriteBufferPercent = std::max(1, std::min(100, nValue));
+        else if (strKey == "maxopenfiles")
+            profile.nMaxOpenFiles = std::max(16, nValue);
+        else if (strKey == "bloombits")
+            profile.nBloomBits = std::max(0, nValue);
+        else if (strKey == "compression")
+            profile.fCompression = nValue != 0;
+        else if (strKey == "compactionthreads")
+            profile.nCompactionThreads = std::max(1, std::min(16, nValue));
+        else if (strKey == "subcompactions")
+            profile.nSubcompactions = std::max(1, std::min(16, nValue));
+        else
+            printf("Ignoring unknown -dbopt=%s\n", strOpt.c_str());
+    }
+    return profile;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile &profile) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize * profile.nBlockCachePercent / 100);
+    options.write_buffer_size = nCacheSize * profile.nWriteBufferPercent / 100; // up to two write buffers may be held in memory simultaneously
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = profile.nMaxOpenFiles;
+    options.max_background_compactions = profile.nCompactionThreads;
+    options.max_subcompactions = profile.nSubcompactions;
     return options;
 }
 
+// All open databases, for GetLevelDBStats
+static boost::mutex &GetOpenDBsMutex() {
+    static boost::mutex mutex;
+    return mutex;
+}
+
+static std::set<CLevelDB*> &GetOpenDBs() {
+    static std::set<CLevelDB*> setOpenDBs;
+    return setOpenDBs;
+}
+
 CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    strName = path.filename().string();
+    strPath = path.string();
+    profile = GetLevelDBProfile(strName);
+    options = GetOptions(nCacheSize, profile);
+    nBlockCacheSize = nCacheSize * profile.nBlockCachePercent / 100;
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -58,9 +126,16 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
     if (!status.ok())
         throw std::runtime_error(strprintf("CLevelDB(): error opening database environment %s", status.ToString().c_str()));
     printf("Opened LevelDB successfully\n");
+
+    boost::mutex::scoped_lock lock(GetOpenDBsMutex());
+    GetOpenDBs().insert(this);
 }
 
 CLevelDB::~CLevelDB() {
+    {
+        boost::mutex::scoped_lock lock(GetOpenDBsMutex());
+        GetOpenDBs().erase(this);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -71,8 +146,23 @@ CLevelDB::~CLevelDB() {
     options.env = NULL;
 }
 
+leveldb::Status CLevelDB::Get(const leveldb::Slice &slKey, std::string *pstrValue) {
+    int64 nStart = GetTimeMicros();
+    leveldb::Status status = pdb->Get(readoptions, slKey, pstrValue);
+    int64 nTime = GetTimeMicros() - nStart;
+    boost::mutex::scoped_lock lock(mutexStats);
+    histRead.Add(nTime);
+    return status;
+}
+
 bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
+    int64 nStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    int64 nTime = GetTimeMicros() - nStart;
+    {
+        boost::mutex::scoped_lock lock(mutexStats);
+        histWrite.Add(nTime);
+    }
     if (!status.ok()) {
         printf("LevelDB write failure: %s\n", status.ToString().c_str());
         HandleError(status);
@@ -80,3 +170,84 @@ bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error)
     }
     return true;
 }
+
+CLevelDBStats CLevelDB::GetStats() {
+    CLevelDBStats stats;
+    stats.strName = strName;
+    stats.strPath = strPath;
+    stats.profile = profile;
+    stats.nBlockCacheSize = nBlockCacheSize;
+    stats.nWriteBufferSize = options.write_buffer_size;
+    pdb->GetProperty("leveldb.stats", &stats.strStats);
+    pdb->GetProperty("leveldb.sstables", &stats.strSSTables);
+
+    leveldb::Range range("", "\xff\xff\xff\xff");
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    stats.nApproximateSize = nSize;
+
+    // The table below the "Compactions" header of leveldb.stats:
+    // Level  Files Size(MB) Time(sec) Read(MB) Write(MB)
+    std::istringstream ss(stats.strStats);
+    std::string strLine;
+    while (std::getline(ss, strLine)) {
+        CLevelDBLevelStats level;
+        if (sscanf(strLine.c_str(), "%d %d %lf %lf %lf %lf", &level.nLevel, &level.nFiles, &level.dSizeMB,
+                   &level.dCompactionSeconds, &level.dCompactionReadMB, &level.dCompactionWriteMB) == 6)
+            stats.vLevels.push_back(level);
+    }
+
+    boost::mutex::scoped_lock lock(mutexStats);
+    stats.histRead = histRead;
+    stats.histWrite = histWrite;
+    return stats;
+}
+
+// Key ranges larger than this are split by their second byte when compacting
+static const uint64_t COMPACT_RANGE_SIZE = 32 << 20;
+
+static uint64_t GetApproximateSize(leveldb::DB *pdb, const std::string &strBegin, const std::string &strEnd) {
+    leveldb::Range range(strBegin, strEnd.empty() ? "\xff\xff\xff\xff" : strEnd);
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
+void CLevelDB::Compact() {
+    int64 nStart = GetTimeMillis();
+
+    // [begin, end) ranges, an empty end for the end of the key space
+    std::vector<std::pair<std::string, std::string> > vRanges;
+    for (int nFirst = 0; nFirst < 256; nFirst++) {
+        std::string strBegin(1, (char)nFirst);
+        std::string strEnd = nFirst < 255 ? std::string(1, (char)(nFirst + 1)) : std::string();
+        uint64_t nSize = GetApproximateSize(pdb, strBegin, strEnd);
+        if (nSize == 0)
+            continue;
+        if (nSize <= COMPACT_RANGE_SIZE) {
+            vRanges.push_back(std::make_pair(strBegin, strEnd));
+            continue;
+        }
+        for (int nSecond = 0; nSecond < 256; nSecond++) {
+            std::string strSubBegin = nSecond > 0 ? strBegin + (char)nSecond : strBegin;
+            std::string strSubEnd = nSecond < 255 ? strBegin + (char)(nSecond + 1) : strEnd;
+            if (GetApproximateSize(pdb, strSubBegin, strSubEnd) > 0)
+                vRanges.push_back(std::make_pair(strSubBegin, strSubEnd));
+        }
+    }
+
+    for (unsigned int i = 0; i < vRanges.size(); i++) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slBegin(vRanges[i].first), slEnd(vRanges[i].second);
+        pdb->CompactRange(&slBegin, vRanges[i].second.empty() ? NULL : &slEnd);
+    }
+    printf("Compacted LevelDB in %s (%u key ranges) in %"PRI64d"ms\n", strPath.c_str(), (unsigned int)vRanges.size(), GetTimeMillis() - nStart);
+}
+
+std::vector<CLevelDBStats> GetLevelDBStats() {
+    std::vector<CLevelDBStats> vStats;
+    boost::mutex::scoped_lock lock(GetOpenDBsMutex());
+    BOOST_FOREACH(CLevelDB *pdb, GetOpenDBs())
+        vStats.push_back(pdb->GetStats());
+    return vStats;
+}
@@ -11,6 +11,7 @@
 #include <leveldb/write_batch.h>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
 
 class leveldb_error : public std::runtime_error
 {
@@ -20,6 +21,76 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+/** Tuning of a database. Each database starts from the defaults of its profile,
+ *  which can be changed with -dbopt=<name>:<option>=<value> (see GetLevelDBProfile) */
+struct CLevelDBProfile
+{
+    int nBlockCachePercent;  // share of the database's cache size used for the block cache
+    int nWriteBufferPercent; // share used for each write buffer (two may be held at once)
+    int nMaxOpenFiles;
+    int nBloomBits;          // bits per key of the bloom filter, 0 for none
+    bool fCompression;
+    int nCompactionThreads;  // compactions of disjoint key ranges run at the same time
+    int nSubcompactions;     // threads a single large compaction is split over
+
+    CLevelDBProfile() : nBlockCachePercent(50), nWriteBufferPercent(25), nMaxOpenFiles(64), nBloomBits(10), fCompression(false), nCompactionThreads(1), nSubcompactions(1) {}
+};
+
+/** Default for -dbcompactionthreads */
+static const int DEFAULT_DB_COMPACTION_THREADS = 2;
+
+/** Get the profile of the database named strName (the last component of its path) */
+CLevelDBProfile GetLevelDBProfile(const std::string &strName);
+
+/** Counts operations by duration: bucket i holds those that took less than 2^i
+ *  microseconds and at least half that, the last one all that took longer */
+class CLatencyHistogram
+{
+public:
+    static const int BUCKETS = 24;
+
+    uint64 nCount;
+    uint64 nTotalMicros;
+    uint64 vBuckets[BUCKETS];
+
+    CLatencyHistogram() : nCount(0), nTotalMicros(0) {
+        for (int i = 0; i < BUCKETS; i++)
+            vBuckets[i] = 0;
+    }
+
+    void Add(int64 nMicros);
+};
+
+/** Compaction statistics LevelDB keeps for one level */
+struct CLevelDBLevelStats
+{
+    int nLevel;
+    int nFiles;
+    double dSizeMB;
+    double dCompactionSeconds;
+    double dCompactionReadMB;
+    double dCompactionWriteMB;
+};
+
+/** Snapshot of the settings, internals and metrics of an open database */
+struct CLevelDBStats
+{
+    std::string strName;
+    std::string strPath;
+    CLevelDBProfile profile;
+    size_t nBlockCacheSize;
+    size_t nWriteBufferSize;
+    std::string strStats;    // leveldb.stats property
+    std::string strSSTables; // leveldb.sstables property
+    uint64 nApproximateSize;
+    std::vector<CLevelDBLevelStats> vLevels;
+    CLatencyHistogram histRead;
+    CLatencyHistogram histWrite;
+};
+
+/** Stats of all databases currently open */
+std::vector<CLevelDBStats> GetLevelDBStats();
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -77,6 +148,18 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    std::string strName;
+    std::string strPath;
+    CLevelDBProfile profile;
+    size_t nBlockCacheSize;
+
+    // timings of Read/Exists and WriteBatch
+    boost::mutex mutexStats;
+    CLatencyHistogram histRead;
+    CLatencyHistogram histWrite;
+
+    leveldb::Status Get(const leveldb::Slice &slKey, std::string *pstrValue);
+
 public:
     CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
     ~CLevelDB();
@@ -88,7 +171,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = Get(slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -96,7 +179,7 @@ public:
             HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CBufferReader ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch(std::exception &e) {
             return false;
@@ -117,7 +200,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = Get(slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -149,6 +232,12 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    CLevelDBStats GetStats();
+
+    /** Compact the whole database, one key prefix at a time so that it can be
+     *  interrupted between ranges. Reads and writes may continue meanwhile. */
+    void Compact();
 };
 
 #endif // BITCOIN_LEVELDB_H
@@ -71,16 +71,35 @@ struct DBImpl::CompactionState {
 
   uint64_t total_bytes;
 
+  // User key range [*begin,*end) handled by this state; NULL means
+  // unbounded.  Set when a compaction is split over several threads.
+  const std::string* begin;
+  const std::string* end;
+
+  // Micros spent compacting imm_ in the middle of the compaction
+  int64_t imm_micros;
+
   Output* current_output() { return &outputs[outputs.size()-1]; }
 
   explicit CompactionState(Compaction* c)
       : compaction(c),
         outfile(NULL),
         builder(NULL),
-        total_bytes(0) {
+        total_bytes(0),
+        begin(NULL),
+        end(NULL),
+        imm_micros(0) {
   }
 };
 
+// A key range of a compaction that is compacted by its own thread
+struct DBImpl::SubcompactionJob {
+  DBImpl* db;
+  CompactionState* state;
+  Status status;
+  bool done;
+};
+
 // Fix user-supplied options to be reasonable
 template <class T,class V>
 static void ClipToRange(T* ptr, V minvalue, V maxvalue) {
@@ -97,6 +116,8 @@ Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.max_open_files,    64 + kNumNonTableCacheFiles, 50000);
   ClipToRange(&result.write_buffer_size, 64<<10,                      1<<30);
   ClipToRange(&result.block_size,        1<<10,                       4<<20);
+  ClipToRange(&result.max_background_compactions, 1,                  64);
+  ClipToRange(&result.max_subcompactions, 1,                          64);
   if (result.info_log == NULL) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -132,7 +153,11 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       log_(NULL),
       seed_(0),
       tmp_batch_(new WriteBatch),
-      bg_compaction_scheduled_(false),
+      bg_compaction_scheduled_(0),
+      bg_compaction_queued_(false),
+      bg_memtable_compacting_(false),
+      pending_imm_output_(false),
+      manifest_writing_(false),
       manual_compaction_(NULL) {
   mem_->Ref();
   has_imm_.Release_Store(NULL);
@@ -143,13 +168,15 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
 
   versions_ = new VersionSet(dbname_, &options_, table_cache_,
                              &internal_comparator_);
+
+  env_->SetBackgroundThreads(options_.max_background_compactions);
 }
 
 DBImpl::~DBImpl() {
   // Wait for background work to finish
   mutex_.Lock();
   shutting_down_.Release_Store(this);  // Any non-NULL value is ok
-  while (bg_compaction_scheduled_) {
+  while (bg_compaction_scheduled_ > 0) {
     bg_cv_.Wait();
   }
   mutex_.Unlock();
@@ -432,7 +459,9 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
     }
 
     if (mem->ApproximateMemoryUsage() > options_.write_buffer_size) {
-      status = WriteLevel0Table(mem, edit, NULL);
+      uint64_t number;
+      status = WriteLevel0Table(mem, edit, NULL, &number);
+      pending_outputs_.erase(number);
       if (!status.ok()) {
         // Reflect errors immediately so that conditions like full
         // file-systems cause the DB::Open() to fail.
@@ -444,7 +473,9 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
   }
 
   if (status.ok() && mem != NULL) {
-    status = WriteLevel0Table(mem, edit, NULL);
+    uint64_t number;
+    status = WriteLevel0Table(mem, edit, NULL, &number);
+    pending_outputs_.erase(number);
     // Reflect errors immediately so that conditions like full
     // file-systems cause the DB::Open() to fail.
   }
@@ -455,12 +486,13 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
 }
 
 Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
-                                Version* base) {
+                                Version* base, uint64_t* number) {
   mutex_.AssertHeld();
   const uint64_t start_micros = env_->NowMicros();
   FileMetaData meta;
   meta.number = versions_->NewFileNumber();
   pending_outputs_.insert(meta.number);
+  *number = meta.number;
   Iterator* iter = mem->NewIterator();
   Log(options_.info_log, "Level-0 table #%llu: started",
       (unsigned long long) meta.number);
@@ -477,8 +509,6 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
       (unsigned long long) meta.file_size,
       s.ToString().c_str());
   delete iter;
-  pending_outputs_.erase(meta.number);
-
 
   // Note that if file_size is zero, the file has been deleted and
   // should not be added to the manifest.
@@ -486,8 +516,11 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
   if (s.ok() && meta.file_size > 0) {
     const Slice min_user_key = meta.smallest.user_key();
     const Slice max_user_key = meta.largest.user_key();
-    if (base != NULL) {
+    // The output of a running compaction may span a key range that has
+    // no files yet, so only move the table up while none is running.
+    if (base != NULL && versions_->NumRunningCompactions() == 0) {
       level = base->PickLevelForMemTableOutput(min_user_key, max_user_key);
+      pending_imm_output_ = (level > 0);
     }
     edit->AddFile(level, meta.number, meta.file_size,
                   meta.smallest, meta.largest);
@@ -503,12 +536,21 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
 void DBImpl::CompactMemTable() {
   mutex_.AssertHeld();
   assert(imm_ != NULL);
+  if (bg_memtable_compacting_) {
+    // Another thread is already writing imm_
+    return;
+  }
+  bg_memtable_compacting_ = true;
+
+  // Other threads may compact levels meanwhile
+  MaybeScheduleCompaction();
 
   // Save the contents of the memtable as a new Table
   VersionEdit edit;
   Version* base = versions_->current();
   base->Ref();
-  Status s = WriteLevel0Table(imm_, &edit, base);
+  uint64_t number;
+  Status s = WriteLevel0Table(imm_, &edit, base, &number);
   base->Unref();
 
   if (s.ok() && shutting_down_.Acquire_Load()) {
@@ -519,8 +561,11 @@ void DBImpl::CompactMemTable() {
   if (s.ok()) {
     edit.SetPrevLogNumber(0);
     edit.SetLogNumber(logfile_number_);  // Earlier logs no longer needed
-    s = versions_->LogAndApply(&edit, &mutex_);
+    s = LogAndApply(&edit);
   }
+  pending_outputs_.erase(number);
+  pending_imm_output_ = false;
+  bg_memtable_compacting_ = false;
 
   if (s.ok()) {
     // Commit to the new state
@@ -611,20 +656,47 @@ void DBImpl::RecordBackgroundError(const Status& s) {
   }
 }
 
+Status DBImpl::LogAndApply(VersionEdit* edit) {
+  mutex_.AssertHeld();
+  while (manifest_writing_) {
+    bg_cv_.Wait();
+  }
+  manifest_writing_ = true;
+  Status s = versions_->LogAndApply(edit, &mutex_);
+  manifest_writing_ = false;
+  bg_cv_.SignalAll();
+  return s;
+}
+
+bool DBImpl::HasBackgroundWork() {
+  mutex_.AssertHeld();
+  if (imm_ != NULL && !bg_memtable_compacting_) {
+    return true;
+  } else if (pending_imm_output_) {
+    return false;
+  } else if (manual_compaction_ != NULL) {
+    // Manual compactions wait for the running compactions to finish
+    return versions_->NumRunningCompactions() == 0;
+  } else {
+    return versions_->NeedsCompaction();
+  }
+}
+
 void DBImpl::MaybeScheduleCompaction() {
   mutex_.AssertHeld();
-  if (bg_compaction_scheduled_) {
-    // Already scheduled
+  if (bg_compaction_queued_) {
+    // Already scheduled; the call will schedule another if needed
+  } else if (bg_compaction_scheduled_ >= options_.max_background_compactions) {
+    // All background threads are busy
   } else if (shutting_down_.Acquire_Load()) {
     // DB is being deleted; no more background compactions
   } else if (!bg_error_.ok()) {
     // Already got an error; no more changes
-  } else if (imm_ == NULL &&
-             manual_compaction_ == NULL &&
-             !versions_->NeedsCompaction()) {
+  } else if (!HasBackgroundWork()) {
     // No work to be done
   } else {
-    bg_compaction_scheduled_ = true;
+    bg_compaction_queued_ = true;
+    bg_compaction_scheduled_++;
     env_->Schedule(&DBImpl::BGWork, this);
   }
 }
@@ -635,7 +707,8 @@ void DBImpl::BGWork(void* db) {
 
 void DBImpl::BackgroundCall() {
   MutexLock l(&mutex_);
-  assert(bg_compaction_scheduled_);
+  assert(bg_compaction_scheduled_ > 0);
+  bg_compaction_queued_ = false;
   if (shutting_down_.Acquire_Load()) {
     // No more background work when shutting down.
   } else if (!bg_error_.ok()) {
@@ -644,7 +717,7 @@ void DBImpl::BackgroundCall() {
     BackgroundCompaction();
   }
 
-  bg_compaction_scheduled_ = false;
+  bg_compaction_scheduled_--;
 
   // Previous compaction may have produced too many files in a level,
   // so reschedule another compaction if needed.
@@ -655,15 +728,22 @@ void DBImpl::BackgroundCall() {
 void DBImpl::BackgroundCompaction() {
   mutex_.AssertHeld();
 
-  if (imm_ != NULL) {
+  if (imm_ != NULL && !bg_memtable_compacting_) {
     CompactMemTable();
     return;
   }
+  if (pending_imm_output_) {
+    return;
+  }
 
   Compaction* c;
   bool is_manual = (manual_compaction_ != NULL);
   InternalKey manual_end;
   if (is_manual) {
+    if (versions_->NumRunningCompactions() > 0) {
+      // Picked up again once the running compactions are done
+      return;
+    }
     ManualCompaction* m = manual_compaction_;
     c = versions_->CompactRange(m->level, m->begin, m->end);
     m->done = (c == NULL);
@@ -680,6 +760,11 @@ void DBImpl::BackgroundCompaction() {
     c = versions_->PickCompaction();
   }
 
+  if (c != NULL) {
+    // Let another thread pick the next compaction
+    MaybeScheduleCompaction();
+  }
+
   Status status;
   if (c == NULL) {
     // Nothing to do
@@ -690,7 +775,7 @@ void DBImpl::BackgroundCompaction() {
     c->edit()->DeleteFile(c->level(), f->number);
     c->edit()->AddFile(c->level() + 1, f->number, f->file_size,
                        f->smallest, f->largest);
-    status = versions_->LogAndApply(c->edit(), &mutex_);
+    status = LogAndApply(c->edit());
     if (!status.ok()) {
       RecordBackgroundError(status);
     }
@@ -701,6 +786,7 @@ void DBImpl::BackgroundCompaction() {
         static_cast<unsigned long long>(f->file_size),
         status.ToString().c_str(),
         versions_->LevelSummary(&tmp));
+    versions_->ReleaseCompaction(c);
   } else {
     CompactionState* compact = new CompactionState(c);
     status = DoCompactionWork(compact);
@@ -708,6 +794,8 @@ void DBImpl::BackgroundCompaction() {
       RecordBackgroundError(status);
     }
     CleanupCompaction(compact);
+    // Clear the busy flags while the input version still holds the files
+    versions_->ReleaseCompaction(c);
     c->ReleaseInputs();
     DeleteObsoleteFiles();
   }
@@ -849,33 +937,74 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact) {
         level + 1,
         out.number, out.file_size, out.smallest, out.largest);
   }
-  return versions_->LogAndApply(compact->compaction->edit(), &mutex_);
+  return LogAndApply(compact->compaction->edit());
 }
 
-Status DBImpl::DoCompactionWork(CompactionState* compact) {
-  const uint64_t start_micros = env_->NowMicros();
-  int64_t imm_micros = 0;  // Micros spent doing imm_ compactions
+namespace {
+struct UserKeyLess {
+  const Comparator* cmp;
+  explicit UserKeyLess(const Comparator* c) : cmp(c) { }
+  bool operator()(const Slice& a, const Slice& b) const {
+    return cmp->Compare(a, b) < 0;
+  }
+};
+}  // namespace
 
-  Log(options_.info_log,  "Compacting %d@%d + %d@%d files",
-      compact->compaction->num_input_files(0),
-      compact->compaction->level(),
-      compact->compaction->num_input_files(1),
-      compact->compaction->level() + 1);
+void DBImpl::GetSubcompactionBoundaries(Compaction* c,
+                                        std::vector<std::string>* boundaries) {
+  boundaries->clear();
+  if (options_.max_subcompactions <= 1) {
+    return;
+  }
 
-  assert(versions_->NumLevelFiles(compact->compaction->level()) > 0);
-  assert(compact->builder == NULL);
-  assert(compact->outfile == NULL);
-  if (snapshots_.empty()) {
-    compact->smallest_snapshot = versions_->LastSequence();
-  } else {
-    compact->smallest_snapshot = snapshots_.oldest()->number_;
+  // Input files end the ranges, so that each range reads roughly the
+  // same number of files
+  uint64_t total_bytes = 0;
+  std::vector<Slice> keys;
+  for (int which = 0; which < 2; which++) {
+    for (int i = 0; i < c->num_input_files(which); i++) {
+      total_bytes += c->input(which, i)->file_size;
+      keys.push_back(c->input(which, i)->largest.user_key());
+    }
+  }
+  if (total_bytes < 4 * c->MaxOutputFileSize()) {
+    // Not worth the threads
+    return;
+  }
+  std::sort(keys.begin(), keys.end(), UserKeyLess(user_comparator()));
+  size_t n = 0;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (n == 0 || user_comparator()->Compare(keys[i], keys[n - 1]) != 0) {
+      keys[n++] = keys[i];
+    }
   }
+  keys.resize(n);
 
-  // Release mutex while we're actually doing the compaction work
-  mutex_.Unlock();
+  const size_t ranges = std::min(static_cast<size_t>(options_.max_subcompactions), n);
+  for (size_t i = 1; i < ranges; i++) {
+    // Range i starts at the largest key of the last file of range i-1
+    boundaries->push_back(keys[i * n / ranges - 1].ToString());
+  }
+}
 
+void DBImpl::BGSubcompaction(void* arg) {
+  SubcompactionJob* job = reinterpret_cast<SubcompactionJob*>(arg);
+  DBImpl* db = job->db;
+  Status s = db->DoSubcompactionWork(job->state);
+  MutexLock l(&db->mutex_);
+  job->status = s;
+  job->done = true;
+  db->bg_cv_.SignalAll();
+}
+
+Status DBImpl::DoSubcompactionWork(CompactionState* compact) {
   Iterator* input = versions_->MakeInputIterator(compact->compaction);
-  input->SeekToFirst();
+  if (compact->begin != NULL) {
+    InternalKey start(*compact->begin, kMaxSequenceNumber, kValueTypeForSeek);
+    input->Seek(start.Encode());
+  } else {
+    input->SeekToFirst();
+  }
   Status status;
   ParsedInternalKey ikey;
   std::string current_user_key;
@@ -891,10 +1020,16 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
       }
       mutex_.Unlock();
-      imm_micros += (env_->NowMicros() - imm_start);
+      compact->imm_micros += (env_->NowMicros() - imm_start);
     }
 
     Slice key = input->key();
+    if (compact->end != NULL && key.size() >= 8 &&
+        user_comparator()->Compare(ExtractUserKey(key),
+                                   Slice(*compact->end)) >= 0) {
+      // The rest belongs to the next range
+      break;
+    }
     if (compact->compaction->ShouldStopBefore(key) &&
         compact->builder != NULL) {
       status = FinishCompactionOutputFile(compact, input);
@@ -985,10 +1120,77 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     status = input->status();
   }
   delete input;
-  input = NULL;
+  return status;
+}
+
+Status DBImpl::DoCompactionWork(CompactionState* compact) {
+  const uint64_t start_micros = env_->NowMicros();
+
+  Log(options_.info_log,  "Compacting %d@%d + %d@%d files",
+      compact->compaction->num_input_files(0),
+      compact->compaction->level(),
+      compact->compaction->num_input_files(1),
+      compact->compaction->level() + 1);
+
+  assert(versions_->NumLevelFiles(compact->compaction->level()) > 0);
+  assert(compact->builder == NULL);
+  assert(compact->outfile == NULL);
+  if (snapshots_.empty()) {
+    compact->smallest_snapshot = versions_->LastSequence();
+  } else {
+    compact->smallest_snapshot = snapshots_.oldest()->number_;
+  }
+
+  // Ranges after the first one are compacted by threads of their own
+  std::vector<std::string> boundaries;
+  GetSubcompactionBoundaries(compact->compaction, &boundaries);
+  std::vector<SubcompactionJob> jobs(boundaries.size());
+  for (size_t i = 0; i < boundaries.size(); i++) {
+    CompactionState* sub =
+        new CompactionState(compact->compaction->NewSubcompaction());
+    sub->smallest_snapshot = compact->smallest_snapshot;
+    sub->begin = &boundaries[i];
+    sub->end = (i + 1 < boundaries.size()) ? &boundaries[i + 1] : NULL;
+    jobs[i].db = this;
+    jobs[i].state = sub;
+    jobs[i].done = false;
+  }
+  if (!boundaries.empty()) {
+    compact->end = &boundaries[0];
+    Log(options_.info_log, "Compacting in %d key ranges",
+        static_cast<int>(boundaries.size()) + 1);
+  }
+
+  // Release mutex while we're actually doing the compaction work
+  mutex_.Unlock();
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    env_->StartThread(&DBImpl::BGSubcompaction, &jobs[i]);
+  }
+  Status status = DoSubcompactionWork(compact);
+
+  mutex_.Lock();
+
+  // The outputs of the other ranges follow ours in key order
+  for (size_t i = 0; i < jobs.size(); i++) {
+    while (!jobs[i].done) {
+      bg_cv_.Wait();
+    }
+    CompactionState* sub = jobs[i].state;
+    if (status.ok()) {
+      status = jobs[i].status;
+    }
+    compact->outputs.insert(compact->outputs.end(),
+                            sub->outputs.begin(), sub->outputs.end());
+    compact->total_bytes += sub->total_bytes;
+    sub->outputs.clear();
+    Compaction* c = sub->compaction;
+    CleanupCompaction(sub);
+    delete c;
+  }
 
   CompactionStats stats;
-  stats.micros = env_->NowMicros() - start_micros - imm_micros;
+  stats.micros = env_->NowMicros() - start_micros - compact->imm_micros;
   for (int which = 0; which < 2; which++) {
     for (int i = 0; i < compact->compaction->num_input_files(which); i++) {
       stats.bytes_read += compact->compaction->input(which, i)->file_size;
@@ -998,7 +1200,6 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     stats.bytes_written += compact->outputs[i].file_size;
   }
 
-  mutex_.Lock();
   stats_[compact->compaction->level() + 1].Add(stats);
 
   if (status.ok()) {
@@ -17,6 +17,7 @@
 
 namespace leveldb {
 
+class Compaction;
 class MemTable;
 class TableCache;
 class Version;
@@ -67,6 +68,7 @@ class DBImpl : public DB {
  private:
   friend class DB;
   struct CompactionState;
+  struct SubcompactionJob;
   struct Writer;
 
   Iterator* NewInternalIterator(const ReadOptions&,
@@ -95,7 +97,10 @@ class DBImpl : public DB {
                         SequenceNumber* max_sequence)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
-  Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base)
+  // The new table is kept in pending_outputs_ until the caller has
+  // installed it; its number is stored in *number.
+  Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base,
+                          uint64_t* number)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
   Status MakeRoomForWrite(bool force /* compact even if there is room? */)
@@ -104,6 +109,11 @@ class DBImpl : public DB {
 
   void RecordBackgroundError(const Status& s);
 
+  // Apply *edit to the current version.  Unlike VersionSet::LogAndApply(),
+  // may be called by several background threads at the same time.
+  Status LogAndApply(VersionEdit* edit) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  bool HasBackgroundWork() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   void MaybeScheduleCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   static void BGWork(void* db);
   void BackgroundCall();
@@ -113,6 +123,18 @@ class DBImpl : public DB {
   Status DoCompactionWork(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+  // Split a large compaction into key ranges for separate threads.
+  // Stores in *boundaries the user keys at which the second and later
+  // ranges start; leaves it empty if the compaction is not split.
+  void GetSubcompactionBoundaries(Compaction* c,
+                                  std::vector<std::string>* boundaries);
+  static void BGSubcompaction(void* job);
+
+  // Merge the inputs of compact->compaction in the key range of *compact
+  // into new output files.
+  // REQUIRES: mutex_ is not held.
+  Status DoSubcompactionWork(CompactionState* compact);
+
   Status OpenCompactionOutputFile(CompactionState* compact);
   Status FinishCompactionOutputFile(CompactionState* compact, Iterator* input);
   Status InstallCompactionResults(CompactionState* compact)
@@ -155,8 +177,21 @@ class DBImpl : public DB {
   // part of ongoing compactions.
   std::set<uint64_t> pending_outputs_;
 
-  // Has a background compaction been scheduled or is running?
-  bool bg_compaction_scheduled_;
+  // Number of background compaction calls that are scheduled or running
+  int bg_compaction_scheduled_;
+
+  // Has a scheduled background call not started yet?
+  bool bg_compaction_queued_;
+
+  // Is some thread writing imm_ to a table?
+  bool bg_memtable_compacting_;
+
+  // The table written for imm_ goes above level-0 but is not installed
+  // yet.  Compactions picked meanwhile would not see it, so none are.
+  bool pending_imm_output_;
+
+  // Is some thread applying an edit to the MANIFEST?
+  bool manifest_writing_;
 
   // Information for a manual compaction
   struct ManualCompaction {
@@ -195,6 +195,7 @@ class DBTest {
     kDefault,
     kFilter,
     kUncompressed,
+    kParallelCompaction,
     kEnd
   };
   int option_config_;
@@ -244,6 +245,10 @@ class DBTest {
       case kUncompressed:
         options.compression = kNoCompression;
         break;
+      case kParallelCompaction:
+        options.max_background_compactions = 4;
+        options.max_subcompactions = 4;
+        break;
       default:
         break;
     }
@@ -986,6 +991,40 @@ TEST(DBTest, CompactionsGenerateMultipleFiles) {
   }
 }
 
+TEST(DBTest, Subcompactions) {
+  Options options = CurrentOptions();
+  options.write_buffer_size = 100000000;        // Large write buffer
+  options.max_background_compactions = 4;
+  options.max_subcompactions = 4;
+  Reopen(&options);
+
+  Random rnd(301);
+
+  // Write 12MB (120 values, each 100K)
+  std::vector<std::string> values;
+  for (int i = 0; i < 120; i++) {
+    values.push_back(RandomString(&rnd, 100000));
+    ASSERT_OK(Put(Key(i), values[i]));
+  }
+
+  // Reopening with a smaller write buffer moves the updates into several
+  // level-0 files, which are compacted into level-1 by several threads
+  options.write_buffer_size = 3000000;
+  Reopen(&options);
+  ASSERT_GT(NumTableFilesAtLevel(0), 1);
+  dbfull()->TEST_CompactRange(0, NULL, NULL);
+
+  ASSERT_EQ(NumTableFilesAtLevel(0), 0);
+  ASSERT_GT(NumTableFilesAtLevel(1), 1);
+  for (int i = 0; i < 120; i++) {
+    ASSERT_EQ(Get(Key(i)), values[i]);
+  }
+  Reopen(&options);
+  for (int i = 0; i < 120; i++) {
+    ASSERT_EQ(Get(Key(i)), values[i]);
+  }
+}
+
 TEST(DBTest, RepeatedWritesToSameKey) {
   Options options = CurrentOptions();
   options.env = env_;
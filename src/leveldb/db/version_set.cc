@@ -54,6 +54,15 @@ static int64_t TotalFileSize(const std::vector<FileMetaData*>& files) {
   return sum;
 }
 
+static bool AnyBeingCompacted(const std::vector<FileMetaData*>& files) {
+  for (size_t i = 0; i < files.size(); i++) {
+    if (files[i]->being_compacted) {
+      return true;
+    }
+  }
+  return false;
+}
+
 namespace {
 std::string IntSetToString(const std::set<uint64_t>& s) {
   std::string result = "{";
@@ -794,7 +803,8 @@ VersionSet::VersionSet(const std::string& dbname,
       descriptor_file_(NULL),
       descriptor_log_(NULL),
       dummy_versions_(this),
-      current_(NULL) {
+      current_(NULL),
+      running_compactions_(0) {
   AppendVersion(new Version(this));
 }
 
@@ -1055,6 +1065,7 @@ void VersionSet::Finalize(Version* v) {
       score = static_cast<double>(level_bytes) / MaxBytesForLevel(level);
     }
 
+    v->compaction_scores_[level] = score;
     if (score > best_score) {
       best_level = level;
       best_score = score;
@@ -1254,60 +1265,135 @@ Iterator* VersionSet::MakeInputIterator(Compaction* c) {
   return result;
 }
 
-Compaction* VersionSet::PickCompaction() {
-  Compaction* c;
+bool VersionSet::NeedsCompaction() {
   int level;
+  std::vector<FileMetaData*> inputs;
+  return PickCompactionInputs(&level, &inputs);
+}
+
+// Stores in *inputs the files that a compaction of "f" reads from "level"
+// and returns true iff neither they nor the files they overlap in
+// "level+1" are inputs of a running compaction.
+bool VersionSet::CanCompact(int level, FileMetaData* f,
+                            std::vector<FileMetaData*>* inputs) {
+  // Level-0 files overlap each other and are ordered by age, so only one
+  // compaction at a time may take files out of level-0
+  if (level == 0 && AnyBeingCompacted(current_->files_[0])) {
+    return false;
+  }
 
+  inputs->clear();
+  inputs->push_back(f);
+  InternalKey smallest, largest;
+  GetRange(*inputs, &smallest, &largest);
+
+  // Files in level 0 may overlap each other, so pick up all overlapping ones
+  if (level == 0) {
+    // Note that the next call will discard the file we placed in
+    // *inputs earlier and replace it with an overlapping set
+    // which will include the picked file.
+    current_->GetOverlappingInputs(0, &smallest, &largest, inputs);
+    assert(!inputs->empty());
+    GetRange(*inputs, &smallest, &largest);
+  }
+  if (AnyBeingCompacted(*inputs)) {
+    return false;
+  }
+
+  std::vector<FileMetaData*> parents;
+  current_->GetOverlappingInputs(level + 1, &smallest, &largest, &parents);
+  return !AnyBeingCompacted(parents);
+}
+
+bool VersionSet::PickCompactionInputs(int* level,
+                                      std::vector<FileMetaData*>* inputs) {
   // We prefer compactions triggered by too much data in a level over
-  // the compactions triggered by seeks.
-  const bool size_compaction = (current_->compaction_score_ >= 1);
-  const bool seek_compaction = (current_->file_to_compact_ != NULL);
-  if (size_compaction) {
-    level = current_->compaction_level_;
-    assert(level >= 0);
-    assert(level+1 < config::kNumLevels);
-    c = new Compaction(level);
-
-    // Pick the first file that comes after compact_pointer_[level]
-    for (size_t i = 0; i < current_->files_[level].size(); i++) {
-      FileMetaData* f = current_->files_[level][i];
-      if (compact_pointer_[level].empty() ||
-          icmp_.Compare(f->largest.Encode(), compact_pointer_[level]) > 0) {
-        c->inputs_[0].push_back(f);
-        break;
+  // the compactions triggered by seeks.  Levels are tried in order of
+  // decreasing score, as long as their files are busy in other compactions.
+  bool tried[config::kNumLevels];
+  for (int i = 0; i < config::kNumLevels; i++) {
+    tried[i] = false;
+  }
+  for (;;) {
+    int best_level = -1;
+    for (int i = 0; i < config::kNumLevels - 1; i++) {
+      const double score = current_->compaction_scores_[i];
+      if (!tried[i] && score >= 1 &&
+          (best_level < 0 || score > current_->compaction_scores_[best_level])) {
+        best_level = i;
       }
     }
-    if (c->inputs_[0].empty()) {
-      // Wrap-around to the beginning of the key space
-      c->inputs_[0].push_back(current_->files_[level][0]);
+    if (best_level < 0) {
+      break;
     }
-  } else if (seek_compaction) {
-    level = current_->file_to_compact_level_;
-    c = new Compaction(level);
-    c->inputs_[0].push_back(current_->file_to_compact_);
-  } else {
+    tried[best_level] = true;
+
+    // Try the files in order, starting with the first one that comes
+    // after compact_pointer_[level]
+    const std::vector<FileMetaData*>& files = current_->files_[best_level];
+    size_t start = 0;
+    if (!compact_pointer_[best_level].empty()) {
+      while (start < files.size() &&
+             icmp_.Compare(files[start]->largest.Encode(),
+                           compact_pointer_[best_level]) <= 0) {
+        start++;
+      }
+      if (start == files.size()) {
+        // Wrap-around to the beginning of the key space
+        start = 0;
+      }
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+      if (CanCompact(best_level, files[(start + i) % files.size()], inputs)) {
+        *level = best_level;
+        return true;
+      }
+    }
+  }
+
+  if (current_->file_to_compact_ != NULL &&
+      CanCompact(current_->file_to_compact_level_,
+                 current_->file_to_compact_, inputs)) {
+    *level = current_->file_to_compact_level_;
+    return true;
+  }
+  return false;
+}
+
+Compaction* VersionSet::PickCompaction() {
+  int level;
+  std::vector<FileMetaData*> inputs;
+  if (!PickCompactionInputs(&level, &inputs)) {
     return NULL;
   }
+  assert(level >= 0);
+  assert(level+1 < config::kNumLevels);
 
+  Compaction* c = new Compaction(level);
   c->input_version_ = current_;
   c->input_version_->Ref();
-
-  // Files in level 0 may overlap each other, so pick up all overlapping ones
-  if (level == 0) {
-    InternalKey smallest, largest;
-    GetRange(c->inputs_[0], &smallest, &largest);
-    // Note that the next call will discard the file we placed in
-    // c->inputs_[0] earlier and replace it with an overlapping set
-    // which will include the picked file.
-    current_->GetOverlappingInputs(0, &smallest, &largest, &c->inputs_[0]);
-    assert(!c->inputs_[0].empty());
-  }
+  c->inputs_[0] = inputs;
 
   SetupOtherInputs(c);
+  SetBeingCompacted(c, true);
 
   return c;
 }
 
+void VersionSet::SetBeingCompacted(Compaction* c, bool value) {
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->inputs_[which].size(); i++) {
+      assert(c->inputs_[which][i]->being_compacted != value);
+      c->inputs_[which][i]->being_compacted = value;
+    }
+  }
+  running_compactions_ += value ? 1 : -1;
+}
+
+void VersionSet::ReleaseCompaction(Compaction* c) {
+  SetBeingCompacted(c, false);
+}
+
 void VersionSet::SetupOtherInputs(Compaction* c) {
   const int level = c->level();
   InternalKey smallest, largest;
@@ -1328,7 +1414,8 @@ void VersionSet::SetupOtherInputs(Compaction* c) {
     const int64_t inputs1_size = TotalFileSize(c->inputs_[1]);
     const int64_t expanded0_size = TotalFileSize(expanded0);
     if (expanded0.size() > c->inputs_[0].size() &&
-        inputs1_size + expanded0_size < kExpandedCompactionByteSizeLimit) {
+        inputs1_size + expanded0_size < kExpandedCompactionByteSizeLimit &&
+        !AnyBeingCompacted(expanded0)) {
       InternalKey new_start, new_limit;
       GetRange(expanded0, &new_start, &new_limit);
       std::vector<FileMetaData*> expanded1;
@@ -1402,11 +1489,13 @@ Compaction* VersionSet::CompactRange(
     }
   }
 
+  assert(running_compactions_ == 0);
   Compaction* c = new Compaction(level);
   c->input_version_ = current_;
   c->input_version_->Ref();
   c->inputs_[0] = inputs;
   SetupOtherInputs(c);
+  SetBeingCompacted(c, true);
   return c;
 }
 
@@ -1495,4 +1584,15 @@ void Compaction::ReleaseInputs() {
   }
 }
 
+Compaction* Compaction::NewSubcompaction() const {
+  assert(input_version_ != NULL);
+  Compaction* c = new Compaction(level_);
+  c->input_version_ = input_version_;
+  c->input_version_->Ref();
+  c->inputs_[0] = inputs_[0];
+  c->inputs_[1] = inputs_[1];
+  c->grandparents_ = grandparents_;
+  return c;
+}
+
 }  // namespace leveldb
@@ -147,12 +147,18 @@ class Version {
   double compaction_score_;
   int compaction_level_;
 
+  // Compaction score of every level, also initialized by Finalize().
+  double compaction_scores_[config::kNumLevels];
+
   explicit Version(VersionSet* vset)
       : vset_(vset), next_(this), prev_(this), refs_(0),
         file_to_compact_(NULL),
         file_to_compact_level_(-1),
         compaction_score_(-1),
         compaction_level_(-1) {
+    for (int level = 0; level < config::kNumLevels; level++) {
+      compaction_scores_[level] = -1;
+    }
   }
 
   ~Version();
@@ -224,21 +230,31 @@ class VersionSet {
   // being compacted, or zero if there is no such log file.
   uint64_t PrevLogNumber() const { return prev_log_number_; }
 
-  // Pick level and inputs for a new compaction.
+  // Pick level and inputs for a new compaction.  Files that are inputs
+  // of a running compaction are never picked.
   // Returns NULL if there is no compaction to be done.
   // Otherwise returns a pointer to a heap-allocated object that
-  // describes the compaction.  Caller should delete the result.
+  // describes the compaction.  Caller should pass the result to
+  // ReleaseCompaction() once it is done, then delete it.
   Compaction* PickCompaction();
 
   // Return a compaction object for compacting the range [begin,end] in
   // the specified level.  Returns NULL if there is nothing in that
-  // level that overlaps the specified range.  Caller should delete
-  // the result.
+  // level that overlaps the specified range.  Caller should pass the
+  // result to ReleaseCompaction() once it is done, then delete it.
+  // REQUIRES: no compaction is running.
   Compaction* CompactRange(
       int level,
       const InternalKey* begin,
       const InternalKey* end);
 
+  // Allow the input files of "*c" to be picked by other compactions again.
+  void ReleaseCompaction(Compaction* c);
+
+  // Return the number of compactions that have been picked but not
+  // released yet.
+  int NumRunningCompactions() const { return running_compactions_; }
+
   // Return the maximum overlapping data (in bytes) at next level for any
   // file at a level >= 1.
   int64_t MaxNextLevelOverlappingBytes();
@@ -247,11 +263,9 @@ class VersionSet {
   // The caller should delete the iterator when no longer needed.
   Iterator* MakeInputIterator(Compaction* c);
 
-  // Returns true iff some level needs a compaction.
-  bool NeedsCompaction() const {
-    Version* v = current_;
-    return (v->compaction_score_ >= 1) || (v->file_to_compact_ != NULL);
-  }
+  // Returns true iff some level needs a compaction that can be picked
+  // next to the compactions already running.
+  bool NeedsCompaction();
 
   // Add all files listed in any live version to *live.
   // May also mutate some internal state.
@@ -285,8 +299,15 @@ class VersionSet {
                  InternalKey* smallest,
                  InternalKey* largest);
 
+  bool PickCompactionInputs(int* level, std::vector<FileMetaData*>* inputs);
+
+  bool CanCompact(int level, FileMetaData* f,
+                  std::vector<FileMetaData*>* inputs);
+
   void SetupOtherInputs(Compaction* c);
 
+  void SetBeingCompacted(Compaction* c, bool value);
+
   // Save current contents to *log
   Status WriteSnapshot(log::Writer* log);
 
@@ -313,6 +334,9 @@ class VersionSet {
   // Either an empty string, or a valid InternalKey.
   std::string compact_pointer_[config::kNumLevels];
 
+  // Number of compactions whose input files are marked being_compacted
+  int running_compactions_;
+
   // No copying allowed
   VersionSet(const VersionSet&);
   void operator=(const VersionSet&);
@@ -360,6 +384,12 @@ class Compaction {
   // is successful.
   void ReleaseInputs();
 
+  // Return a compaction over the same inputs with its own state for
+  // IsBaseLevelForKey() and ShouldStopBefore(), so that another thread
+  // can compact a part of the key range.  Caller should delete the result.
+  // REQUIRES: the inputs have not been released.
+  Compaction* NewSubcompaction() const;
+
  private:
   friend class Version;
   friend class VersionSet;
@@ -129,6 +129,11 @@ class Env {
   // When "function(arg)" returns, the thread will be destroyed.
   virtual void StartThread(void (*function)(void* arg), void* arg) = 0;
 
+  // Make at least "number" threads available to run the functions passed
+  // to Schedule().  The default does nothing, for environments that do not
+  // limit the number of background threads.
+  virtual void SetBackgroundThreads(int number) { }
+
   // *path is set to a temporary directory that can be used for testing. It may
   // or many not have just been created. The directory may or may not differ
   // between runs of the same process, but subsequent calls will return the
@@ -312,6 +317,9 @@ class EnvWrapper : public Env {
   void StartThread(void (*f)(void*), void* a) {
     return target_->StartThread(f, a);
   }
+  void SetBackgroundThreads(int n) {
+    return target_->SetBackgroundThreads(n);
+  }
   virtual Status GetTestDirectory(std::string* path) {
     return target_->GetTestDirectory(path);
   }
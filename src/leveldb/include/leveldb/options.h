@@ -135,6 +135,20 @@ struct Options {
   // Default: NULL
   const FilterPolicy* filter_policy;
 
+  // Maximum number of compactions that may run at the same time.  Only
+  // compactions that share no input files run concurrently, and at most
+  // one of them compacts level-0.
+  //
+  // Default: 1
+  int max_background_compactions;
+
+  // Maximum number of threads a single large compaction is split over.
+  // Each thread compacts a separate range of the input keys into its own
+  // output files.
+  //
+  // Default: 1
+  int max_subcompactions;
+
   // Create an Options object with default values for all fields.
   Options();
 };
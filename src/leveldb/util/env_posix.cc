@@ -5,6 +5,7 @@
 
 #include <deque>
 #include <set>
+#include <vector>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -454,6 +455,8 @@ class PosixEnv : public Env {
 
   virtual void StartThread(void (*function)(void* arg), void* arg);
 
+  virtual void SetBackgroundThreads(int number);
+
   virtual Status GetTestDirectory(std::string* result) {
     const char* env = getenv("TEST_TMPDIR");
     if (env && env[0] != '\0') {
@@ -504,7 +507,7 @@ class PosixEnv : public Env {
     }
   }
 
-  // BGThread() is the body of the background thread
+  // BGThread() is the body of the background threads
   void BGThread();
   static void* BGThreadWrapper(void* arg) {
     reinterpret_cast<PosixEnv*>(arg)->BGThread();
@@ -513,8 +516,8 @@ class PosixEnv : public Env {
 
   pthread_mutex_t mu_;
   pthread_cond_t bgsignal_;
-  pthread_t bgthread_;
-  bool started_bgthread_;
+  std::vector<pthread_t> bgthreads_;
+  int max_bgthreads_;
 
   // Entry per Schedule() call
   struct BGItem { void* arg; void (*function)(void*); };
@@ -525,7 +528,7 @@ class PosixEnv : public Env {
   MmapLimiter mmap_limit_;
 };
 
-PosixEnv::PosixEnv() : started_bgthread_(false) {
+PosixEnv::PosixEnv() : max_bgthreads_(1) {
   PthreadCall("mutex_init", pthread_mutex_init(&mu_, NULL));
   PthreadCall("cvar_init", pthread_cond_init(&bgsignal_, NULL));
 }
@@ -533,19 +536,18 @@ PosixEnv::PosixEnv() : started_bgthread_(false) {
 void PosixEnv::Schedule(void (*function)(void*), void* arg) {
   PthreadCall("lock", pthread_mutex_lock(&mu_));
 
-  // Start background thread if necessary
-  if (!started_bgthread_) {
-    started_bgthread_ = true;
+  // Start background threads if necessary
+  while (bgthreads_.size() < static_cast<size_t>(max_bgthreads_)) {
+    pthread_t t;
     PthreadCall(
         "create thread",
-        pthread_create(&bgthread_, NULL,  &PosixEnv::BGThreadWrapper, this));
+        pthread_create(&t, NULL,  &PosixEnv::BGThreadWrapper, this));
+    bgthreads_.push_back(t);
   }
 
-  // If the queue is currently empty, the background thread may currently be
-  // waiting.
-  if (queue_.empty()) {
-    PthreadCall("signal", pthread_cond_signal(&bgsignal_));
-  }
+  // Some background thread may be waiting for work.  With more than one
+  // thread the queue may be non-empty while others are still waiting.
+  PthreadCall("signal", pthread_cond_signal(&bgsignal_));
 
   // Add to priority queue
   queue_.push_back(BGItem());
@@ -572,6 +574,15 @@ void PosixEnv::BGThread() {
   }
 }
 
+void PosixEnv::SetBackgroundThreads(int number) {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  if (number > max_bgthreads_) {
+    // Threads are started by the next call to Schedule()
+    max_bgthreads_ = number;
+  }
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
 namespace {
 struct StartThreadState {
   void (*user_function)(void*);
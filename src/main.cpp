@@ -34,8 +34,11 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
+CMainSignals mainSignals;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 uint256 hashGenesisBlock("0x8432ed563657dc92d085fa98b5dfd77975ff50b6bc4be28efe80db615d98a9ae");   // DRG
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // Isracoin: starting difficulty is 1 / 2^12
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -44,6 +47,7 @@ uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
@@ -51,7 +55,16 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fAddressIndex = false;
+bool fBlockFilterIndex = false;
 unsigned int nCoinCacheSize = 5000;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64 nPruneTarget = 0;
+int64 nSyncInterval = DEFAULT_SYNC_INTERVAL;
+uint64 nSyncBuffer = (uint64)DEFAULT_SYNC_BUFFER << 20;
+uint64 nMaxMempoolSize = (uint64)DEFAULT_MAX_MEMPOOL_SIZE << 20;
+int64 nMempoolExpiry = DEFAULT_MEMPOOL_EXPIRY * 60 * 60;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 0.001 * COIN;;   //DRG
@@ -63,8 +76,8 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -79,6 +92,54 @@ int64 nTransactionFee = 0;
 int64 nMinimumInputValue = DUST_HARD_LIMIT;
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block index storage
+//
+
+static const CSipHasher hasherBlockMap(GetRand(std::numeric_limits<uint64>::max()), GetRand(std::numeric_limits<uint64>::max()));
+
+size_t BlockHasher::operator()(const uint256& hash) const
+{
+    return CSipHasher(hasherBlockMap).Write(hash.begin(), hash.size()).Finalize();
+}
+
+/** Owns all CBlockIndex entries. They are allocated in large chunks instead of one
+ *  heap allocation each, so the index of a long chain loads quickly, sits close
+ *  together in memory, and is released at once. Entries are never freed on their own. */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_SIZE = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed; // entries handed out from the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == CHUNK_SIZE) {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    // invalidates every entry handed out so far
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
+    }
+};
+
+static CBlockIndexArena blockIndexArena;
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // dispatching functions
@@ -268,6 +329,7 @@ CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn)
 bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
     if (base->GetCoins(txid, coins))
         return true;
+    LOCK(mempool.cs);
     if (mempool.exists(txid)) {
         const CTransaction &tx = mempool.lookup(txid);
         coins = CCoins(tx, MEMPOOL_HEIGHT);
@@ -282,13 +344,26 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CBlockFilterDB *pblockfilterdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+// Orphans by expiry time, and the orphans and their total size per sending peer
+static set<pair<int64, uint256> > setOrphanTransactionsByExpiry;
+struct COrphanPeer
+{
+    unsigned int nSize;
+    set<pair<int64, uint256> > setOrphans;
+
+    COrphanPeer() : nSize(0) {}
+};
+static map<NodeId, COrphanPeer> mapOrphanTransactionsByPeer;
+static unsigned int nOrphanTransactionsSize = 0;
+
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -299,8 +374,6 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
     if (sz > 5000)
     {
@@ -308,40 +381,82 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    COrphanTx &orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().c_str(),
-        mapOrphanTransactions.size());
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    setOrphanTransactionsByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
+    COrphanPeer &orphanpeer = mapOrphanTransactionsByPeer[peer];
+    orphanpeer.setOrphans.insert(make_pair(orphan.nTimeExpire, hash));
+    orphanpeer.nSize += sz;
+    nOrphanTransactionsSize += sz;
+
+    printf("stored orphan tx %s (mapsz %"PRIszu", %u bytes)\n", hash.ToString().c_str(),
+        mapOrphanTransactions.size(), nOrphanTransactionsSize);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx &orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
-    }
-    mapOrphanTransactions.erase(hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+    setOrphanTransactionsByExpiry.erase(make_pair(orphan.nTimeExpire, hash));
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(orphan.fromPeer);
+    itPeer->second.setOrphans.erase(make_pair(orphan.nTimeExpire, hash));
+    itPeer->second.nSize -= orphan.nTxSize;
+    if (itPeer->second.setOrphans.empty())
+        mapOrphanTransactionsByPeer.erase(itPeer);
+    nOrphanTransactionsSize -= orphan.nTxSize;
+    mapOrphanTransactions.erase(it);
+}
+
+void EraseOrphansFor(NodeId peer)
+{
+    LOCK(cs_main);
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    set<pair<int64, uint256> > setOrphans = itPeer->second.setOrphans;
+    BOOST_FOREACH(const PAIRTYPE(int64, uint256) &item, setOrphans)
+        EraseOrphanTx(item.second);
+    printf("Erased %"PRIszu" orphan tx from peer %d\n", setOrphans.size(), peer);
 }
 
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Drop the orphans whose parents did not show up in time
+    int64 nNow = GetTime();
+    while (!setOrphanTransactionsByExpiry.empty() && setOrphanTransactionsByExpiry.begin()->first <= nNow)
+    {
+        EraseOrphanTx(setOrphanTransactionsByExpiry.begin()->second);
+        ++nEvicted;
+    }
+
+    // Then evict the oldest orphan of the peer taking the most space, so one peer
+    // flooding us cannot push out what the others sent
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > MAX_ORPHAN_TRANSACTIONS_SIZE)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        map<NodeId, COrphanPeer>::iterator itMax = mapOrphanTransactionsByPeer.begin();
+        for (map<NodeId, COrphanPeer>::iterator it = itMax; it != mapOrphanTransactionsByPeer.end(); ++it)
+            if (it->second.nSize > itMax->second.nSize)
+                itMax = it;
+        EraseOrphanTx(itMax->second.setOrphans.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
@@ -508,7 +623,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     if (pblock == NULL) {
         CCoins coins;
         if (pcoinsTip->GetCoins(GetHash(), coins)) {
-            CBlockIndex *pindex = FindBlockByHeight(coins.nHeight);
+            CBlockIndex *pindex = chainActive[coins.nHeight];
             if (pindex) {
                 if (!blockTmp.ReadFromDisk(pindex))
                     return 0;
@@ -538,7 +653,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -671,8 +786,41 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
     }
 }
 
-bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
-                        bool* pfMissingInputs)
+// Build the pool entry of a transaction whose inputs are in view. Inputs that are
+// missing count for nothing, and only inputs in the chain add to the priority.
+static CTxMemPoolEntry GetMemPoolEntry(const CTransaction &tx, CCoinsViewCache &view)
+{
+    int64 nValueIn = 0, nValueInChain = 0;
+    double dPriority = 0;
+    bool fMissingInputs = false;
+    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+        if (!view.HaveCoins(txin.prevout.hash)) {
+            fMissingInputs = true;
+            continue;
+        }
+        const CCoins &coins = view.GetCoins(txin.prevout.hash);
+        if (!coins.IsAvailable(txin.prevout.n)) {
+            fMissingInputs = true;
+            continue;
+        }
+        int64 nValue = coins.vout[txin.prevout.n].nValue;
+        nValueIn += nValue;
+        if ((unsigned int)coins.nHeight != MEMPOOL_HEIGHT) {
+            nValueInChain += nValue;
+            dPriority += (double)nValue * (nBestHeight - coins.nHeight + 1);
+        }
+    }
+    int64 nFee = fMissingInputs ? 0 : nValueIn - tx.GetValueOut();
+    CTxMemPoolEntry entry(tx, nFee, GetTime(), nBestHeight, 0, nValueInChain);
+    entry.dPriority = dPriority / entry.nTxSize;
+    entry.nSigOps = tx.GetLegacySigOpCount();
+    if (!fMissingInputs)
+        entry.nSigOps += tx.GetP2SHSigOpCount(view);
+    return entry;
+}
+
+bool CTxMemPool::PreAccept(CValidationState &state, const CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs,
+                           CTxMemPoolEntry &entry, std::vector<CScriptCheck> *pvChecks)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -700,36 +848,14 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         LOCK(cs);
         if (mapTx.count(hash))
             return false;
-    }
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (mapNextTx.count(outpoint))
-        {
-            // Disable replacement feature for now
-            return false;
-
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = mapNextTx[outpoint].ptx;
-            if (ptxOld->IsFinal())
+        // Check for conflicts with in-memory transactions
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            if (mapNextTx.count(txin.prevout))
                 return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
-            {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
-                    return false;
-            }
-            break;
-        }
     }
 
+    entry = CTxMemPoolEntry(tx, 0, GetTime(), nBestHeight);
     if (fCheckInputs)
     {
         CCoinsView dummy;
@@ -774,8 +900,10 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        // The entry works out the fee and sigops once, for the block templates and ConnectBlock as well
+        entry = GetMemPoolEntry(tx, view);
+        int64 nFees = entry.nFee;
+        unsigned int nSize = entry.nTxSize;
 
         // Don't accept it if it can't get into a block
         int64 txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
@@ -784,6 +912,13 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
                          hash.ToString().c_str(),
                          nFees, txMinFee);
 
+        // Once the pool was full, require more than what the evicted transactions paid
+        int64 nMinPoolFee = (int64)(GetMinFee(nMaxMempoolSize) * nSize / 1000);
+        if (fLimitFree && nMinPoolFee > 0 && nFees < nMinPoolFee)
+            return error("CTxMemPool::accept() : mempool min fee not met %s, %"PRI64d" < %"PRI64d,
+                         hash.ToString().c_str(),
+                         nFees, nMinPoolFee);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -809,32 +944,149 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, pvChecks))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
         }
+
+        entry.fInputsChecked = true;
     }
 
+    return true;
+}
+
+bool CTxMemPool::FinishAccept(CValidationState &state, const CTransaction &tx, const CTxMemPoolEntry &entry)
+{
     // Store transaction in memory
+    uint256 hash = entry.hash;
     {
         LOCK(cs);
-        if (ptxOld)
-        {
-            printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            remove(*ptxOld);
-        }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, entry);
     }
 
-    ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+    // Stay within the pool limits; this may evict the new transaction itself
+    Expire(GetTime() - nMempoolExpiry);
+    TrimToSize(nMaxMempoolSize);
+    if (!exists(hash))
+        return error("CTxMemPool::accept() : mempool full, %s not accepted", hash.ToString().c_str());
+
     SyncWithWallets(hash, tx, NULL, true);
 
     return true;
 }
 
+bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
+                        bool* pfMissingInputs, int64 nAcceptTime)
+{
+    CTxMemPoolEntry entry;
+    if (!PreAccept(state, tx, fCheckInputs, fLimitFree, pfMissingInputs, entry, NULL))
+        return false;
+    if (nAcceptTime)
+        entry.nTime = nAcceptTime;
+    return FinishAccept(state, tx, entry);
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void CTxMemPool::acceptBatch(std::vector<CMemPoolBatchTx> &vBatch, bool fLimitFree)
+{
+    std::vector<CMemPoolBatchTx*> vPending;
+    for (unsigned int i = 0; i < vBatch.size(); i++)
+        vPending.push_back(&vBatch[i]);
+
+    // Each round checks what is pending against the pool as it is. Transactions spending
+    // one that passed in this round are missing inputs for now, and wait for the next round.
+    while (!vPending.empty())
+    {
+        std::vector<CMemPoolBatchTx*> vRound, vDeferred;
+        std::vector<CTxMemPoolEntry> vEntries;
+        std::vector<std::vector<CScriptCheck> > vChecks;
+        std::set<uint256> setRound;
+        BOOST_FOREACH(CMemPoolBatchTx *ptx, vPending) {
+            CTxMemPoolEntry entry;
+            std::vector<CScriptCheck> vTxChecks;
+            ptx->state = CValidationState();
+            if (!PreAccept(ptx->state, ptx->tx, true, fLimitFree, &ptx->fMissingInputs, entry, &vTxChecks)) {
+                if (ptx->fMissingInputs) {
+                    BOOST_FOREACH(const CTxIn &txin, ptx->tx.vin) {
+                        if (setRound.count(txin.prevout.hash)) {
+                            vDeferred.push_back(ptx);
+                            break;
+                        }
+                    }
+                }
+                continue;
+            }
+            if (ptx->nAcceptTime)
+                entry.nTime = ptx->nAcceptTime;
+            setRound.insert(entry.hash);
+            vRound.push_back(ptx);
+            vEntries.push_back(entry);
+            vChecks.push_back(vTxChecks);
+        }
+
+        // Verify the scripts of the whole round on the script check threads. Should any fail,
+        // check the transactions one by one to tell which.
+        bool fAllValid = nScriptCheckThreads > 0;
+        if (fAllValid) {
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            for (unsigned int i = 0; i < vChecks.size(); i++) {
+                std::vector<CScriptCheck> vTxChecks(vChecks[i]);
+                control.Add(vTxChecks);
+            }
+            fAllValid = control.Wait();
+        }
+        std::vector<bool> vValid(vRound.size(), true);
+        if (!fAllValid) {
+            for (unsigned int i = 0; i < vChecks.size(); i++) {
+                BOOST_FOREACH(const CScriptCheck &check, vChecks[i]) {
+                    if (!check()) {
+                        vValid[i] = false;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Add what passed, in the order given
+        for (unsigned int i = 0; i < vRound.size(); i++) {
+            CMemPoolBatchTx &batchtx = *vRound[i];
+            if (!vValid[i]) {
+                // Check again inline, so the transaction fails the way accept would have failed it
+                CTxMemPoolEntry entry;
+                PreAccept(batchtx.state, batchtx.tx, true, false, NULL, entry, NULL);
+                continue;
+            }
+            bool fConflict = false;
+            {
+                LOCK(cs);
+                fConflict = mapTx.count(vEntries[i].hash) > 0;
+                BOOST_FOREACH(const CTxIn &txin, batchtx.tx.vin)
+                    fConflict |= mapNextTx.count(txin.prevout) > 0;
+            }
+            if (fConflict) {
+                batchtx.state.Invalid(error("CTxMemPool::acceptBatch() : %s conflicts with an earlier transaction",
+                                            vEntries[i].hash.ToString().c_str()));
+                continue;
+            }
+            batchtx.fAccepted = FinishAccept(batchtx.state, batchtx.tx, vEntries[i]);
+        }
+
+        vPending.swap(vDeferred);
+    }
+}
+
+bool AcceptToMemoryPoolBatch(std::vector<CMemPoolBatchTx> &vBatch, bool fLimitFree)
+{
+    try {
+        mempool.acceptBatch(vBatch, fLimitFree);
+    } catch(std::runtime_error &e) {
+        CValidationState state;
+        return state.Abort(_("System error: ") + e.what());
+    }
+    return true;
+}
+
 bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs)
 {
     try {
@@ -844,16 +1096,230 @@ bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs
     }
 }
 
+CTxMemPoolEntry::CTxMemPoolEntry() : hash(0), nFee(0), nSigOps(0), nTxSize(0), nTime(0), nHeight(0), dPriority(0), nValueInChain(0), nUsageSize(0), fInputsChecked(false),
+    nCountWithAncestors(0), nSizeWithAncestors(0), nFeesWithAncestors(0),
+    nCountWithDescendants(0), nSizeWithDescendants(0), nFeesWithDescendants(0)
+{
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction &txIn, int64 nFeeIn, int64 nTimeIn, unsigned int nHeightIn, double dPriorityIn, int64 nValueInChainIn) :
+    tx(txIn), hash(txIn.GetHash()), nFee(nFeeIn), nSigOps(0), nTime(nTimeIn), nHeight(nHeightIn), dPriority(dPriorityIn), nValueInChain(nValueInChainIn), nUsageSize(0), fInputsChecked(false)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    return dPriority + (double)nValueInChain * ((int)nCurrentHeight - (int)nHeight) / nTxSize;
+}
+
+bool CompareTxMemPoolEntryByDescendantScore::operator()(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) const
+{
+    double dScoreA = std::max(a->GetFeeRate(), a->GetFeeRateWithDescendants());
+    double dScoreB = std::max(b->GetFeeRate(), b->GetFeeRateWithDescendants());
+    if (dScoreA != dScoreB)
+        return dScoreA < dScoreB;
+    if (a->nTime != b->nTime)
+        return a->nTime > b->nTime;
+    return a->hash < b->hash;
+}
+
+bool CompareTxMemPoolEntryByTime::operator()(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) const
+{
+    if (a->nTime != b->nTime)
+        return a->nTime < b->nTime;
+    return a->hash < b->hash;
+}
+
+bool CompareTxMemPoolEntryByAncestorScore::operator()(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) const
+{
+    double dScoreA = a->GetFeeRateWithAncestors();
+    double dScoreB = b->GetFeeRateWithAncestors();
+    if (dScoreA != dScoreB)
+        return dScoreA > dScoreB;
+    return a->hash < b->hash;
+}
+
+// Heap memory taken by an allocation of nAlloc bytes, including the allocator's overhead
+static inline uint64 MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+// A node of a std::set or std::map: three pointers and the color, then the value
+template<typename T>
+static inline uint64 TreeNodeUsage()
+{
+    return MallocUsage(4 * sizeof(void*) + sizeof(T));
+}
+
+// Memory used by an entry in mapTx, its transaction, its mapNextTx nodes and its index nodes;
+// the links between parents and children are counted separately
+static uint64 GetEntryUsage(const CTxMemPoolEntry &entry)
+{
+    const CTransaction &tx = entry.tx;
+    uint64 nUsage = TreeNodeUsage<std::pair<const uint256, CTxMemPoolEntry> >();
+    nUsage += MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxIn &txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut &txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+    nUsage += tx.vin.size() * TreeNodeUsage<std::pair<const COutPoint, CInPoint> >();
+    nUsage += 3 * TreeNodeUsage<const CTxMemPoolEntry*>();
+    return nUsage;
+}
+
+// A link is a node in the parent's setChildren and one in the child's setParents
+static inline uint64 LinkUsage()
+{
+    return 2 * TreeNodeUsage<const CTxMemPoolEntry*>();
+}
+
+CTxMemPool::CTxMemPool() : nTotalUsage(0), dRollingMinFee(0), nLastRollingFeeUpdate(0)
+{
+}
+
+void CTxMemPool::CalculateAncestors(const CTxMemPoolEntry &entry, std::set<const CTxMemPoolEntry*> &setAncestors) const
+{
+    std::vector<const CTxMemPoolEntry*> vToVisit(entry.setParents.begin(), entry.setParents.end());
+    while (!vToVisit.empty()) {
+        const CTxMemPoolEntry *pentry = vToVisit.back();
+        vToVisit.pop_back();
+        if (setAncestors.insert(pentry).second)
+            vToVisit.insert(vToVisit.end(), pentry->setParents.begin(), pentry->setParents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const CTxMemPoolEntry &entry, std::set<const CTxMemPoolEntry*> &setDescendants) const
+{
+    std::vector<const CTxMemPoolEntry*> vToVisit(entry.setChildren.begin(), entry.setChildren.end());
+    while (!vToVisit.empty()) {
+        const CTxMemPoolEntry *pentry = vToVisit.back();
+        vToVisit.pop_back();
+        if (setDescendants.insert(pentry).second)
+            vToVisit.insert(vToVisit.end(), pentry->setChildren.begin(), pentry->setChildren.end());
+    }
+}
+
+void CTxMemPool::Unindex(const CTxMemPoolEntry *pentry)
+{
+    setByDescendantScore.erase(pentry);
+    setByAncestorScore.erase(pentry);
+}
+
+void CTxMemPool::Reindex(const CTxMemPoolEntry *pentry)
+{
+    setByDescendantScore.insert(pentry);
+    setByAncestorScore.insert(pentry);
+}
+
+void CTxMemPool::RecalculateTotals(CTxMemPoolEntry &entry)
+{
+    std::set<const CTxMemPoolEntry*> setAncestors, setDescendants;
+    CalculateAncestors(entry, setAncestors);
+    CalculateDescendants(entry, setDescendants);
+
+    entry.nCountWithAncestors = entry.nCountWithDescendants = 1;
+    entry.nSizeWithAncestors = entry.nSizeWithDescendants = entry.nTxSize;
+    entry.nFeesWithAncestors = entry.nFeesWithDescendants = entry.nFee;
+    BOOST_FOREACH(const CTxMemPoolEntry *pentry, setAncestors) {
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += pentry->nTxSize;
+        entry.nFeesWithAncestors += pentry->nFee;
+    }
+    BOOST_FOREACH(const CTxMemPoolEntry *pentry, setDescendants) {
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += pentry->nTxSize;
+        entry.nFeesWithDescendants += pentry->nFee;
+    }
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
+{
+    CTxMemPoolEntry entry;
+    {
+        LOCK(cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+        CCoinsViewCache view(viewMemPool, false);
+        entry = GetMemPoolEntry(tx, view);
+    }
+    return addUnchecked(hash, entry);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entryIn)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
-    {
-        mapTx[hash] = tx;
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
-        nTransactionsUpdated++;
+    LOCK(cs);
+    if (mapTx.count(hash))
+        return false;
+
+    CTxMemPoolEntry &entry = mapTx[hash];
+    entry = entryIn;
+    entry.hash = hash;
+    entry.setParents.clear();
+    entry.setChildren.clear();
+    const CTransaction &tx = entry.tx;
+
+    // The entries in the pool are only changed here and in remove, through the indexes' const pointers
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        mapNextTx[tx.vin[i].prevout] = CInPoint(&entry.tx, i);
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(tx.vin[i].prevout.hash);
+        if (mi != mapTx.end() && entry.setParents.insert(&mi->second).second) {
+            mi->second.setChildren.insert(&entry);
+            nTotalUsage += LinkUsage();
+        }
     }
+    // Transactions of a disconnected block can come back after their children
+    for (std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0)); it != mapNextTx.end() && it->first.hash == hash; ++it) {
+        CTxMemPoolEntry *pchild = const_cast<CTxMemPoolEntry*>(lookupEntry(it->second.ptx->GetHash()));
+        if (!pchild || !entry.setChildren.insert(pchild).second)
+            continue;
+        pchild->setParents.insert(&entry);
+        nTotalUsage += LinkUsage();
+    }
+    entry.nUsageSize = GetEntryUsage(entry);
+    nTotalUsage += entry.nUsageSize;
+
+    std::set<const CTxMemPoolEntry*> setAncestors;
+    CalculateAncestors(entry, setAncestors);
+    if (entry.setChildren.empty()) {
+        // The usual case: one more descendant for each ancestor
+        BOOST_FOREACH(const CTxMemPoolEntry *pconst, setAncestors) {
+            CTxMemPoolEntry *pentry = const_cast<CTxMemPoolEntry*>(pconst);
+            Unindex(pentry);
+            pentry->nCountWithDescendants++;
+            pentry->nSizeWithDescendants += entry.nTxSize;
+            pentry->nFeesWithDescendants += entry.nFee;
+            Reindex(pentry);
+            entry.nCountWithAncestors++;
+            entry.nSizeWithAncestors += pentry->nTxSize;
+            entry.nFeesWithAncestors += pentry->nFee;
+        }
+    } else {
+        std::set<const CTxMemPoolEntry*> setAffected;
+        CalculateDescendants(entry, setAffected);
+        setAffected.insert(setAncestors.begin(), setAncestors.end());
+        BOOST_FOREACH(const CTxMemPoolEntry *pconst, setAffected) {
+            CTxMemPoolEntry *pentry = const_cast<CTxMemPoolEntry*>(pconst);
+            Unindex(pentry);
+            RecalculateTotals(*pentry);
+            Reindex(pentry);
+        }
+        RecalculateTotals(entry);
+    }
+    Reindex(&entry);
+    setByTime.insert(&entry);
+
+    nTransactionsUpdated++;
+    mainSignals.UpdatedMempool();
     return true;
 }
 
@@ -871,12 +1337,49 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                     remove(*it->second.ptx, true);
             }
         }
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            CTxMemPoolEntry &entry = mi->second;
+
+            // Take the entry out of the totals of its ancestors and descendants
+            std::set<const CTxMemPoolEntry*> setAncestors, setDescendants;
+            CalculateAncestors(entry, setAncestors);
+            CalculateDescendants(entry, setDescendants);
+            BOOST_FOREACH(const CTxMemPoolEntry *pparent, entry.setParents)
+                const_cast<CTxMemPoolEntry*>(pparent)->setChildren.erase(&entry);
+            BOOST_FOREACH(const CTxMemPoolEntry *pchild, entry.setChildren)
+                const_cast<CTxMemPoolEntry*>(pchild)->setParents.erase(&entry);
+            nTotalUsage -= (entry.setParents.size() + entry.setChildren.size()) * LinkUsage();
+            nTotalUsage -= entry.nUsageSize;
+            if (setDescendants.empty()) {
+                // The usual case: one descendant less for each ancestor
+                BOOST_FOREACH(const CTxMemPoolEntry *pconst, setAncestors) {
+                    CTxMemPoolEntry *pentry = const_cast<CTxMemPoolEntry*>(pconst);
+                    Unindex(pentry);
+                    pentry->nCountWithDescendants--;
+                    pentry->nSizeWithDescendants -= entry.nTxSize;
+                    pentry->nFeesWithDescendants -= entry.nFee;
+                    Reindex(pentry);
+                }
+            } else {
+                // The descendants may lose other ancestors through this entry as well
+                setDescendants.insert(setAncestors.begin(), setAncestors.end());
+                BOOST_FOREACH(const CTxMemPoolEntry *pconst, setDescendants) {
+                    CTxMemPoolEntry *pentry = const_cast<CTxMemPoolEntry*>(pconst);
+                    Unindex(pentry);
+                    RecalculateTotals(*pentry);
+                    Reindex(pentry);
+                }
+            }
+
+            Unindex(&entry);
+            setByTime.erase(&entry);
+            BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            mapTx.erase(mi);
             nTransactionsUpdated++;
+            mainSignals.UpdatedMempool();
         }
     }
     return true;
@@ -900,9 +1403,14 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    setByDescendantScore.clear();
+    setByTime.clear();
+    setByAncestorScore.clear();
     mapTx.clear();
     mapNextTx.clear();
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
+    mainSignals.UpdatedMempool();
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -911,10 +1419,226 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+bool CTxMemPool::CheckIndexes() const
+{
+    LOCK(cs);
+    if (setByDescendantScore.size() != mapTx.size() || setByTime.size() != mapTx.size() || setByAncestorScore.size() != mapTx.size())
+        return error("CTxMemPool::CheckIndexes() : index sizes differ from the pool size");
+
+    uint64 nUsage = 0;
+    for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi) {
+        const CTxMemPoolEntry &entry = mi->second;
+        if (!setByDescendantScore.count(&entry) || !setByTime.count(&entry) || !setByAncestorScore.count(&entry))
+            return error("CTxMemPool::CheckIndexes() : %s missing from an index", mi->first.ToString().c_str());
+
+        std::set<const CTxMemPoolEntry*> setParents;
+        BOOST_FOREACH(const CTxIn &txin, entry.tx.vin) {
+            const CTxMemPoolEntry *pparent = lookupEntry(txin.prevout.hash);
+            if (pparent)
+                setParents.insert(pparent);
+        }
+        if (setParents != entry.setParents)
+            return error("CTxMemPool::CheckIndexes() : wrong parents for %s", mi->first.ToString().c_str());
+        BOOST_FOREACH(const CTxMemPoolEntry *pchild, entry.setChildren)
+            if (!pchild->setParents.count(&entry))
+                return error("CTxMemPool::CheckIndexes() : wrong children for %s", mi->first.ToString().c_str());
+
+        if (GetEntryUsage(entry) != entry.nUsageSize)
+            return error("CTxMemPool::CheckIndexes() : wrong memory usage for %s", mi->first.ToString().c_str());
+        nUsage += entry.nUsageSize + entry.setParents.size() * LinkUsage();
+
+        CTxMemPoolEntry check(entry);
+        const_cast<CTxMemPool*>(this)->RecalculateTotals(check);
+        if (check.nCountWithAncestors != entry.nCountWithAncestors || check.nSizeWithAncestors != entry.nSizeWithAncestors ||
+            check.nFeesWithAncestors != entry.nFeesWithAncestors || check.nCountWithDescendants != entry.nCountWithDescendants ||
+            check.nSizeWithDescendants != entry.nSizeWithDescendants || check.nFeesWithDescendants != entry.nFeesWithDescendants)
+            return error("CTxMemPool::CheckIndexes() : wrong totals for %s", mi->first.ToString().c_str());
+    }
+    if (nUsage != nTotalUsage)
+        return error("CTxMemPool::CheckIndexes() : memory usage %"PRI64u" differs from %"PRI64u, nTotalUsage, nUsage);
+    return true;
+}
+
+void CTxMemPool::RemoveWithDescendants(const CTxMemPoolEntry *pentry)
+{
+    std::set<const CTxMemPoolEntry*> setRemove;
+    CalculateDescendants(*pentry, setRemove);
+    setRemove.insert(pentry);
+
+    // A descendant has more ancestors than any of the entries it descends from, so this removes children first
+    std::vector<std::pair<uint64, uint256> > vRemove;
+    BOOST_FOREACH(const CTxMemPoolEntry *p, setRemove)
+        vRemove.push_back(std::make_pair(p->nCountWithAncestors, p->hash));
+    std::sort(vRemove.rbegin(), vRemove.rend());
+    for (unsigned int i = 0; i < vRemove.size(); i++) {
+        CTransaction tx = mapTx[vRemove[i].second].tx;
+        remove(tx);
+    }
+}
+
+void CTxMemPool::TrimToSize(uint64 nSizeLimit)
+{
+    LOCK(cs);
+    double dMaxRemovedRate = 0;
+    unsigned int nEvicted = 0;
+    while (nTotalUsage > nSizeLimit && !setByDescendantScore.empty()) {
+        const CTxMemPoolEntry *pentry = *setByDescendantScore.begin();
+        // New transactions have to pay for relaying themselves on top of what the evicted ones paid
+        dMaxRemovedRate = std::max(dMaxRemovedRate, pentry->GetFeeRateWithDescendants() + CTransaction::nMinRelayTxFee);
+        nEvicted += pentry->nCountWithDescendants;
+        RemoveWithDescendants(pentry);
+    }
+    if (nEvicted > 0) {
+        // Decay the old value first, so that it is not refreshed as well
+        GetMinFee(nSizeLimit);
+        dRollingMinFee = std::max(dRollingMinFee, dMaxRemovedRate);
+        nLastRollingFeeUpdate = GetTime();
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, minimum fee now %.0f per kB\n", nEvicted, dRollingMinFee);
+    }
+}
+
+int CTxMemPool::Expire(int64 nTime)
+{
+    LOCK(cs);
+    int nRemoved = 0;
+    while (!setByTime.empty() && (*setByTime.begin())->nTime < nTime) {
+        const CTxMemPoolEntry *pentry = *setByTime.begin();
+        nRemoved += pentry->nCountWithDescendants;
+        RemoveWithDescendants(pentry);
+    }
+    if (nRemoved > 0 && fDebug)
+        printf("CTxMemPool::Expire() : removed %d transactions\n", nRemoved);
+    return nRemoved;
+}
+
+double CTxMemPool::GetMinFee(uint64 nSizeLimit)
+{
+    LOCK(cs);
+    if (dRollingMinFee == 0)
+        return 0;
+
+    int64 nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10) {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        if (nTotalUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nTotalUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinFee /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFee < CTransaction::nMinRelayTxFee / 2) {
+            dRollingMinFee = 0;
+            return 0;
+        }
+    }
+    return std::max(dRollingMinFee, (double)CTransaction::nMinRelayTxFee);
+}
+
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    static CCriticalSection cs_dump;
+    LOCK(cs_dump);
+    int64 nStart = GetTimeMillis();
+
+    std::vector<std::pair<CTransaction, int64> > vEntries;
+    {
+        LOCK(mempool.cs);
+        vEntries.reserve(mempool.mapTx.size());
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vEntries.push_back(std::make_pair(mi->second.tx, mi->second.nTime));
+    }
+
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    try {
+        CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (!fileout)
+            return error("DumpMempool() : open failed");
+        fileout << MEMPOOL_DUMP_VERSION << (uint64)vEntries.size();
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+            fileout << vEntries[i].first << vEntries[i].second;
+        FileCommit(fileout);
+        fileout.fclose();
+    } catch (std::exception &e) {
+        return error("DumpMempool() : I/O error: %s", e.what());
+    }
+    if (!RenameOver(pathTmp, path))
+        return error("DumpMempool() : rename failed");
+
+    printf("Dumped %"PRIszu" memory pool transactions in %"PRI64d"ms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+static bool ReadMempool()
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int64 nStart = GetTimeMillis();
+    int64 nExpiryTime = GetTime() - nMempoolExpiry;
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0;
+    try {
+        uint64 nVersion, nCount;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %"PRI64u, nVersion);
+        filein >> nCount;
+
+        // Take cs_main for a batch of transactions at a time, so blocks and peers are not held up
+        while (nCount > 0) {
+            boost::this_thread::interruption_point();
+            if (ShutdownRequested())
+                throw boost::thread_interrupted();
+            std::vector<CMemPoolBatchTx> vBatch;
+            for (; vBatch.size() < 100 && nCount > 0; nCount--) {
+                CTransaction tx;
+                int64 nTime;
+                filein >> tx >> nTime;
+                if (nTime < nExpiryTime)
+                    nExpired++;
+                else
+                    vBatch.push_back(CMemPoolBatchTx(tx, nTime));
+            }
+
+            LOCK(cs_main);
+            if (pcoinsTip == NULL)
+                throw boost::thread_interrupted();
+            AcceptToMemoryPoolBatch(vBatch, false);
+            BOOST_FOREACH(const CMemPoolBatchTx &batchtx, vBatch) {
+                if (batchtx.fAccepted)
+                    nAccepted++;
+                else
+                    nFailed++;
+            }
+        }
+    } catch (std::exception &e) {
+        return error("LoadMempool() : deserialize or I/O error: %s", e.what());
+    }
+
+    printf("Loaded %u memory pool transactions (%u failed, %u expired) in %"PRI64d"ms\n",
+           nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    bool fRet = ReadMempool();
+    // Unless the load was interrupted, there is nothing left in the file that dumping could lose
+    fMempoolLoaded = true;
+    return fRet;
+}
+
 
 
 
@@ -924,7 +1648,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1033,7 +1757,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
                     nHeight = coins.nHeight;
             }
             if (nHeight > 0)
-                pindexSlow = FindBlockByHeight(nHeight);
+                pindexSlow = chainActive[nHeight];
         }
     }
 
@@ -1063,22 +1787,109 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+CBlockIndex *CChain::SetTip(CBlockIndex *pindex) {
+    if (pindex == NULL) {
+        vChain.clear();
+        return NULL;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex) {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+    return pindex;
+}
+
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (pa == NULL || pb == NULL)
+        return NULL;
+    int nHeight = std::min(pa->nHeight, pb->nHeight);
+    pa = pa->GetAncestor(nHeight);
+    pb = pb->GetAncestor(nHeight);
+    if (pa == pb)
+        return pa;
+    if (pa->GetAncestor(0) != pb->GetAncestor(0))
+        return NULL;
+
+    // Below the fork both branches share all ancestors: bisect on its height
+    int nLow = 0, nHigh = nHeight;
+    while (nHigh - nLow > 1) {
+        int nMid = (nLow + nHigh) / 2;
+        if (pa->GetAncestor(nMid) == pb->GetAncestor(nMid))
+            nLow = nMid;
+        else
+            nHigh = nMid;
+    }
+    return pa->GetAncestor(nLow);
+}
+
+/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression performs well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                       heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+bool CBlockIndex::IsInMainChain() const
+{
+    return chainActive.Contains(this);
+}
+
+int64 CBlockIndex::GetMedianTime() const
+{
+    const CBlockIndex* pindex = this;
+    for (int i = 0; i < nMedianTimeSpan/2; i++)
+    {
+        const CBlockIndex* pindexNext = chainActive.Next(pindex);
+        if (!pindexNext)
+            return GetBlockTime();
+        pindex = pindexNext;
+    }
+    return pindex->GetMedianTimePast();
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
@@ -1227,9 +2038,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
         blockstogoback = retargetInterval;
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1346,12 +2155,49 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
     pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
     setBlockIndexValid.erase(pindex);
     InvalidChainFound(pindex);
-    if (pindex->pnext) {
+    if (chainActive.Contains(pindex)) {
         CValidationState stateDummy;
         ConnectBestBlock(stateDummy); // reorganise away from the failed block
     }
 }
 
+bool ReconnectBestChain(CValidationState &state)
+{
+    while (true) {
+        boost::this_thread::interruption_point();
+        LOCK(cs_main);
+
+        std::set<CBlockIndex*,CBlockIndexWorkComparator>::reverse_iterator it = setBlockIndexValid.rbegin();
+        if (it == setBlockIndexValid.rend())
+            return true;
+        CBlockIndex *pindexNewBest = *it;
+        if (pindexBest && pindexNewBest->nChainWork <= pindexBest->nChainWork)
+            return true;
+
+        // Only a plain extension of the current tip is connected in steps here;
+        // forks and failed blocks are left to ConnectBestBlock
+        int nHeight = pindexBest ? pindexBest->nHeight : -1;
+        if (pindexBest && pindexNewBest->GetAncestor(nHeight) != pindexBest)
+            return ConnectBestBlock(state);
+        vector<CBlockIndex*> vConnect;
+        for (CBlockIndex *pindex = pindexNewBest->GetAncestor(std::min(pindexNewBest->nHeight, nHeight + RECONNECT_BATCH_SIZE)); pindex != pindexBest; pindex = pindex->pprev) {
+            if (pindex->nStatus & BLOCK_FAILED_MASK)
+                return ConnectBestBlock(state);
+            vConnect.push_back(pindex);
+        }
+        reverse(vConnect.begin(), vConnect.end());
+
+        BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
+            try {
+                if (!SetBestChain(state, pindex))
+                    return false;
+            } catch(std::runtime_error &e) {
+                return state.Abort(_("System error: ") + e.what());
+            }
+        }
+    }
+}
+
 bool ConnectBestBlock(CValidationState &state) {
     do {
         CBlockIndex *pindexNewBest;
@@ -1386,7 +2232,7 @@ bool ConnectBestBlock(CValidationState &state) {
             if (pindexBest == NULL || pindexTest->nChainWork > pindexBest->nChainWork)
                 vAttach.push_back(pindexTest);
 
-            if (pindexTest->pprev == NULL || pindexTest->pnext != NULL) {
+            if (pindexTest->pprev == NULL || chainActive.Contains(pindexTest)) {
                 reverse(vAttach.begin(), vAttach.end());
                 BOOST_FOREACH(CBlockIndex *pindexSwitch, vAttach) {
                     boost::this_thread::interruption_point();
@@ -1592,7 +2438,26 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 
 
 
-bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
+bool GetAddressIndexDestination(const CScript &scriptPubKey, unsigned char &nAddressType, uint160 &hashAddress)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID *keyID = boost::get<CKeyID>(&dest)) {
+        nAddressType = ADDRESS_PUBKEYHASH;
+        hashAddress = *keyID;
+        return true;
+    }
+    if (const CScriptID *scriptID = boost::get<CScriptID>(&dest)) {
+        nAddressType = ADDRESS_SCRIPTHASH;
+        hashAddress = *scriptID;
+        return true;
+    }
+    return false;
+}
+
+bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean,
+                             std::vector<CAddressIndexUpdate> *pvAddressUpdates)
 {
     assert(pindex == view.GetBestBlock());
 
@@ -1611,11 +2476,25 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     if (blockUndo.vtxundo.size() + 1 != vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    bool fUpdateAddressIndex = fAddressIndex && pvAddressUpdates != NULL;
+    CAddressIndexUpdate addressUpdate;
+
     // undo transactions in reverse order
     for (int i = vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fUpdateAddressIndex) {
+            for (unsigned int j = 0; j < tx.vout.size(); j++) {
+                unsigned char nAddressType;
+                uint160 hashAddress;
+                if (GetAddressIndexDestination(tx.vout[j].scriptPubKey, nAddressType, hashAddress)) {
+                    addressUpdate.vHistoryErase.push_back(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, i, hash, j, false));
+                    addressUpdate.vUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, hash, j), CAddressUnspentValue()));
+                }
+            }
+        }
+
         // check that all outputs are available
         if (!view.HaveCoins(hash)) {
             fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
@@ -1664,10 +2543,21 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                 coins.vout[out.n] = undo.txout;
                 if (!view.SetCoins(out.hash, coins))
                     return error("DisconnectBlock() : cannot restore coin inputs");
+
+                unsigned char nAddressType;
+                uint160 hashAddress;
+                if (fUpdateAddressIndex && GetAddressIndexDestination(undo.txout.scriptPubKey, nAddressType, hashAddress)) {
+                    addressUpdate.vHistoryErase.push_back(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, i, hash, j, true));
+                    addressUpdate.vUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, out.hash, out.n),
+                                                               CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins.nHeight)));
+                }
             }
         }
     }
 
+    if (fUpdateAddressIndex)
+        pvAddressUpdates->push_back(addressUpdate);
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev);
 
@@ -1679,12 +2569,23 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     }
 }
 
+// Block and undo files written to since the last commit, and how much was written to them (cs_LastBlockFile)
+static std::set<int> setDirtyBlockFiles;
+static uint64 nUncommittedBytes = 0;
+// Set when pcoinsTip moved past the coin database
+static bool fUncommittedChainState = false;
+static int64 nLastCommitTime = 0;
+
 void static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // Never read through a mapping of a file that is about to be truncated
+    if (fFinalize)
+        blockfilemaps.Invalidate(nLastBlockFile);
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -1700,18 +2601,143 @@ void static FlushBlockFile(bool fFinalize = false)
         FileCommit(fileOld);
         fclose(fileOld);
     }
+
+    setDirtyBlockFiles.erase(nLastBlockFile);
+}
+
+// Commit the block and undo files written to since the last call
+void static FlushDirtyBlockFiles()
+{
+    LOCK(cs_LastBlockFile);
+
+    BOOST_FOREACH(int nFile, setDirtyBlockFiles) {
+        CDiskBlockPos pos(nFile, 0);
+        FILE *file = OpenBlockFile(pos);
+        if (file) {
+            FileCommit(file);
+            fclose(file);
+        }
+        file = OpenUndoFile(pos);
+        if (file) {
+            FileCommit(file);
+            fclose(file);
+        }
+    }
+    setDirtyBlockFiles.clear();
+    nUncommittedBytes = 0;
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+// Set when block or undo files grew; the next commit in CommitChainState checks the -prune target
+static bool fCheckForPruning = false;
+
+// Address index changes of the blocks SetBestChain moved through since the last commit, in order (cs_main)
+static std::vector<CAddressIndexUpdate> vPendingAddressUpdates;
+
+bool FlushAddressIndex(CValidationState &state)
+{
+    if (!fAddressIndex || vPendingAddressUpdates.empty())
+        return true;
+    if (!pblocktree->WriteAddressIndex(vPendingAddressUpdates, pcoinsTip->GetBestBlock()->GetBlockHash()))
+        return state.Abort(_("Failed to write address index"));
+    vPendingAddressUpdates.clear();
+    return true;
+}
+
+uint64 FindFilesToPrune(const std::vector<CBlockFileInfo> &vinfoBlockFile, int nTipHeight, uint64 nTarget, std::set<int> &setFilesToPrune)
+{
+    uint64 nCurrentUsage = 0;
+    BOOST_FOREACH(const CBlockFileInfo &info, vinfoBlockFile)
+        nCurrentUsage += info.nSize + info.nUndoSize;
+    if (nTipHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return nCurrentUsage;
+    unsigned int nLastHeightToPrune = nTipHeight - MIN_BLOCKS_TO_KEEP;
+
+    // Leave room for the next pre-allocated chunks as well
+    uint64 nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    for (int nFile = 0; nFile + 1 < (int)vinfoBlockFile.size() && nCurrentUsage + nBuffer >= nTarget; nFile++) {
+        const CBlockFileInfo &info = vinfoBlockFile[nFile];
+        if (info.nSize == 0 || info.nHeightLast > nLastHeightToPrune)
+            continue;
+        nCurrentUsage -= info.nSize + info.nUndoSize;
+        setFilesToPrune.insert(nFile);
+    }
+    return nCurrentUsage;
+}
+
+bool PruneBlockIndex(CValidationState &state, const std::set<int> &setFilesToPrune)
+{
+    std::vector<CDiskBlockIndex> vBlockIndex;
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi) {
+        CBlockIndex* pindex = (*mi).second;
+        if ((pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) && setFilesToPrune.count(pindex->nFile)) {
+            pindex->nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO);
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            vBlockIndex.push_back(CDiskBlockIndex(pindex));
+        }
+    }
+    if (!pblocktree->WritePrunedBlockFiles(vBlockIndex, setFilesToPrune))
+        return state.Abort(_("Failed to write block index"));
+    fHavePruned = true;
+    return true;
+}
+
+// Delete the oldest block and undo files while their total size exceeds nPruneTarget,
+// once the block index no longer refers to them.
+bool static PruneBlockFiles(CValidationState &state, int nTipHeight)
+{
+    fCheckForPruning = false;
+    if (!fPruneMode)
+        return true;
+
+    LOCK(cs_LastBlockFile);
+
+    std::vector<CBlockFileInfo> vinfoBlockFile(nLastBlockFile + 1);
+    for (int nFile = 0; nFile < nLastBlockFile; nFile++)
+        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+    vinfoBlockFile[nLastBlockFile] = infoLastBlockFile;
+
+    std::set<int> setFilesToPrune;
+    uint64 nCurrentUsage = FindFilesToPrune(vinfoBlockFile, nTipHeight, nPruneTarget, setFilesToPrune);
+    if (setFilesToPrune.empty())
+        return true;
+    if (!PruneBlockIndex(state, setFilesToPrune))
+        return false;
+
+    BOOST_FOREACH(int nFile, setFilesToPrune) {
+        setDirtyBlockFiles.erase(nFile);
+        blockfilemaps.Invalidate(nFile);
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile));
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("rev%05u.dat", nFile));
+        printf("Pruned block file %i: %s\n", nFile, vinfoBlockFile[nFile].ToString().c_str());
+    }
+    printf("PruneBlockFiles() : %"PRIszu" files pruned, %"PRI64u" MiB of block and undo data left\n", setFilesToPrune.size(), nCurrentUsage >> 20);
+
+    return true;
+}
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+// Store the basic filter of a block being connected, and its header (which commits to the previous one)
+bool static WriteBlockFilterIndex(CValidationState &state, const CBlock &block, CBlockIndex *pindex, const CBlockUndo *pblockundo)
+{
+    uint256 hashPrevHeader = 0;
+    if (pindex->pprev && !pblockfilterdb->ReadFilterHeader(pindex->pprev->GetBlockHash(), hashPrevHeader))
+        return state.Abort(_("Failed to read block filter header"));
+    CBlockFilter filter(block, pblockundo);
+    if (!pblockfilterdb->WriteFilter(filter, filter.ComputeHeader(hashPrevHeader)))
+        return state.Abort(_("Failed to write block filter index"));
+    return true;
+}
+
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck,
+                          std::vector<CAddressIndexUpdate> *pvAddressUpdates)
 {
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(state, !fJustCheck, !fJustCheck))
@@ -1723,6 +2749,9 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (GetHash() == hashGenesisBlock) {
+        if (fBlockFilterIndex && !fJustCheck)
+            if (!WriteBlockFilterIndex(state, *this, pindex, NULL))
+                return false;
         view.SetBestBlock(pindex);
         pindexGenesisBlock = pindex;
         return true;
@@ -1769,12 +2798,19 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(vtx.size());
+    bool fUpdateAddressIndex = fAddressIndex && pvAddressUpdates != NULL;
+    CAddressIndexUpdate addressUpdate;
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
 
+        // Transactions validated on entering the memory pool come with their fee and sigops worked out
+        int64 nTxFee = 0;
+        unsigned int nTxSigOps = 0;
+        bool fCached = fStrictPayToScriptHash && !tx.IsCoinBase() && mempool.lookupFeeAndSigOps(GetTxHash(i), nTxFee, nTxSigOps);
+
         nInputs += tx.vin.size();
-        nSigOps += tx.GetLegacySigOpCount();
+        nSigOps += fCached ? nTxSigOps : tx.GetLegacySigOpCount();
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return state.DoS(100, error("ConnectBlock() : too many sigops"));
 
@@ -1783,7 +2819,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             if (!tx.HaveInputs(view))
                 return state.DoS(100, error("ConnectBlock() : inputs missing/spent"));
 
-            if (fStrictPayToScriptHash)
+            if (fStrictPayToScriptHash && !fCached)
             {
                 // Add in sigops done by pay-to-script-hash inputs;
                 // this is to prevent a "rogue miner" from creating
@@ -1793,7 +2829,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
                      return state.DoS(100, error("ConnectBlock() : too many sigops"));
             }
 
-            nFees += tx.GetValueIn(view)-tx.GetValueOut();
+            nFees += fCached ? nTxFee : tx.GetValueIn(view)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
@@ -1806,6 +2842,28 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
+        if (fUpdateAddressIndex) {
+            const uint256 &hash = GetTxHash(i);
+            unsigned char nAddressType;
+            uint160 hashAddress;
+            if (!tx.IsCoinBase()) {
+                for (unsigned int j = 0; j < txundo.vprevout.size(); j++) {
+                    const CTxOut &prevout = txundo.vprevout[j].txout;
+                    if (GetAddressIndexDestination(prevout.scriptPubKey, nAddressType, hashAddress)) {
+                        addressUpdate.vHistoryAdd.push_back(make_pair(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, i, hash, j, true), -prevout.nValue));
+                        addressUpdate.vUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, tx.vin[j].prevout.hash, tx.vin[j].prevout.n), CAddressUnspentValue()));
+                    }
+                }
+            }
+            for (unsigned int j = 0; j < tx.vout.size(); j++) {
+                const CTxOut &out = tx.vout[j];
+                if (GetAddressIndexDestination(out.scriptPubKey, nAddressType, hashAddress)) {
+                    addressUpdate.vHistoryAdd.push_back(make_pair(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, i, hash, j, false), out.nValue));
+                    addressUpdate.vUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, hash, j), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+                }
+            }
+        }
+
         vPos.push_back(std::make_pair(GetTxHash(i), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
@@ -1825,6 +2883,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (!control.Wait())
         return state.DoS(100, false);
     int64 nTime2 = GetTimeMicros() - nStart;
+    if (fUpdateAddressIndex)
+        pvAddressUpdates->push_back(addressUpdate);
     if (fBenchmark)
         printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
 
@@ -1857,6 +2917,10 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    if (fBlockFilterIndex)
+        if (!WriteBlockFilterIndex(state, *this, pindex, &blockundo))
+            return false;
+
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
@@ -1874,19 +2938,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     CCoinsViewCache view(*pcoinsTip, true);
 
     // Find the fork (typically, there is none)
-    CBlockIndex* pfork = view.GetBestBlock();
-    CBlockIndex* plonger = pindexNew;
-    while (pfork && pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight) {
-            plonger = plonger->pprev;
-            assert(plonger != NULL);
-        }
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-        assert(pfork != NULL);
-    }
+    CBlockIndex* pfork = LastCommonAncestor(view.GetBestBlock(), pindexNew);
 
     // List of what to disconnect (typically nothing)
     vector<CBlockIndex*> vDisconnect;
@@ -1904,6 +2956,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         printf("REORGANIZE: Connect %"PRIszu" blocks; ..%s\n", vConnect.size(), pindexNew->GetBlockHash().ToString().c_str());
     }
 
+    // Address index changes, kept apart like the coins in view until all blocks went through
+    std::vector<CAddressIndexUpdate> vAddressUpdates;
+
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
@@ -1911,7 +2966,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.DisconnectBlock(state, pindex, view))
+        if (!block.DisconnectBlock(state, pindex, view, NULL, &vAddressUpdates))
             return error("SetBestBlock() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
         if (fBenchmark)
             printf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -1931,7 +2986,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, &vAddressUpdates)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -1950,38 +3005,24 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     int64 nStart = GetTimeMicros();
     int nModified = view.GetCacheSize();
     assert(view.Flush());
+    vPendingAddressUpdates.insert(vPendingAddressUpdates.end(), vAddressUpdates.begin(), vAddressUpdates.end());
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
         printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Write it to disk if the current group of blocks is complete
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
-        // Typical CCoins structures on disk are around 100 bytes in size.
-        // Pushing a new one to the database can cause it to be written
-        // twice (once in the log, and once in the tables). This is already
-        // an overestimation, as most will delete an existing entry or
-        // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
-            return state.Error();
-        FlushBlockFile();
-        pblocktree->Sync();
-        if (!pcoinsTip->Flush())
-            return state.Abort(_("Failed to write to coin database"));
-    }
+    fUncommittedChainState = true;
+    if (!CommitChainState(state))
+        return false;
 
-    // At this point, all changes have been done to the database.
+    // At this point, all changes are in the coin cache and the pending address index. They
+    // become durable once CommitChainState commits them, which may be a later call; after a
+    // crash before that, startup replays the blocks from the last committed best block.
     // Proceed by updating the memory structures.
 
-    // Disconnect shorter branch
-    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = NULL;
-
-    // Connect longer branch
-    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = pindex;
+    // Switch the active chain over to the longer branch
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect) {
@@ -2004,14 +3045,18 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         ::SetBestChain(locator);
     }
 
-    // New best block
-    hashBestChain = pindexNew->GetBlockHash();
+    // New best block. Waiters are woken only once pindexBest and friends are in place.
+    {
+        boost::mutex::scoped_lock lock(csBestBlock);
+        hashBestChain = pindexNew->GetBlockHash();
+    }
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    cvBlockChange.notify_all();
+    mainSignals.UpdatedBlockTip(pindexNew);
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -2055,15 +3100,16 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(*this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->nTx = vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
@@ -2097,6 +3143,62 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
 }
 
 
+bool CommitChainState(CValidationState &state, bool fForce)
+{
+    if (!fForce && !fCheckForPruning && pcoinsTip->GetCacheSize() <= nCoinCacheSize) {
+        // During the initial block download only a full cache is worth a commit
+        if (!fUncommittedChainState || IsInitialBlockDownload())
+            return true;
+        uint64 nBytes;
+        {
+            LOCK(cs_LastBlockFile);
+            nBytes = nUncommittedBytes;
+        }
+        if (GetTimeMillis() - nLastCommitTime < nSyncInterval && nBytes < nSyncBuffer)
+            return true;
+    }
+
+    // Typical CCoins structures on disk are around 100 bytes in size.
+    // Pushing a new one to the database can cause it to be written
+    // twice (once in the log, and once in the tables). This is already
+    // an overestimation, as most will delete an existing entry or
+    // overwrite one. Still, use a conservative safety factor of 2.
+    if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        return state.Error();
+
+    // Block data first, then the block index and the address index, and the coin database
+    // with its best block last, so that the best block never gets ahead of the data
+    FlushDirtyBlockFiles();
+    if (!FlushAddressIndex(state))
+        return false;
+    if (!pblocktree->Sync())
+        return state.Abort(_("Failed to sync block index"));
+    if (!pcoinsTip->Flush())
+        return state.Abort(_("Failed to write to coin database"));
+    fUncommittedChainState = false;
+    nLastCommitTime = GetTimeMillis();
+
+    // Only now that the coin database is past these blocks may their files go
+    CBlockIndex *pindexCommitted = pcoinsTip->GetBestBlock();
+    if (fCheckForPruning && pindexCommitted && !PruneBlockFiles(state, pindexCommitted->nHeight))
+        return false;
+    return true;
+}
+
+void ThreadCommitChainState()
+{
+    RenameThread("isracoin-commit");
+
+    while (true) {
+        MilliSleep(std::max(nSyncInterval, (int64)100));
+        LOCK(cs_main);
+        if (pcoinsTip == NULL || pblocktree == NULL)
+            return;
+        CValidationState state;
+        CommitChainState(state);
+    }
+}
+
 bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64 nTime, bool fKnown = false)
 {
     bool fUpdatedLast = false;
@@ -2121,6 +3223,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         }
         pos.nFile = nLastBlockFile;
         pos.nPos = infoLastBlockFile.nSize;
+        setDirtyBlockFiles.insert(pos.nFile);
+        nUncommittedBytes += nAddSize;
     }
 
     infoLastBlockFile.nSize += nAddSize;
@@ -2130,6 +3234,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (infoLastBlockFile.nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE *file = OpenBlockFile(pos);
                 if (file) {
@@ -2157,6 +3263,9 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 
     LOCK(cs_LastBlockFile);
 
+    setDirtyBlockFiles.insert(nFile);
+    nUncommittedBytes += nAddSize;
+
     unsigned int nNewSize;
     if (nFile == nLastBlockFile) {
         pos.nPos = infoLastBlockFile.nUndoSize;
@@ -2164,6 +3273,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
         if (!pblocktree->WriteBlockFileInfo(nLastBlockFile, infoLastBlockFile))
             return state.Abort(_("Failed to write block info"));
     } else {
+        // Undo data still goes to earlier files, which the mapped copy would not show
+        blockfilemaps.Invalidate(nFile);
         CBlockFileInfo info;
         if (!pblocktree->ReadBlockFileInfo(nFile, info))
             return state.Abort(_("Failed to read block info"));
@@ -2176,6 +3287,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE *file = OpenUndoFile(pos);
             if (file) {
@@ -2197,6 +3310,10 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    // Already done, e.g. by an import worker thread
+    if (fChecked)
+        return true;
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"));
@@ -2247,6 +3364,8 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        fChecked = true;
     return true;
 }
 
@@ -2261,7 +3380,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2395,15 +3514,14 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().c_str());
 
-        // Accept orphans as long as there is a node to request its parents from
-        if (pfrom) {
-            CBlock* pblock2 = new CBlock(*pblock);
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        // Keep orphans until their parents arrive; imported ones have no node to ask for them
+        CBlock* pblock2 = new CBlock(*pblock);
+        mapOrphanBlocks.insert(make_pair(hash, pblock2));
+        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
+        // Ask this guy to fill in what we're missing
+        if (pfrom)
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
-        }
         return true;
     }
 
@@ -2469,6 +3587,37 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(CBufferReader& blockIn, CBloomFilter& filter, vector<CFlatData>& vMatchedTxData)
+{
+    blockIn >> header;
+    unsigned int nTx = ReadCompactSize(blockIn);
+
+    vector<bool> vMatch;
+    vector<uint256> vHashes;
+
+    vMatch.reserve(nTx);
+    vHashes.reserve(nTx);
+
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        const char* pbegin = blockIn.pos();
+        CTransaction tx;
+        blockIn >> tx;
+        uint256 hash = Hash(pbegin, blockIn.pos());
+        if (filter.IsRelevantAndUpdate(tx, hash))
+        {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(make_pair(i, hash));
+            vMatchedTxData.push_back(CFlatData((void*)pbegin, (void*)blockIn.pos()));
+        }
+        else
+            vMatch.push_back(false);
+        vHashes.push_back(hash);
+    }
+
+    txn = CPartialMerkleTree(vHashes, vMatch);
+}
+
 
 
 
@@ -2650,20 +3799,55 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
     return OpenDiskFile(pos, "rev", fReadOnly);
 }
 
+bool ReadRawBlockFromDisk(CDataStream &ss, const CDiskBlockPos &pos)
+{
+    // Finalized block files are served from their memory mapping
+    const char *pbegin, *pend;
+    if (blockfilemaps.MapBlock(pos, pbegin, pend)) {
+        ss.write(pbegin, pend - pbegin);
+        return true;
+    }
+
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("ReadRawBlockFromDisk() : invalid position");
+
+    // Open the block file at the record header in front of the block
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+
+    unsigned char pchMessageStartFile[4];
+    unsigned int nSize;
+    try {
+        filein >> FLATDATA(pchMessageStartFile) >> nSize;
+    }
+    catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    if (memcmp(pchMessageStartFile, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize > MAX_BLOCK_SIZE)
+        return error("ReadRawBlockFromDisk() : invalid record header in blk%05u.dat at %u", pos.nFile, pos.nPos);
+
+    unsigned int nStart = ss.size();
+    ss.resize(nStart + nSize);
+    if (nSize > 0 && fread(&ss[nStart], 1, nSize, filein) != nSize) {
+        ss.resize(nStart);
+        return error("ReadRawBlockFromDisk() : short read in blk%05u.dat at %u", pos.nFile, pos.nPos);
+    }
+    return true;
+}
+
 CBlockIndex * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -2677,22 +3861,23 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainWork in a single pass: every entry is completed after its
+    // ancestors, which are walked back until one that is already done (every block
+    // has nonzero work, so a zero nChainWork marks an entry not yet visited)
+    vector<CBlockIndex*> vPending;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
-            setBlockIndexValid.insert(pindex);
+        for (CBlockIndex* pindex = item.second; pindex && pindex->nChainWork == 0; pindex = pindex->pprev)
+            vPending.push_back(pindex);
+        while (!vPending.empty()) {
+            CBlockIndex* pindex = vPending.back();
+            vPending.pop_back();
+            pindex->BuildSkip();
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+        }
     }
 
     // Load block file info
@@ -2715,6 +3900,19 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    printf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+
+    // Check whether we have a block filter index
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    printf("LoadBlockIndexDB(): block filter index %s\n", fBlockFilterIndex ? "enabled" : "disabled");
+
+    // Check whether block files have been pruned before
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        printf("LoadBlockIndexDB(): block files have previously been pruned\n");
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -2723,13 +3921,8 @@ bool static LoadBlockIndexDB()
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexBest->nChainWork;
 
-    // set 'next' pointers in best chain
-    CBlockIndex *pindex = pindexBest;
-    while(pindex != NULL && pindex->pprev != NULL) {
-         CBlockIndex *pindexPrev = pindex->pprev;
-         pindexPrev->pnext = pindex;
-         pindex = pindexPrev;
-    }
+    // Index the best chain by height
+    chainActive.SetTip(pindexBest);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2737,82 +3930,291 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
-bool VerifyDB(int nCheckLevel, int nCheckDepth)
+namespace {
+
+/** Number of blocks read and checked together by VerifyDB before they are disconnected */
+const size_t VERIFY_BATCH_SIZE = 128;
+
+CCriticalSection cs_verifyStatus;
+CVerifyStatus verifyStatus;
+boost::thread* pthreadVerify = NULL;
+
+/** Work shared by the threads reading and checking a batch of blocks for VerifyDB */
+struct CVerifyBatch
 {
-    if (pindexBest == NULL || pindexBest->pprev == NULL)
-        return true;
+    const std::vector<CBlockIndex*>& vIndex;
+    std::vector<CBlock>& vBlock;
+    int nCheckLevel;
 
-    // Verify blocks in the best chain
-    if (nCheckDepth <= 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(*pcoinsTip, true);
-    CBlockIndex* pindexState = pindexBest;
+    boost::mutex mutex;
+    size_t nNext;
+    size_t nFailed; // lowest position that failed, vIndex.size() if none did
+    std::string strError;
+
+    CVerifyBatch(const std::vector<CBlockIndex*>& vIndexIn, std::vector<CBlock>& vBlockIn, int nCheckLevelIn) :
+        vIndex(vIndexIn), vBlock(vBlockIn), nCheckLevel(nCheckLevelIn), nNext(0), nFailed(vIndexIn.size()) {}
+};
+
+// check levels 0 to 2, which only depend on the block itself
+bool VerifyBlockData(const CBlockIndex* pindex, CBlock& block, int nCheckLevel, std::string& strError)
+{
+    // check level 0: read from disk
+    if (!block.ReadFromDisk(pindex)) {
+        strError = strprintf("block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        return false;
+    }
+    // check level 1: verify block validity
+    CValidationState state;
+    if (nCheckLevel >= 1 && !block.CheckBlock(state)) {
+        strError = strprintf("found bad block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        return false;
+    }
+    // check level 2: verify undo validity
+    if (nCheckLevel >= 2) {
+        CBlockUndo undo;
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (!pos.IsNull() && !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash())) {
+            strError = strprintf("found bad undo data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+void ThreadVerifyBatch(CVerifyBatch* pbatch)
+{
+    while (true) {
+        boost::this_thread::interruption_point();
+        size_t i;
+        {
+            boost::mutex::scoped_lock lock(pbatch->mutex);
+            if (pbatch->nNext >= pbatch->vIndex.size() || pbatch->nFailed < pbatch->vIndex.size())
+                return;
+            i = pbatch->nNext++;
+        }
+        std::string strError;
+        if (!VerifyBlockData(pbatch->vIndex[i], pbatch->vBlock[i], pbatch->nCheckLevel, strError)) {
+            boost::mutex::scoped_lock lock(pbatch->mutex);
+            if (i < pbatch->nFailed) {
+                pbatch->nFailed = i;
+                pbatch->strError = strError;
+            }
+        }
+    }
+}
+
+// Read and check vIndex into vBlock on nThreads threads; returns the position of a failed block, or vIndex.size()
+size_t VerifyBatch(const std::vector<CBlockIndex*>& vIndex, std::vector<CBlock>& vBlock, int nCheckLevel, int nThreads, std::string& strError)
+{
+    CVerifyBatch batch(vIndex, vBlock, nCheckLevel);
+    boost::thread_group threads;
+    for (int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ThreadVerifyBatch, &batch));
+    try {
+        ThreadVerifyBatch(&batch);
+        threads.join_all();
+    } catch (...) {
+        // the workers point into batch, which is about to go
+        threads.interrupt_all();
+        threads.join_all();
+        throw;
+    }
+    strError = batch.strError;
+    return batch.nFailed;
+}
+
+bool VerifyDBInternal(int nCheckLevel, int nCheckDepth, bool& fAborted)
+{
+    // The blocks to check are picked from the best chain at the start; only the
+    // disconnect and reconnect steps need cs_main, and they stop if the best
+    // chain moves meanwhile (which can only happen for a background check)
+    std::vector<CBlockIndex*> vIndex;
+    CBlockIndex* pindexTip;
+    boost::scoped_ptr<CCoinsViewCache> pcoins;
+    {
+        LOCK(cs_main);
+        pindexTip = pindexBest;
+        if (pindexTip == NULL || pindexTip->pprev == NULL)
+            return true;
+
+        // Verify blocks in the best chain
+        if (nCheckDepth <= 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > pindexTip->nHeight)
+            nCheckDepth = pindexTip->nHeight;
+        printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+        for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
+        {
+            if (pindex->nHeight < pindexTip->nHeight-nCheckDepth)
+                break;
+            if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                // Nothing to check below this point, the block files are gone
+                printf("VerifyDB() : block data pruned below height %d, stopping\n", pindex->nHeight + 1);
+                break;
+            }
+            vIndex.push_back(pindex);
+        }
+        pcoins.reset(new CCoinsViewCache(*pcoinsTip, true));
+    }
+
+    CCoinsViewCache& coins = *pcoins;
+    CBlockIndex* pindexState = pindexTip;
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), 8));
+    for (size_t nStart = 0; nStart < vIndex.size(); nStart += VERIFY_BATCH_SIZE)
     {
         boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!block.ReadFromDisk(pindex))
-            return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !block.CheckBlock(state))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            }
+        std::vector<CBlockIndex*> vBatch(vIndex.begin() + nStart, vIndex.begin() + std::min(vIndex.size(), nStart + VERIFY_BATCH_SIZE));
+        std::vector<CBlock> vBlock(vBatch.size());
+        std::string strError;
+        size_t nFailed = VerifyBatch(vBatch, vBlock, nCheckLevel, nThreads, strError);
+        if (nFailed < vBatch.size()) {
+            LOCK(cs_main);
+            if (!(vBatch[nFailed]->nStatus & BLOCK_HAVE_DATA)) {
+                // pruned while a background check was reading it
+                printf("VerifyDB() : block data pruned below height %d, stopping\n", vBatch[nFailed]->nHeight + 1);
+                vBatch.resize(nFailed);
+                vIndex.resize(nStart + nFailed);
+            } else
+                return error("VerifyDB() : *** %s", strError.c_str());
+        }
+        {
+            LOCK(cs_verifyStatus);
+            verifyStatus.nBlocksChecked = nStart + vBatch.size();
         }
+
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel < 3 || vBatch.empty())
+            continue;
+        LOCK(cs_main);
+        if (pindexBest != pindexTip) {
+            printf("VerifyDB() : best chain changed during verification, aborted\n");
+            fAborted = true;
+            return false;
+        }
+        for (size_t i = 0; i < vBatch.size(); i++)
+        {
+            CBlockIndex* pindex = vBatch[i];
+            if (pindex != pindexState || (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) > 2*nCoinCacheSize + 32000)
+                break;
             bool fClean = true;
-            if (!block.DisconnectBlock(state, pindex, coins, &fClean))
+            if (!vBlock[i].DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
             pindexState = pindex->pprev;
             if (!fClean) {
                 nGoodTransactions = 0;
                 pindexFailure = pindex;
             } else
-                nGoodTransactions += block.vtx.size();
+                nGoodTransactions += vBlock[i].vtx.size();
+        }
+    }
+    if (pindexFailure)
+        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexTip->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
+
+    // check level 4: try reconnecting blocks
+    if (nCheckLevel >= 4) {
+        LOCK(cs_main);
+        if (pindexBest != pindexTip) {
+            printf("VerifyDB() : best chain changed during verification, aborted\n");
+            fAborted = true;
+            return false;
+        }
+        CBlockIndex *pindex = pindexState;
+        while (pindex != pindexTip) {
+            boost::this_thread::interruption_point();
+            pindex = chainActive.Next(pindex);
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+                return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+            if (!block.ConnectBlock(state, pindex, coins))
+                return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         }
     }
-    if (pindexFailure)
-        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexBest->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
 
-    // check level 4: try reconnecting blocks
-    if (nCheckLevel >= 4) {
-        CBlockIndex *pindex = pindexState;
-        while (pindex != pindexBest) {
-            boost::this_thread::interruption_point();
-            pindex = pindex->pnext;
-            CBlock block;
-            if (!block.ReadFromDisk(pindex))
-                return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            if (!block.ConnectBlock(state, pindex, coins))
-                return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-        }
+    printf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexTip->nHeight - pindexState->nHeight, nGoodTransactions);
+
+    return true;
+}
+
+void ThreadVerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("isracoin-verify");
+    try {
+        VerifyDB(nCheckLevel, nCheckDepth);
+    } catch (boost::thread_interrupted&) {
+        printf("VerifyDB() : background verification interrupted\n");
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadVerifyDB()");
+    }
+}
+
+} // anon namespace
+
+bool VerifyDB(int nCheckLevel, int nCheckDepth, bool *pfAborted)
+{
+    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
+    {
+        LOCK(cs_verifyStatus);
+        verifyStatus.fRunning = true;
+        verifyStatus.nCheckLevel = nCheckLevel;
+        verifyStatus.nCheckDepth = nCheckDepth;
+        verifyStatus.nBlocksChecked = 0;
+        verifyStatus.nTimeStart = GetTime();
+        verifyStatus.strResult = "";
+    }
+    bool fResult = false, fAborted = false;
+    try {
+        fResult = VerifyDBInternal(nCheckLevel, nCheckDepth, fAborted);
+    } catch (...) {
+        LOCK(cs_verifyStatus);
+        verifyStatus.fRunning = false;
+        verifyStatus.strResult = "interrupted";
+        throw;
+    }
+    LOCK(cs_verifyStatus);
+    verifyStatus.fRunning = false;
+    verifyStatus.strResult = fResult ? "ok" : fAborted ? "aborted" : "failed";
+    if (pfAborted)
+        *pfAborted = fAborted;
+    return fResult;
+}
+
+bool StartVerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    {
+        LOCK(cs_verifyStatus);
+        if (verifyStatus.fRunning)
+            return false;
+        verifyStatus.fRunning = true;
     }
+    StopVerifyDB();
+    pthreadVerify = new boost::thread(boost::bind(&ThreadVerifyDB, nCheckLevel, nCheckDepth));
+    return true;
+}
 
-    printf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexBest->nHeight - pindexState->nHeight, nGoodTransactions);
+void StopVerifyDB()
+{
+    if (pthreadVerify == NULL)
+        return;
+    pthreadVerify->interrupt();
+    pthreadVerify->join();
+    delete pthreadVerify;
+    pthreadVerify = NULL;
+}
 
-    return true;
+CVerifyStatus GetVerifyStatus()
+{
+    LOCK(cs_verifyStatus);
+    return verifyStatus;
 }
 
 void UnloadBlockIndex()
 {
+    blockfilemaps.Clear();
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2820,6 +4222,7 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    chainActive.SetTip(NULL);
 }
 
 bool LoadBlockIndex()
@@ -2852,6 +4255,10 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", false);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
     printf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -2915,7 +4322,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2968,7 +4375,7 @@ void PrintBlockTree()
         vector<CBlockIndex*>& vNext = mapNext[pindex];
         for (unsigned int i = 0; i < vNext.size(); i++)
         {
-            if (vNext[i]->pnext)
+            if (chainActive.Contains(vNext[i]))
             {
                 swap(vNext[0], vNext[i]);
                 break;
@@ -2981,82 +4388,6 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
-{
-    int64 nStart = GetTimeMillis();
-
-    int nLoaded = 0;
-    try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
-        }
-        uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[4];
-                blkdat.FindByte(pchMessageStart[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, pchMessageStart, 4))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
-            } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
-            }
-        }
-        fclose(fileIn);
-    } catch(std::runtime_error &e) {
-        AbortNode(_("Error: system error: ") + e.what());
-    }
-    if (nLoaded > 0)
-        printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
-}
-
-
-
-
-
 
 
 
@@ -3187,10 +4518,16 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = true;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 pfrom->nBlocksRequested++;
                 if (mi != mapBlockIndex.end())
                 {
+                    // Don't pretend to have blocks whose data was pruned
+                    if (!(((*mi).second)->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        printf("ProcessGetData(): ignoring request for pruned block %s\n", inv.hash.ToString().c_str());
+                        send = false;
+                    }
                     // If the requested block is at a height below our last
                     // checkpoint, only serve it if it's in the checkpointed chain
                     int nHeight = ((*mi).second)->nHeight;
@@ -3207,17 +4544,32 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    CDiskBlockPos pos = ((*mi).second)->GetBlockPos();
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // Send block from disk, copying its stored serialization straight into the send buffer
+                        pfrom->BeginMessage("block");
+                        bool fRead = false;
+                        try {
+                            fRead = ReadRawBlockFromDisk(pfrom->ssSend, pos);
+                        } catch (...) {
+                            pfrom->AbortMessage();
+                            throw;
+                        }
+                        if (fRead)
+                            pfrom->EndMessage();
+                        else
+                            pfrom->AbortMessage();
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                        if (pfrom->pfilter && ReadRawBlockFromDisk(ssBlock, pos))
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CBufferReader blockIn(&ssBlock[0], &ssBlock[0] + ssBlock.size(), SER_NETWORK, PROTOCOL_VERSION);
+                            vector<CFlatData> vMatchedTxData;
+                            CMerkleBlock merkleBlock(blockIn, *pfrom->pfilter, vMatchedTxData);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3225,10 +4577,9 @@ void static ProcessGetData(CNode* pfrom)
                             // they must either disconnect and retry or request the full block.
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            for (unsigned int i = 0; i < merkleBlock.vMatchedTxn.size(); i++)
+                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, merkleBlock.vMatchedTxn[i].second)))
+                                    pfrom->PushMessage("tx", vMatchedTxData[i]);
                         }
                         // else
                             // no response
@@ -3297,6 +4648,35 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Find the blocks covered by a getcfilters or getcfheaders request: the ancestors of
+// hashStop from nStartHeight on. Returns false if the request cannot be served.
+bool static GetCFilterRange(CNode* pfrom, unsigned char nFilterType, unsigned int nStartHeight, const uint256 &hashStop,
+                            unsigned int nMaxSize, std::vector<CBlockIndex*> &vBlocks)
+{
+    if (nFilterType != BLOCK_FILTER_BASIC)
+        return error("peer %s requested unsupported filter type %d", pfrom->addr.ToString().c_str(), nFilterType);
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+    if (mi == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindexStop = (*mi).second;
+    // filters only exist for blocks that have been connected
+    if ((pindexStop->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
+        return false;
+
+    if (nStartHeight > (unsigned int)pindexStop->nHeight || pindexStop->nHeight - nStartHeight >= nMaxSize)
+    {
+        pfrom->Misbehaving(20);
+        return error("peer %s requested filters for %d to %s", pfrom->addr.ToString().c_str(), nStartHeight, hashStop.ToString().c_str());
+    }
+
+    vBlocks.resize(pindexStop->nHeight - nStartHeight + 1);
+    CBlockIndex* pindex = pindexStop;
+    for (unsigned int i = vBlocks.size(); i > 0; i--, pindex = pindex->pprev)
+        vBlocks[i - 1] = pindex;
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3577,10 +4957,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Send the rest of the chain
         if (pindex)
-            pindex = pindex->pnext;
+            pindex = chainActive.Next(pindex);
         int nLimit = 500;
         printf("getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str(), nLimit);
-        for (; pindex; pindex = pindex->pnext)
+        for (; pindex; pindex = chainActive.Next(pindex))
         {
             if (pindex->GetBlockHash() == hashStop)
             {
@@ -3610,7 +4990,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3620,14 +5000,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             // Find the last block the caller has in the main chain
             pindex = locator.GetBlockIndex();
             if (pindex)
-                pindex = pindex->pnext;
+                pindex = chainActive.Next(pindex);
         }
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
         int nLimit = 2000;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
-        for (; pindex; pindex = pindex->pnext)
+        for (; pindex; pindex = chainActive.Next(pindex))
         {
             vHeaders.push_back(pindex->GetBlockHeader());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
@@ -3662,34 +5042,44 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 tx.GetHash().ToString().c_str(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            // Process the orphan transactions that depended on this one, a generation at a time, so
+            // the scripts of each generation are checked together on the script check threads.
+            // Use dummy validation states so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            set<uint256> setDone;
+            for (unsigned int i = 0; i < vWorkQueue.size(); )
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
+                vector<CMemPoolBatchTx> vBatch;
+                set<uint256> setQueued;
+                for (; i < vWorkQueue.size(); i++)
+                {
+                    // The orphans spending any output of the transaction
+                    map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.lower_bound(COutPoint(vWorkQueue[i], 0));
+                    for (; itByPrev != mapOrphanTransactionsByPrev.end() && itByPrev->first.hash == vWorkQueue[i]; ++itByPrev)
+                        BOOST_FOREACH(const uint256 &orphanHash, itByPrev->second)
+                            if (!setDone.count(orphanHash) && setQueued.insert(orphanHash).second)
+                                vBatch.push_back(CMemPoolBatchTx(mapOrphanTransactions[orphanHash].tx));
+                }
+
+                AcceptToMemoryPoolBatch(vBatch, true);
+                BOOST_FOREACH(const CMemPoolBatchTx &batchtx, vBatch)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+                    uint256 orphanHash = batchtx.tx.GetHash();
+                    if (batchtx.fAccepted)
                     {
                         printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
-                        RelayTransaction(orphanTx, orphanHash);
+                        RelayTransaction(batchtx.tx, orphanHash);
                         mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
                         vWorkQueue.push_back(orphanHash);
                         vEraseQueue.push_back(orphanHash);
+                        setDone.insert(orphanHash);
                     }
-                    else if (!fMissingInputs2)
+                    else if (!batchtx.fMissingInputs)
                     {
                         // invalid or too-little-fee orphan
                         vEraseQueue.push_back(orphanHash);
+                        setDone.insert(orphanHash);
                         printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
                     }
                 }
@@ -3700,12 +5090,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(tx, pfrom->id);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
             if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+                printf("mapOrphan overflow or expiry, removed %u tx\n", nEvicted);
         }
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
@@ -3878,6 +5268,87 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (!fBlockFilterIndex &&
+             (strCommand == "getcfilters" ||
+              strCommand == "getcfheaders" ||
+              strCommand == "getcfcheckpt"))
+    {
+        pfrom->CloseSocketDisconnect();
+        return error("peer %s requested compact block filters even though we do not advertise that service",
+                     pfrom->addr.ToString().c_str());
+    }
+
+    else if (strCommand == "getcfilters")
+    {
+        unsigned char nFilterType;
+        unsigned int nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        std::vector<CBlockIndex*> vBlocks;
+        if (!GetCFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vBlocks))
+            return true;
+
+        BOOST_FOREACH(CBlockIndex* pindex, vBlocks) {
+            CBlockFilter filter;
+            if (!pblockfilterdb->ReadFilter(pindex->GetBlockHash(), filter))
+                return error("getcfilters : filter for block %s not found", pindex->GetBlockHash().ToString().c_str());
+            pfrom->PushMessage("cfilter", nFilterType, filter.GetBlockHash(), filter.GetEncoded());
+        }
+    }
+
+
+    else if (strCommand == "getcfheaders")
+    {
+        unsigned char nFilterType;
+        unsigned int nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        std::vector<CBlockIndex*> vBlocks;
+        if (!GetCFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vBlocks))
+            return true;
+
+        uint256 hashPrevHeader = 0;
+        if (vBlocks[0]->pprev && !pblockfilterdb->ReadFilterHeader(vBlocks[0]->pprev->GetBlockHash(), hashPrevHeader))
+            return error("getcfheaders : filter header for block %s not found", vBlocks[0]->pprev->GetBlockHash().ToString().c_str());
+
+        std::vector<uint256> vFilterHashes;
+        vFilterHashes.reserve(vBlocks.size());
+        BOOST_FOREACH(CBlockIndex* pindex, vBlocks) {
+            CBlockFilter filter;
+            if (!pblockfilterdb->ReadFilter(pindex->GetBlockHash(), filter))
+                return error("getcfheaders : filter for block %s not found", pindex->GetBlockHash().ToString().c_str());
+            vFilterHashes.push_back(filter.GetHash());
+        }
+        pfrom->PushMessage("cfheaders", nFilterType, hashStop, hashPrevHeader, vFilterHashes);
+    }
+
+
+    else if (strCommand == "getcfcheckpt")
+    {
+        unsigned char nFilterType;
+        uint256 hashStop;
+        vRecv >> nFilterType >> hashStop;
+
+        if (nFilterType != BLOCK_FILTER_BASIC)
+            return error("peer %s requested unsupported filter type %d", pfrom->addr.ToString().c_str(), nFilterType);
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end() || ((*mi).second->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
+            return true;
+
+        // Filter headers at every CFCHECKPT_INTERVAL blocks up to hashStop
+        CBlockIndex* pindexStop = (*mi).second;
+        std::vector<uint256> vHeaders(pindexStop->nHeight / CFCHECKPT_INTERVAL);
+        for (unsigned int i = 0; i < vHeaders.size(); i++) {
+            CBlockIndex* pindex = pindexStop->GetAncestor((i + 1) * CFCHECKPT_INTERVAL);
+            if (!pblockfilterdb->ReadFilterHeader(pindex->GetBlockHash(), vHeaders[i]))
+                return error("getcfcheckpt : filter header for block %s not found", pindex->GetBlockHash().ToString().c_str());
+        }
+        pfrom->PushMessage("cfcheckpt", nFilterType, hashStop, vHeaders);
+    }
+
+
     else
     {
         // Ignore unknown commands for extensibility
@@ -4240,58 +5711,248 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
+
+// The memory pool transactions of the next block, checked against the coins of the
+// transactions before them. It is kept between calls to CreateNewBlock and only
+// extended by the transactions that entered the pool since, until the tip changes,
+// a transaction in it leaves the pool or it gets older than TEMPLATE_REBUILD_INTERVAL.
+// Scripts are only verified for transactions the pool accepted without checking them.
+// Callers hold cs_main and mempool.cs.
+class CBlockAssembler
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    CBlockIndex *pindexPrev;
+    int nHeight;
+    CCoinsViewCache *pcoinsBase;
+    CCoinsViewCache view;
+    int64 nTimeStart;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    uint64 nBlockSize;
+    int nBlockSigOps;
+    int64 nFees;
+    bool fPrintPriority;
+    bool fPriorityAdded;
+
+    // By hash, as entries may leave the pool and come back at another address
+    std::set<uint256> setInBlock;
+    std::set<uint256> setFailed;
+
+    CBlockAssembler(CBlockIndex *pindexPrevIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn) :
+        pindexPrev(pindexPrevIn), nHeight(pindexPrevIn->nHeight), pcoinsBase(pcoinsTip), view(*pcoinsTip, true), nTimeStart(GetTime()),
+        nBlockMaxSize(nBlockMaxSizeIn), nBlockPrioritySize(nBlockPrioritySizeIn), nBlockMinSize(nBlockMinSizeIn),
+        nBlockSize(1000), nBlockSigOps(100), nFees(0), fPriorityAdded(false)
+    {
+        fPrintPriority = GetBoolArg("-printpriority");
+    }
 
-    COrphan(CTransaction* ptxIn)
+    bool IsCurrent(unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn) const
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        if (pindexPrev != pindexBest || nHeight != pindexBest->nHeight || pcoinsBase != pcoinsTip)
+            return false;
+        if (nBlockMaxSize != nBlockMaxSizeIn || nBlockPrioritySize != nBlockPrioritySizeIn || nBlockMinSize != nBlockMinSizeIn)
+            return false;
+        // Better paying transactions that arrived since cannot take the place of those already in
+        if (GetTime() - nTimeStart >= TEMPLATE_REBUILD_INTERVAL)
+            return false;
+        BOOST_FOREACH(const uint256 &hash, setInBlock)
+            if (!mempool.exists(hash))
+                return false;
+        return true;
     }
 
-    void print() const
+    bool Skip(const CTxMemPoolEntry *pentry) const
     {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().c_str());
+        return setInBlock.count(pentry->hash) || setFailed.count(pentry->hash);
     }
-};
 
+    bool AddTx(const CTxMemPoolEntry *pentry, CCoinsViewCache &viewTx)
+    {
+        const CTransaction &tx = pentry->tx;
+        if (tx.IsCoinBase() || !tx.IsFinal())
+            return false;
+
+        // Size limits
+        if (nBlockSize + pentry->nTxSize >= nBlockMaxSize)
+            return false;
 
-uint64 nLastBlockTx = 0;
-uint64 nLastBlockSize = 0;
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = pentry->fInputsChecked ? pentry->nSigOps : tx.GetLegacySigOpCount();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+        if (!tx.HaveInputs(viewTx))
+            return false;
+
+        // Only entries that were not validated on entering the pool need their fee and sigops worked out
+        int64 nTxFees = pentry->nFee;
+        if (!pentry->fInputsChecked)
+        {
+            nTxFees = tx.GetValueIn(viewTx)-tx.GetValueOut();
+            nTxSigOps += tx.GetP2SHSigOpCount(viewTx);
+            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+                return false;
+        }
+
+        CValidationState state;
+        if (!tx.CheckInputs(state, viewTx, !pentry->fInputsChecked, SCRIPT_VERIFY_P2SH))
+            return false;
+
+        CTxUndo txundo;
+        tx.UpdateCoins(state, viewTx, txundo, pindexPrev->nHeight+1, pentry->hash);
+
+        // Added
+        vtx.push_back(tx);
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += pentry->nTxSize;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        setInBlock.insert(pentry->hash);
+
+        if (fPrintPriority)
+        {
+            printf("priority %.1f feeperkb %.1f txid %s\n",
+                   pentry->GetPriority(pindexPrev->nHeight), pentry->GetFeeRate(), pentry->hash.ToString().c_str());
+        }
+        return true;
+    }
+
+    bool HasParentsInBlock(const CTxMemPoolEntry *pentry) const
     {
-        if (byFee)
+        BOOST_FOREACH(const CTxMemPoolEntry *pparent, pentry->setParents)
+            if (!setInBlock.count(pparent->hash))
+                return false;
+        return true;
+    }
+
+    // Add the transactions with the highest priority, regardless of their fees, up to nBlockPrioritySize
+    void AddPriorityTxs()
+    {
+        std::vector<std::pair<double, const CTxMemPoolEntry*> > vecPriority;
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            if (!Skip(&mi->second) && HasParentsInBlock(&mi->second))
+                vecPriority.push_back(std::make_pair(mi->second.GetPriority(pindexPrev->nHeight), &mi->second));
+        std::make_heap(vecPriority.begin(), vecPriority.end());
+
+        while (!vecPriority.empty())
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            double dPriority = vecPriority.front().first;
+            const CTxMemPoolEntry *pentry = vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end());
+            vecPriority.pop_back();
+
+            if (nBlockSize + pentry->nTxSize >= nBlockPrioritySize || dPriority < COIN * 576 / 250)
+                break;
+
+            if (!AddTx(pentry, view)) {
+                setFailed.insert(pentry->hash);
+                continue;
+            }
+
+            // Children become candidates once all their parents are in
+            BOOST_FOREACH(const CTxMemPoolEntry *pchild, pentry->setChildren) {
+                if (!Skip(pchild) && HasParentsInBlock(pchild)) {
+                    vecPriority.push_back(std::make_pair(pchild->GetPriority(pindexPrev->nHeight), pchild));
+                    std::push_heap(vecPriority.begin(), vecPriority.end());
+                }
+            }
         }
-        else
+    }
+
+    // Add packages of transactions and their ancestors, highest ancestor fee rate first. The
+    // scores are not updated for ancestors that are already in the block.
+    void AddFeeTxs()
+    {
+        BOOST_FOREACH(const CTxMemPoolEntry *pentry, mempool.setByAncestorScore)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            if (Skip(pentry))
+                continue;
+
+            std::set<const CTxMemPoolEntry*> setAncestors;
+            mempool.CalculateAncestors(*pentry, setAncestors);
+            std::vector<std::pair<uint64, const CTxMemPoolEntry*> > vPackage;
+            vPackage.push_back(std::make_pair(pentry->nCountWithAncestors, pentry));
+            uint64 nPackageSize = pentry->nTxSize;
+            int64 nPackageFees = pentry->nFee;
+            bool fFailed = false;
+            BOOST_FOREACH(const CTxMemPoolEntry *pancestor, setAncestors) {
+                if (setInBlock.count(pancestor->hash))
+                    continue;
+                if (setFailed.count(pancestor->hash)) {
+                    fFailed = true;
+                    break;
+                }
+                vPackage.push_back(std::make_pair(pancestor->nCountWithAncestors, pancestor));
+                nPackageSize += pancestor->nTxSize;
+                nPackageFees += pancestor->nFee;
+            }
+            if (fFailed) {
+                setFailed.insert(pentry->hash);
+                continue;
+            }
+            if (nBlockSize + nPackageSize >= nBlockMaxSize)
+                continue;
+
+            // Skip free transactions if we're past the minimum block size:
+            if (((double)nPackageFees * 1000 / nPackageSize < CTransaction::nMinTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+                continue;
+
+            // An ancestor has fewer ancestors of its own than any of its descendants. The package
+            // goes in whole or not at all: its coins are kept apart until all of it is added.
+            std::sort(vPackage.begin(), vPackage.end());
+            CCoinsViewCache viewPackage(view, true);
+            unsigned int nTxBefore = vtx.size();
+            uint64 nBlockSizeBefore = nBlockSize;
+            int nBlockSigOpsBefore = nBlockSigOps;
+            int64 nFeesBefore = nFees;
+            bool fAdded = true;
+            for (unsigned int i = 0; i < vPackage.size() && fAdded; i++) {
+                if (!AddTx(vPackage[i].second, viewPackage)) {
+                    setFailed.insert(vPackage[i].second->hash);
+                    setFailed.insert(pentry->hash);
+                    fAdded = false;
+                }
+            }
+            if (fAdded) {
+                assert(viewPackage.Flush());
+                continue;
+            }
+            for (unsigned int i = nTxBefore; i < vtx.size(); i++)
+                setInBlock.erase(vtx[i].GetHash());
+            vtx.resize(nTxBefore);
+            vTxFees.resize(nTxBefore);
+            vTxSigOps.resize(nTxBefore);
+            nBlockSize = nBlockSizeBefore;
+            nBlockSigOps = nBlockSigOpsBefore;
+            nFees = nFeesBefore;
+        }
+    }
+
+    // Add what entered the pool since the last call; transactions that were
+    // tried before are skipped without being checked again. The priority space
+    // is only filled when the assembler is new, as that pass goes through the
+    // whole pool; later calls only add packages by fee rate.
+    void Update()
+    {
+        if (!fPriorityAdded) {
+            fPriorityAdded = true;
+            if (nBlockPrioritySize > 0)
+                AddPriorityTxs();
         }
+        AddFeeTxs();
     }
 };
 
+static std::auto_ptr<CBlockAssembler> pblockassembler;
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
     // Create new block
@@ -4328,185 +5989,23 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
     // Collect memory pool transactions into the block
-    int64 nFees = 0;
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = pindexBest;
-        CCoinsViewCache view(*pcoinsTip, true);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority");
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 576 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!tx.HaveInputs(view))
-                continue;
-
-            int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-            nTxSigOps += tx.GetP2SHSigOpCount(view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
+        if (!pblockassembler.get() || !pblockassembler->IsCurrent(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize))
+            pblockassembler.reset(new CBlockAssembler(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize));
+        CBlockAssembler &assembler = *pblockassembler;
+        assembler.Update();
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        pblock->vtx.insert(pblock->vtx.end(), assembler.vtx.begin(), assembler.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), assembler.vTxFees.begin(), assembler.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), assembler.vTxSigOps.begin(), assembler.vTxSigOps.end());
+        int64 nFees = assembler.nFees;
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        printf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
+        nLastBlockTx = assembler.vtx.size();
+        nLastBlockSize = assembler.nBlockSize;
+        printf("CreateNewBlock(): total size %"PRI64u"\n", nLastBlockSize);
 
         pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, pindexPrev->GetBlockHash());
         pblocktemplate->vTxFees[0] = -nFees;
@@ -4519,6 +6018,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
         pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
 
+        // The assembler relies on the fees and sigops the pool worked out, and a reused one on
+        // coins from earlier calls, so check the whole block against the coins every time
         CBlockIndex indexDummy(*pblock);
         indexDummy.pprev = pindexPrev;
         indexDummy.nHeight = pindexPrev->nHeight + 1;
@@ -4643,6 +6144,20 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
+// Bumped from mainSignals, so that miner threads see new work at once instead of polling for it
+static volatile unsigned int nMinerTipUpdates = 0;
+static volatile unsigned int nMinerMempoolUpdates = 0;
+
+static void MinerUpdatedBlockTip(CBlockIndex *pindexNew)
+{
+    nMinerTipUpdates++;
+}
+
+static void MinerUpdatedMempool()
+{
+    nMinerMempoolUpdates++;
+}
+
 void static IsracoinMiner(CWallet *pwallet)
 {
     printf("IsracoinMiner started\n");
@@ -4660,7 +6175,8 @@ void static IsracoinMiner(CWallet *pwallet)
         //
         // Create new block
         //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
+        unsigned int nTipUpdatesLast = nMinerTipUpdates;
+        unsigned int nMempoolUpdatesLast = nMinerMempoolUpdates;
         CBlockIndex* pindexPrev = pindexBest;
 
         auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
@@ -4712,7 +6228,7 @@ void static IsracoinMiner(CWallet *pwallet)
                 }
                 pblock->nNonce += 1;
                 nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                if ((pblock->nNonce & 0xFF) == 0 || nMinerTipUpdates != nTipUpdatesLast)
                     break;
             }
 
@@ -4751,9 +6267,9 @@ void static IsracoinMiner(CWallet *pwallet)
                 break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+            if (nMinerMempoolUpdates != nMempoolUpdatesLast && GetTime() - nStart > 60)
                 break;
-            if (pindexPrev != pindexBest)
+            if (nMinerTipUpdates != nTipUpdatesLast)
                 break;
 
             // Update nTime every few seconds
@@ -4792,6 +6308,14 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
     if (nThreads == 0 || !fGenerate)
         return;
 
+    static bool fSignalsConnected = false;
+    if (!fSignalsConnected)
+    {
+        mainSignals.UpdatedBlockTip.connect(&MinerUpdatedBlockTip);
+        mainSignals.UpdatedMempool.connect(&MinerUpdatedMempool);
+        fSignalsConnected = true;
+    }
+
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
         minerThreads->create_thread(boost::bind(&IsracoinMiner, pwallet));
@@ -4858,10 +6382,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -7,6 +7,7 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "blockstore.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
@@ -14,9 +15,13 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+#include <boost/signals2/signal.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
+class CChain;
 class CKeyItem;
 class CReserveKey;
 
@@ -40,6 +45,10 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The maximum total size of the orphan transactions kept in memory */
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_SIZE = 5 * MAX_BLOCK_SIZE;
+/** Seconds after which an orphan transaction whose parents did not show up is dropped */
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -67,6 +76,28 @@ static const int COINBASE_MATURITY_SWITCH = 145;  //DRG
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of blocks below the best chain tip whose block and undo data is never pruned */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Number of blocks ReconnectBestChain connects while holding cs_main */
+static const int RECONNECT_BATCH_SIZE = 100;
+/** Default for -syncinterval: milliseconds between commits of the block files and databases */
+static const int64 DEFAULT_SYNC_INTERVAL = 1000;
+/** Default for -syncbuffer: MiB of block and undo data written before a commit is forced */
+static const unsigned int DEFAULT_SYNC_BUFFER = 16;
+/** Seconds after which CreateNewBlock starts over instead of extending its last set of transactions */
+static const int64 TEMPLATE_REBUILD_INTERVAL = 60;
+/** Version of the mempool.dat format */
+static const uint64 MEMPOOL_DUMP_VERSION = 1;
+/** Seconds between writes of mempool.dat while running */
+static const int64 MEMPOOL_DUMP_INTERVAL = 15 * 60;
+/** Default for -maxmempool: MiB of memory the transaction memory pool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry: hours after which transactions are dropped from the memory pool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Time in which the minimum fee raised by memory pool evictions halves again, in seconds */
+static const int64 ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+/** Smallest -prune target: MIN_BLOCKS_TO_KEEP full blocks plus their undo data, and one block file of slack */
+static const uint64 MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -81,8 +112,18 @@ extern CScript COINBASE_FLAGS;
 
 
 
+/** Maps block hashes to hash table buckets, keyed with a random per-process salt so
+ *  that peers cannot pick blocks that pile up in one bucket */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const;
+};
+
+/** Block index lookup by hash; entries are never removed while the index is loaded */
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -90,7 +131,12 @@ extern int nBestHeight;
 extern uint256 nBestChainWork;
 extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
+/** Guards hashBestChain for waiters on cvBlockChange, which is notified whenever the best chain changes,
+ *  and by long polling getblocktemplate calls when the memory pool changes */
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern CBlockIndex* pindexBest;
+extern CChain chainActive;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -106,11 +152,31 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fBlockFilterIndex;
 extern unsigned int nCoinCacheSize;
+extern bool fPruneMode;
+extern bool fHavePruned;
+extern uint64 nPruneTarget;
+extern int64 nSyncInterval;
+extern uint64 nSyncBuffer;
+extern uint64 nMaxMempoolSize;
+extern int64 nMempoolExpiry;
 
 // Settings
 extern int64 nTransactionFee;
 
+/** Signals for code that must learn about new work at once, such as miners, instead of polling */
+class CMainSignals
+{
+public:
+    /** The best chain moved on to pindexNew. Fired from SetBestChain, with cs_main held. */
+    boost::signals2::signal<void (CBlockIndex *pindexNew)> UpdatedBlockTip;
+    /** Transactions entered or left the memory pool. Fired with the pool's lock held, so slots must be quick. */
+    boost::signals2::signal<void ()> UpdatedMempool;
+};
+extern CMainSignals mainSignals;
+
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
 
@@ -118,7 +184,10 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
+class CBlockFilterDB;
+struct CAddressIndexUpdate;
 struct CDiskBlockPos;
+class CBlockFileInfo;
 class CCoins;
 class CTxUndo;
 class CCoinsView;
@@ -128,6 +197,19 @@ class CValidationState;
 
 struct CBlockTemplate;
 
+/** Progress and outcome of a VerifyDB run */
+struct CVerifyStatus
+{
+    bool fRunning;
+    int nCheckLevel;
+    int nCheckDepth;
+    int nBlocksChecked;     // blocks read and checked so far, counted from the tip
+    int64 nTimeStart;
+    std::string strResult;  // "ok", "failed", "aborted" (best chain changed) or "interrupted" once finished
+
+    CVerifyStatus() : fRunning(false), nCheckLevel(0), nCheckDepth(0), nBlocksChecked(0), nTimeStart(0) {}
+};
+
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWallet* pwalletIn);
 /** Unregister a wallet from core */
@@ -142,26 +224,57 @@ bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
-/** Import blocks from an external file */
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Find the address index type and hash of the address a script pays to; false if there is none */
+bool GetAddressIndexDestination(const CScript &scriptPubKey, unsigned char &nAddressType, uint160 &hashAddress);
+/** Append the block stored at pos to ss in its serialized form, without deserializing it */
+bool ReadRawBlockFromDisk(CDataStream &ss, const CDiskBlockPos &pos);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
+/** Connect the best chain in the block index up to its tip, taking cs_main for a few blocks at a time */
+bool ReconnectBestChain(CValidationState &state);
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
-/** Verify consistency of the block and coin databases */
-bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** Verify consistency of the block and coin databases. Also returns false, setting *pfAborted,
+ *  when the best chain changed under a background run before the check was done. */
+bool VerifyDB(int nCheckLevel, int nCheckDepth, bool *pfAborted = NULL);
+/** Run VerifyDB in a background thread; returns false if a verification is already running */
+bool StartVerifyDB(int nCheckLevel, int nCheckDepth);
+/** Interrupt and wait for a background VerifyDB */
+void StopVerifyDB();
+/** State of the running or last VerifyDB */
+CVerifyStatus GetVerifyStatus();
 /** Print the loaded block tree */
 void PrintBlockTree();
-/** Find a block by height in the currently-connected chain */
-CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Forget the orphan transactions a disconnected peer sent */
+void EraseOrphansFor(NodeId peer);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Commit the block and undo files, the block index with the address index and the coin
+ *  database, in that order, if -syncinterval has passed or -syncbuffer was written since
+ *  the last commit, or the coin cache is full. fForce commits regardless. */
+bool CommitChainState(CValidationState &state, bool fForce = false);
+/** Write the address index changes of the blocks connected and disconnected since the last
+ *  commit. Being written ahead of the coin database, they are replayed after a crash. */
+bool FlushAddressIndex(CValidationState &state);
+/** Choose the oldest block files to prune so their total size, with room for the next chunks, gets
+ *  below nTarget. Files holding blocks within MIN_BLOCKS_TO_KEEP of nTipHeight, and the last file,
+ *  are kept. Returns the size of the files that are left. */
+uint64 FindFilesToPrune(const std::vector<CBlockFileInfo> &vinfoBlockFile, int nTipHeight, uint64 nTarget, std::set<int> &setFilesToPrune);
+/** Forget the block and undo data in the given files, writing the block index in one batch */
+bool PruneBlockIndex(CValidationState &state, const std::set<int> &setFilesToPrune);
+/** Run CommitChainState every -syncinterval, so the last blocks of a burst get written too */
+void ThreadCommitChainState();
+/** Write the memory pool transactions and the times they entered it to mempool.dat.
+ *  Does nothing until LoadMempool has run, so an unfinished load does not lose the file. */
+bool DumpMempool();
+/** Accept the transactions in mempool.dat into the memory pool again, keeping their entry times */
+bool LoadMempool();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
@@ -809,29 +922,40 @@ public:
         hasher << *this;
         fileout << hasher.GetHash();
 
-        // Flush stdio buffers and commit to disk before returning
+        // Flush stdio buffers; CommitChainState commits the file to disk
         fflush(fileout);
-        if (!IsInitialBlockDownload())
-            FileCommit(fileout);
 
         return true;
     }
 
     bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
     {
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlockUndo::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read block
+        // Read undo data and checksum, from a memory mapping if the file is finalized
         uint256 hashChecksum;
-        try {
-            filein >> *this;
-            filein >> hashChecksum;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        const char *pbegin, *pend;
+        boost::shared_ptr<CMappedFile> pmapped = blockfilemaps.MapUndo(pos, pbegin, pend);
+        if (pmapped) {
+            try {
+                CBufferReader ssUndo(pbegin, pend, SER_DISK, CLIENT_VERSION);
+                ssUndo >> *this;
+                ssUndo >> hashChecksum;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+        } else {
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlockUndo::ReadFromDisk() : OpenBlockFile failed");
+
+            try {
+                filein >> *this;
+                filein >> hashChecksum;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Verify checksum
@@ -1344,6 +1468,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fChecked; // CheckBlock passed with all checks enabled
 
     CBlock()
     {
@@ -1360,6 +1485,8 @@ public:
     (
         READWRITE(*(CBlockHeader*)this);
         READWRITE(vtx);
+        if (fRead)
+            fChecked = false;
     )
 
     void SetNull()
@@ -1367,6 +1494,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fChecked = false;
     }
 
     uint256 GetPoWHash() const
@@ -1462,10 +1590,8 @@ public:
         pos.nPos = (unsigned int)fileOutPos;
         fileout << *this;
 
-        // Flush stdio buffers and commit to disk before returning
+        // Flush stdio buffers; CommitChainState commits the file to disk
         fflush(fileout);
-        if (!IsInitialBlockDownload())
-            FileCommit(fileout);
 
         return true;
     }
@@ -1474,17 +1600,29 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        // Read block, from a memory mapping if the file is finalized
+        const char *pbegin, *pend;
+        boost::shared_ptr<CMappedFile> pmapped = blockfilemaps.MapBlock(pos, pbegin, pend);
+        if (pmapped) {
+            try {
+                CBufferReader ssBlock(pbegin, pend, SER_DISK, CLIENT_VERSION);
+                ssBlock >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+        } else {
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
 
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Check the header
@@ -1522,11 +1660,15 @@ public:
     /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
      *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
      *  will be true if no problems were found. Otherwise, the return value will be false in case
-     *  of problems. Note that in any case, coins may be modified. */
-    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
+     *  of problems. Note that in any case, coins may be modified. With -addressindex, the changes
+     *  to the address index are appended to pvAddressUpdates, if given, for the caller to write. */
+    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL,
+                         std::vector<CAddressIndexUpdate> *pvAddressUpdates = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // Address index changes are appended to pvAddressUpdates as in DisconnectBlock.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false,
+                      std::vector<CAddressIndexUpdate> *pvAddressUpdates = NULL);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -1592,7 +1734,7 @@ public:
          if (nBlocks==0 || nTimeFirst > nTimeIn)
              nTimeFirst = nTimeIn;
          nBlocks++;
-         if (nHeightIn > nHeightFirst)
+         if (nHeightIn > nHeightLast)
              nHeightLast = nHeightIn;
          if (nTimeIn > nTimeLast)
              nTimeLast = nTimeIn;
@@ -1623,10 +1765,9 @@ enum BlockStatus {
 
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
- * candidates to be the next block.  pprev and pnext link a path through the
- * main/longest chain.  A blockindex may have multiple pprev pointing back
- * to it, but pnext will only point forward to the longest branch, or will
- * be null if the block is not part of the longest chain.
+ * candidates to be the next block. A blockindex may have multiple pprev pointing
+ * to it, but at most one of them can be part of the currently active branch
+ * (see CChain).
  */
 class CBlockIndex
 {
@@ -1637,8 +1778,8 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    // (memory only) pointer to the index of the *active* successor of this block
-    CBlockIndex* pnext;
+    // (memory only) pointer to an ancestor further back, to find ancestors at any height in O(log n) (see GetAncestor)
+    CBlockIndex* pskip;
 
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
@@ -1677,7 +1818,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
-        pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1698,7 +1839,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
-        pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1765,10 +1906,14 @@ public:
         return (CBigNum(1)<<256) / (bnTarget+1);
     }
 
-    bool IsInMainChain() const
-    {
-        return (pnext || this == pindexBest);
-    }
+    bool IsInMainChain() const;
+
+    // Set pskip; pprev and nHeight must be set, and the skip pointers of all ancestors built
+    void BuildSkip();
+
+    // Efficiently find the ancestor of this block at the given height, or NULL if there is none
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
 
     bool CheckIndex() const
     {
@@ -1793,17 +1938,7 @@ public:
         return pbegin[(pend - pbegin)/2];
     }
 
-    int64 GetMedianTime() const
-    {
-        const CBlockIndex* pindex = this;
-        for (int i = 0; i < nMedianTimeSpan/2; i++)
-        {
-            if (!pindex->pnext)
-                return GetBlockTime();
-            pindex = pindex->pnext;
-        }
-        return pindex->GetMedianTimePast();
-    }
+    int64 GetMedianTime() const;
 
     /**
      * Returns true if there are nRequired or more blocks of minVersion or above
@@ -1814,8 +1949,8 @@ public:
 
     std::string ToString() const
     {
-        return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
-            pprev, pnext, nHeight,
+        return strprintf("CBlockIndex(pprev=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
+            pprev, nHeight,
             hashMerkleRoot.ToString().c_str(),
             GetBlockHash().ToString().c_str());
     }
@@ -1964,7 +2099,56 @@ public:
 
 
 
+/** An in-memory indexed chain of blocks: the block at height h is at position h,
+ *  so height lookups and membership tests take constant time (protected by cs_main) */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the index entry for the genesis block of this chain, or NULL if none */
+    CBlockIndex *Genesis() const {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
 
+    /** Returns the index entry for the tip of this chain, or NULL if none */
+    CBlockIndex *Tip() const {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Returns the index entry at a particular height in this chain, or NULL if no such height exists */
+    CBlockIndex *operator[](int nHeight) const {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Efficiently check whether a block is present in this chain */
+    bool Contains(const CBlockIndex *pindex) const {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Find the successor of a block in this chain, or NULL if the given index is not found or is the tip */
+    CBlockIndex *Next(const CBlockIndex *pindex) const {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        else
+            return NULL;
+    }
+
+    /** Return the maximal height in the chain (the height of the tip), or -1 if empty */
+    int Height() const {
+        return vChain.size() - 1;
+    }
+
+    /** Set or replace the tip of the chain; only entries past the fork point are rewritten.
+     *  Returns the fork point (the last entry that was already part of the chain), or NULL. */
+    CBlockIndex *SetTip(CBlockIndex *pindex);
+};
+
+/** Find the last common ancestor of two blocks, in O(log^2 n), or NULL if they share none */
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb);
 
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
@@ -1987,7 +2171,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2021,14 +2205,20 @@ public:
         while (pindex)
         {
             vHave.push_back(pindex->GetBlockHash());
+            if (pindex->nHeight == 0)
+                break;
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, down to the genesis block
+            int nHeight = std::max(pindex->nHeight - nStep, 0);
+            if (chainActive.Contains(pindex))
+                pindex = chainActive[nHeight];
+            else
+                pindex = pindex->GetAncestor(nHeight);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
-        vHave.push_back(hashGenesisBlock);
+        if (vHave.empty() || vHave.back() != hashGenesisBlock)
+            vHave.push_back(hashGenesisBlock);
     }
 
     int GetDistanceBack()
@@ -2038,7 +2228,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2057,7 +2247,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2073,7 +2263,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2100,14 +2290,120 @@ public:
 
 
 
+/** A transaction in the memory pool, with the data the pool's indexes sort by.
+ *  The ancestor and descendant totals are over the in-pool ancestors and
+ *  descendants of the transaction, and include the transaction itself. */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    uint256 hash;
+    int64 nFee;
+    unsigned int nSigOps;   // legacy and pay-to-script-hash sigops; like nFee, complete only if fInputsChecked
+    unsigned int nTxSize;
+    int64 nTime;            // when it entered the pool
+    unsigned int nHeight;   // best chain height when it entered the pool
+    double dPriority;       // priority at nHeight
+    int64 nValueInChain;    // value of the inputs in the chain at nHeight, which keep aging
+    uint64 nUsageSize;      // memory used by the entry and its nodes in the pool's maps and indexes
+    bool fInputsChecked;    // whether the scripts were verified when the transaction was accepted
+
+    uint64 nCountWithAncestors;
+    uint64 nSizeWithAncestors;
+    int64 nFeesWithAncestors;
+    uint64 nCountWithDescendants;
+    uint64 nSizeWithDescendants;
+    int64 nFeesWithDescendants;
+
+    // In-pool parents and children, filled in by the pool
+    std::set<const CTxMemPoolEntry*> setParents;
+    std::set<const CTxMemPoolEntry*> setChildren;
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction &txIn, int64 nFeeIn, int64 nTimeIn, unsigned int nHeightIn, double dPriorityIn = 0, int64 nValueInChainIn = 0);
+
+    double GetPriority(unsigned int nCurrentHeight) const;
+
+    // Fee rates in satoshi per 1000 bytes
+    double GetFeeRate() const { return (double)nFee * 1000 / nTxSize; }
+    double GetFeeRateWithAncestors() const { return (double)nFeesWithAncestors * 1000 / nSizeWithAncestors; }
+    double GetFeeRateWithDescendants() const { return (double)nFeesWithDescendants * 1000 / nSizeWithDescendants; }
+};
+
+/** Orders entries by the higher of their own fee rate and that with their descendants, lowest first:
+ *  the order in which to give up on transactions and everything that depends on them */
+struct CompareTxMemPoolEntryByDescendantScore
+{
+    bool operator()(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) const;
+};
+
+/** Orders entries by the time they entered the pool, oldest first */
+struct CompareTxMemPoolEntryByTime
+{
+    bool operator()(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) const;
+};
+
+/** Orders entries by the fee rate of the package of them and their ancestors, highest first:
+ *  the order in which to fill a block */
+struct CompareTxMemPoolEntryByAncestorScore
+{
+    bool operator()(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) const;
+};
+
+/** A transaction handed to CTxMemPool::acceptBatch, and what became of it */
+struct CMemPoolBatchTx
+{
+    CTransaction tx;
+    int64 nAcceptTime;      // time to keep as the pool entry time, or 0 for now
+    CValidationState state;
+    bool fAccepted;
+    bool fMissingInputs;
+
+    CMemPoolBatchTx(const CTransaction &txIn, int64 nAcceptTimeIn = 0) : tx(txIn), nAcceptTime(nAcceptTimeIn), fAccepted(false), fMissingInputs(false) {}
+};
+
+/** A transaction whose inputs are not known yet, kept until its parents arrive */
+struct COrphanTx
+{
+    CTransaction tx;
+    NodeId fromPeer;
+    int64 nTimeExpire;
+    unsigned int nTxSize;
+};
+
 class CTxMemPool
 {
+public:
+    typedef std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByDescendantScore> setEntriesByDescendantScore;
+    typedef std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByTime> setEntriesByTime;
+    typedef std::set<const CTxMemPoolEntry*, CompareTxMemPoolEntryByAncestorScore> setEntriesByAncestorScore;
+
+private:
+    uint64 nTotalUsage;
+    double dRollingMinFee;
+    int64 nLastRollingFeeUpdate;
+
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
-    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
+    // Indexes over mapTx, kept up to date by addUnchecked and remove
+    setEntriesByDescendantScore setByDescendantScore;
+    setEntriesByTime setByTime;
+    setEntriesByAncestorScore setByAncestorScore;
+
+    CTxMemPool();
+
+    // nAcceptTime, if set, is kept as the time the transaction entered the pool
+    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, int64 nAcceptTime = 0);
+    // Accept several transactions at once: the checks that need the pool run one transaction after
+    // the other, the script checks of all of them on the script check threads, and those that pass
+    // are added in the order given. Transactions spending others of the batch are retried once
+    // those are in. Callers hold cs_main.
+    void acceptBatch(std::vector<CMemPoolBatchTx> &vBatch, bool fLimitFree);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
+    // Add a transaction, taking its fee and priority from the chain and the pool
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
@@ -2115,6 +2411,28 @@ public:
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
 
+    // All in-pool ancestors or descendants of an entry, not including the entry itself
+    void CalculateAncestors(const CTxMemPoolEntry &entry, std::set<const CTxMemPoolEntry*> &setAncestors) const;
+    void CalculateDescendants(const CTxMemPoolEntry &entry, std::set<const CTxMemPoolEntry*> &setDescendants) const;
+
+    // Evict the transactions with the lowest fee rate, together with their descendants, until the
+    // pool uses at most nSizeLimit bytes. Raises the minimum fee to above that of the evicted ones.
+    void TrimToSize(uint64 nSizeLimit);
+    // Remove the transactions that entered the pool before nTime, and their descendants. Returns the number removed.
+    int Expire(int64 nTime);
+    // The minimum fee rate for new transactions, in satoshi per 1000 bytes, or 0 if evictions did not raise it.
+    // It halves every ROLLING_FEE_HALFLIFE, faster while the pool is well below nSizeLimit.
+    double GetMinFee(uint64 nSizeLimit);
+
+    uint64 DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nTotalUsage;
+    }
+
+    // Check the indexes, the ancestor and descendant totals and the memory usage against a full recalculation (for tests)
+    bool CheckIndexes() const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -2123,17 +2441,59 @@ public:
 
     bool exists(uint256 hash)
     {
+        LOCK(cs);
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    // The transaction must be in the pool; callers hold cs for as long as they use the reference
+    const CTransaction& lookup(uint256 hash) const
     {
-        return mapTx[hash];
+        LOCK(cs);
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            throw std::runtime_error("CTxMemPool::lookup() : transaction not in the memory pool");
+        return it->second.tx;
     }
+
+    const CTxMemPoolEntry* lookupEntry(const uint256 &hash) const
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(hash);
+        return it == mapTx.end() ? NULL : &it->second;
+    }
+
+    // The fee and sigops of a transaction worked out when it was validated on entering the pool
+    bool lookupFeeAndSigOps(const uint256 &hash, int64 &nFee, unsigned int &nSigOps) const
+    {
+        LOCK(cs);
+        const CTxMemPoolEntry *pentry = lookupEntry(hash);
+        if (pentry == NULL || !pentry->fInputsChecked)
+            return false;
+        nFee = pentry->nFee;
+        nSigOps = pentry->nSigOps;
+        return true;
+    }
+
+private:
+    // Everything accept checks, with the script checks left in pvChecks if that is set
+    bool PreAccept(CValidationState &state, const CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs,
+                   CTxMemPoolEntry &entry, std::vector<CScriptCheck> *pvChecks);
+    // Add a checked transaction, keep the pool within its limits and tell the wallets
+    bool FinishAccept(CValidationState &state, const CTransaction &tx, const CTxMemPoolEntry &entry);
+
+    // Remove an entry from the sorted indexes before changing what they sort by, and put it back after
+    void Unindex(const CTxMemPoolEntry *pentry);
+    void Reindex(const CTxMemPoolEntry *pentry);
+    // Recalculate the ancestor and descendant totals of an entry from scratch
+    void RecalculateTotals(CTxMemPoolEntry &entry);
+    // Remove an entry and everything that depends on it
+    void RemoveWithDescendants(const CTxMemPoolEntry *pentry);
 };
 
 extern CTxMemPool mempool;
 
+/** CTxMemPool::acceptBatch on the memory pool, aborting the node on database errors like AcceptToMemoryPool */
+bool AcceptToMemoryPoolBatch(std::vector<CMemPoolBatchTx> &vBatch, bool fLimitFree);
+
 struct CCoinsStats
 {
     int nHeight;
@@ -2248,6 +2608,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the block filter database, if -blockfilterindex is enabled (protected by cs_main) */
+extern CBlockFilterDB *pblockfilterdb;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -2283,6 +2646,11 @@ public:
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    // Create from a serialized block, as stored on disk. Transactions are only deserialized
+    // to match them against filter; their hashes are computed from the serialized data, and
+    // vMatchedTxData receives the serialized form of each transaction in vMatchedTxn.
+    CMerkleBlock(CBufferReader& blockIn, CBloomFilter& filter, std::vector<CFlatData>& vMatchedTxData);
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(header);
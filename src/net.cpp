@@ -556,6 +556,8 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+NodeId CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
@@ -752,6 +754,7 @@ static list<CNode*> vNodesDisconnected;
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    vector<NodeId> vDisconnected; // peers whose orphan transactions are still to be erased
     loop
     {
         //
@@ -768,6 +771,7 @@ void ThreadSocketHandler()
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    vDisconnected.push_back(pnode->id);
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
@@ -812,6 +816,18 @@ void ThreadSocketHandler()
                 }
             }
         }
+        // Outside cs_vNodes, and only if cs_main is free so socket I/O never waits for it;
+        // otherwise the next loop tries again
+        if (!vDisconnected.empty())
+        {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain)
+            {
+                BOOST_FOREACH(NodeId id, vDisconnected)
+                    EraseOrphansFor(id);
+                vDisconnected.clear();
+            }
+        }
         if (vNodes.size() != nPrevNodeCount)
         {
             nPrevNodeCount = vNodes.size();
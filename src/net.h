@@ -77,6 +77,9 @@ extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
 
+/** Identifies a peer for as long as the process runs, unlike its CNode pointer */
+typedef int NodeId;
+
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
 extern std::map<CInv, CDataStream> mapRelay;
@@ -176,6 +179,7 @@ public:
     int64 nLastSendEmpty;
     int64 nTimeConnected;
     uint64 nBlocksRequested;
+    NodeId id;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -208,6 +212,9 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    static NodeId nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
 public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
@@ -239,6 +246,10 @@ public:
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
         nBlocksRequested = 0;
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
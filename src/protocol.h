@@ -71,6 +71,8 @@ enum
 {
     NODE_NETWORK = (1 << 0),
     NODE_BLOOM = (1 << 1),
+    // NODE_COMPACT_FILTERS means the node serves compact block filters (getcfilters, getcfheaders, getcfcheckpt)
+    NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 /** A CService with information about it as peer */
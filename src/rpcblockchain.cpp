@@ -5,6 +5,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
+#include "base58.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -66,8 +68,9 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
+    CBlockIndex *pnext = chainActive.Next(blockindex);
+    if (pnext)
+        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
@@ -121,10 +124,46 @@ Value settxfee(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "If verbose is true, returns an object for each transaction with its size, fee,\n"
+            "the time and height at which it entered the pool, its current priority, and\n"
+            "the count, size and fees of it together with its in-pool ancestors and descendants.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        Object o;
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            const CTxMemPoolEntry &e = mi->second;
+            Object info;
+            info.push_back(Pair("size", (boost::int64_t)e.nTxSize));
+            info.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+            info.push_back(Pair("time", (boost::int64_t)e.nTime));
+            info.push_back(Pair("height", (int)e.nHeight));
+            info.push_back(Pair("startingpriority", e.dPriority));
+            info.push_back(Pair("currentpriority", e.GetPriority(nBestHeight)));
+            info.push_back(Pair("ancestorcount", (boost::int64_t)e.nCountWithAncestors));
+            info.push_back(Pair("ancestorsize", (boost::int64_t)e.nSizeWithAncestors));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(e.nFeesWithAncestors)));
+            info.push_back(Pair("descendantcount", (boost::int64_t)e.nCountWithDescendants));
+            info.push_back(Pair("descendantsize", (boost::int64_t)e.nSizeWithDescendants));
+            info.push_back(Pair("descendantfees", ValueFromAmount(e.nFeesWithDescendants)));
+            Array depends;
+            BOOST_FOREACH(const CTxMemPoolEntry *pparent, e.setParents)
+                depends.push_back(pparent->hash.ToString());
+            info.push_back(Pair("depends", depends));
+            o.push_back(Pair(mi->first.ToString(), info));
+        }
+        return o;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
@@ -136,6 +175,22 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the number of transactions in the memory pool, the memory it uses,\n"
+            "its limit and the minimum fee per kB it currently accepts.");
+
+    Object ret;
+    ret.push_back(Pair("size", (boost::int64_t)mempool.size()));
+    ret.push_back(Pair("usage", (boost::int64_t)mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("maxmempool", (boost::int64_t)nMaxMempoolSize));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(std::max((int64)mempool.GetMinFee(nMaxMempoolSize), CTransaction::nMinRelayTxFee))));
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -147,7 +202,7 @@ Value getblockhash(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -172,6 +227,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex);
 
     if (!fVerbose)
@@ -185,6 +242,32 @@ Value getblock(const Array& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+Value getblockfilter(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getblockfilter <hash>\n"
+            "Returns the hex-encoded basic compact filter (BIP158) of block <hash> and its filter header.\n"
+            "Requires -blockfilterindex.");
+
+    if (!fBlockFilterIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block filter index is not enabled (use -blockfilterindex)");
+
+    uint256 hash(params[0].get_str());
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlockFilter filter;
+    uint256 hashHeader;
+    if (!pblockfilterdb->ReadFilter(hash, filter) || !pblockfilterdb->ReadFilterHeader(hash, hashHeader))
+        throw JSONRPCError(RPC_MISC_ERROR, "Filter not available (block not connected yet)");
+
+    Object ret;
+    ret.push_back(Pair("filter", HexStr(filter.GetEncoded())));
+    ret.push_back(Pair("header", hashHeader.GetHex()));
+    return ret;
+}
+
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -194,6 +277,11 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
 
     Object ret;
 
+    // The statistics come from the coin database, which may lag behind the tip
+    CValidationState state;
+    if (!CommitChainState(state, true))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to write the chain state to disk");
+
     CCoinsStats stats;
     if (pcoinsTip->GetStats(stats)) {
         ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
@@ -252,12 +340,88 @@ Value gettxout(const Array& params, bool fHelp)
     return ret;
 }
 
-Value verifychain(const Array& params, bool fHelp)
+static Object LatencyHistogramToJSON(const CLatencyHistogram &hist)
+{
+    Object ret;
+    ret.push_back(Pair("count", (boost::uint64_t)hist.nCount));
+    ret.push_back(Pair("totalus", (boost::uint64_t)hist.nTotalMicros));
+    // [upper bound in microseconds (0 for the open-ended last bucket), count], for the buckets in use
+    Array buckets;
+    for (int i = 0; i < CLatencyHistogram::BUCKETS; i++) {
+        if (hist.vBuckets[i] == 0)
+            continue;
+        Array bucket;
+        bucket.push_back(i < CLatencyHistogram::BUCKETS - 1 ? (boost::int64_t)1 << i : (boost::int64_t)0);
+        bucket.push_back((boost::uint64_t)hist.vBuckets[i]);
+        buckets.push_back(bucket);
+    }
+    ret.push_back(Pair("histogram", buckets));
+    return ret;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
         throw runtime_error(
-            "verifychain [check level] [num blocks]\n"
-            "Verifies blockchain database.");
+            "getdbstats [name] [verbose=false]\n"
+            "Returns settings, LevelDB internals and read/write latencies of the open databases,\n"
+            "or of the one called <name> (chainstate, index or filter).\n"
+            "With verbose set, the LevelDB stats and sstables reports are included as text.");
+
+    std::string strName = params.size() > 0 ? params[0].get_str() : "";
+    bool fVerbose = params.size() > 1 && params[1].get_bool();
+
+    Array ret;
+    BOOST_FOREACH(const CLevelDBStats &stats, GetLevelDBStats()) {
+        if (!strName.empty() && stats.strName != strName)
+            continue;
+        Object obj;
+        obj.push_back(Pair("name", stats.strName));
+        obj.push_back(Pair("path", stats.strPath));
+
+        Object options;
+        options.push_back(Pair("blockcache", (boost::uint64_t)stats.nBlockCacheSize));
+        options.push_back(Pair("writebuffer", (boost::uint64_t)stats.nWriteBufferSize));
+        options.push_back(Pair("maxopenfiles", stats.profile.nMaxOpenFiles));
+        options.push_back(Pair("bloombits", stats.profile.nBloomBits));
+        options.push_back(Pair("compression", stats.profile.fCompression));
+        options.push_back(Pair("compactionthreads", stats.profile.nCompactionThreads));
+        options.push_back(Pair("subcompactions", stats.profile.nSubcompactions));
+        obj.push_back(Pair("options", options));
+
+        obj.push_back(Pair("approximatesize", (boost::uint64_t)stats.nApproximateSize));
+        Array levels;
+        BOOST_FOREACH(const CLevelDBLevelStats &level, stats.vLevels) {
+            Object objLevel;
+            objLevel.push_back(Pair("level", level.nLevel));
+            objLevel.push_back(Pair("files", level.nFiles));
+            objLevel.push_back(Pair("sizemb", level.dSizeMB));
+            objLevel.push_back(Pair("compactionseconds", level.dCompactionSeconds));
+            objLevel.push_back(Pair("compactionreadmb", level.dCompactionReadMB));
+            objLevel.push_back(Pair("compactionwritemb", level.dCompactionWriteMB));
+            levels.push_back(objLevel);
+        }
+        obj.push_back(Pair("levels", levels));
+        obj.push_back(Pair("reads", LatencyHistogramToJSON(stats.histRead)));
+        obj.push_back(Pair("writes", LatencyHistogramToJSON(stats.histWrite)));
+        if (fVerbose) {
+            obj.push_back(Pair("stats", stats.strStats));
+            obj.push_back(Pair("sstables", stats.strSSTables));
+        }
+        ret.push_back(obj);
+    }
+    if (!strName.empty() && ret.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No open database with that name");
+    return ret;
+}
+
+Value verifychain(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "verifychain [check level] [num blocks] [background=false]\n"
+            "Verifies blockchain database.\n"
+            "With background set, returns at once and verifies in a separate thread; see getverifychaininfo.");
 
     int nCheckLevel = GetArg("-checklevel", 3);
     int nCheckDepth = GetArg("-checkblocks", 288);
@@ -265,7 +429,170 @@ Value verifychain(const Array& params, bool fHelp)
         nCheckLevel = params[0].get_int();
     if (params.size() > 1)
         nCheckDepth = params[1].get_int();
+    bool fBackground = params.size() > 2 && params[2].get_bool();
+
+    if (GetVerifyStatus().fRunning)
+        throw JSONRPCError(RPC_MISC_ERROR, "A chain verification is already running");
+    if (fBackground)
+        return StartVerifyDB(nCheckLevel, nCheckDepth);
+    bool fAborted = false;
+    bool fResult = VerifyDB(nCheckLevel, nCheckDepth, &fAborted);
+    if (fAborted)
+        throw JSONRPCError(RPC_MISC_ERROR, "Chain verification aborted, the best chain changed while it ran");
+    return fResult;
+}
+
+Value getverifychaininfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getverifychaininfo\n"
+            "Returns the state of the running or last chain verification.");
+
+    CVerifyStatus status = GetVerifyStatus();
+    Object ret;
+    ret.push_back(Pair("running", status.fRunning));
+    ret.push_back(Pair("checklevel", status.nCheckLevel));
+    ret.push_back(Pair("checkblocks", status.nCheckDepth));
+    ret.push_back(Pair("blockschecked", status.nBlocksChecked));
+    ret.push_back(Pair("starttime", (boost::int64_t)status.nTimeStart));
+    if (!status.fRunning)
+        ret.push_back(Pair("result", status.strResult));
+    return ret;
+}
+
+// Address index type and hash of an address given as an RPC parameter
+static void ParseIndexedAddress(const Value& param, unsigned char &nAddressType, uint160 &hashAddress)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (use -addressindex and -reindex)");
+
+    CBitcoinAddress address(param.get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Isracoin address");
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(address.Get());
+    if (!GetAddressIndexDestination(scriptPubKey, nAddressType, hashAddress))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Isracoin address");
+}
+
+// Blocks connected since the last commit are only indexed in memory; write them out before reading
+static void FlushPendingAddressIndex()
+{
+    CValidationState state;
+    if (!FlushAddressIndex(state))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to write address index");
+}
+
+// Optional [skip] and [count] pagination parameters at position nParam
+static void ParsePagination(const Array& params, unsigned int nParam, unsigned int &nSkip, unsigned int &nCount)
+{
+    nSkip = 0;
+    nCount = 100;
+    if (params.size() > nParam) {
+        if (params[nParam].get_int() < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative skip");
+        nSkip = params[nParam].get_int();
+    }
+    if (params.size() > nParam + 1) {
+        if (params[nParam + 1].get_int() <= 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Count must be positive");
+        nCount = params[nParam + 1].get_int();
+    }
+}
+
+Value getaddresshistory(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresshistory <address> [skip=0] [count=100]\n"
+            "Returns the outputs paying to and the inputs spending from <address>, in chain order.\n"
+            "Skips the first [skip] entries and returns at most [count]. Requires -addressindex.");
+
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    ParseIndexedAddress(params[0], nAddressType, hashAddress);
+    FlushPendingAddressIndex();
+    unsigned int nSkip, nCount;
+    ParsePagination(params, 1, nSkip, nCount);
+
+    std::vector<std::pair<CAddressIndexKey, int64> > vEntries;
+    if (!pblocktree->ReadAddressHistory(nAddressType, hashAddress, vEntries, nSkip, nCount))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+
+    Array ret;
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        const CAddressIndexKey &key = vEntries[i].first;
+        Object entry;
+        entry.push_back(Pair("txid", key.txhash.GetHex()));
+        entry.push_back(Pair(key.fSpending ? "vin" : "vout", (boost::int64_t)key.nIndex));
+        entry.push_back(Pair("height", (boost::int64_t)key.nHeight));
+        entry.push_back(Pair("amount", ValueFromAmount(vEntries[i].second)));
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address>\n"
+            "Returns the current balance of <address> and the total it has received. Requires -addressindex.");
+
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    ParseIndexedAddress(params[0], nAddressType, hashAddress);
+    FlushPendingAddressIndex();
+
+    std::vector<std::pair<CAddressIndexKey, int64> > vEntries;
+    if (!pblocktree->ReadAddressHistory(nAddressType, hashAddress, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+
+    int64 nBalance = 0;
+    int64 nReceived = 0;
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        nBalance += vEntries[i].second;
+        if (vEntries[i].second > 0)
+            nReceived += vEntries[i].second;
+    }
 
-    return VerifyDB(nCheckLevel, nCheckDepth);
+    Object ret;
+    ret.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    ret.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return ret;
 }
 
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos <address> [skip=0] [count=100]\n"
+            "Returns the unspent outputs paying to <address>.\n"
+            "Skips the first [skip] outputs and returns at most [count]. Requires -addressindex.");
+
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    ParseIndexedAddress(params[0], nAddressType, hashAddress);
+    FlushPendingAddressIndex();
+    unsigned int nSkip, nCount;
+    ParsePagination(params, 1, nSkip, nCount);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vEntries;
+    if (!pblocktree->ReadAddressUnspent(nAddressType, hashAddress, vEntries, nSkip, nCount))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+
+    Array ret;
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        const CAddressUnspentValue &value = vEntries[i].second;
+        Object entry;
+        entry.push_back(Pair("txid", vEntries[i].first.txhash.GetHex()));
+        entry.push_back(Pair("vout", (boost::int64_t)vEntries[i].first.nIndex));
+        entry.push_back(Pair("scriptPubKey", HexStr(value.scriptPubKey.begin(), value.scriptPubKey.end())));
+        entry.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+        entry.push_back(Pair("height", value.nHeight));
+        entry.push_back(Pair("confirmations", nBestHeight - value.nHeight + 1));
+        ret.push_back(entry);
+    }
+    return ret;
+}
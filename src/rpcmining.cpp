@@ -21,7 +21,7 @@ Value GetNetworkHashPS(int lookup, int height) {
     CBlockIndex *pb = pindexBest;
 
     if (height >= 0 && height < nBestHeight)
-        pb = FindBlockByHeight(height);
+        pb = chainActive[height];
 
     if (pb == NULL || !pb->nHeight)
         return 0;
@@ -71,8 +71,30 @@ Value getnetworkhashps(const Array& params, bool fHelp)
 // Allocated in InitRPCMining, free'd in ShutdownRPCMining
 static CReserveKey* pMiningKey = NULL;
 
+// Number of long polling getblocktemplate calls waiting on cvBlockChange, guarded by csBestBlock
+static int nLongPollWaiters = 0;
+// Copy of nTransactionsUpdated for them, guarded by csBestBlock; the original is written under mempool.cs
+static unsigned int nLongPollTransactionsUpdated = 0;
+
+// Long polling calls also return for new transactions, so wake them when the memory pool changes.
+// Called with mempool.cs held.
+static void LongPollUpdatedMempool()
+{
+    boost::mutex::scoped_lock lock(csBestBlock);
+    nLongPollTransactionsUpdated = nTransactionsUpdated;
+    if (nLongPollWaiters > 0)
+        cvBlockChange.notify_all();
+}
+
 void InitRPCMining()
 {
+    {
+        LOCK(mempool.cs);
+        boost::mutex::scoped_lock lock(csBestBlock);
+        nLongPollTransactionsUpdated = nTransactionsUpdated;
+    }
+    mainSignals.UpdatedMempool.connect(&LongPollUpdatedMempool);
+
     if (!pwalletMain)
         return;
 
@@ -82,6 +104,8 @@ void InitRPCMining()
 
 void ShutdownRPCMining()
 {
+    mainSignals.UpdatedMempool.disconnect(&LongPollUpdatedMempool);
+
     if (!pMiningKey)
         return;
 
@@ -426,6 +450,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"transactions\" : contents of non-coinbase transactions that should be included in the next block\n"
             "  \"coinbaseaux\" : data that should be included in coinbase\n"
             "  \"coinbasevalue\" : maximum allowable input to coinbase transaction, including the generation award and transaction fees\n"
+            "  \"longpollid\" : id to pass as \"longpollid\" in [params] to wait for the next template\n"
             "  \"target\" : hash target\n"
             "  \"mintime\" : minimum timestamp appropriate for next block\n"
             "  \"curtime\" : current timestamp\n"
@@ -435,9 +460,12 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "If [params] has a \"longpollid\", the call returns once the best block changed, or once a\n"
+            "minute has passed since the call and there are transactions newer than that id.\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -450,22 +478,69 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
 
-    if (vNodes.empty())
-        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Isracoin is not connected!");
+    {
+        LOCK(cs_main);
+        if (vNodes.empty())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Isracoin is not connected!");
 
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Isracoin is downloading blocks...");
+        if (IsInitialBlockDownload())
+            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Isracoin is downloading blocks...");
+    }
+
+    // Long polling: this runs without cs_main, so wait here until the chain moves on, or until
+    // a minute has passed and there are new transactions. Both wake us through cvBlockChange.
+    if (lpval.type() != null_type)
+    {
+        uint256 hashWatchedChain;
+        unsigned int nTransactionsUpdatedLastLP;
+        if (lpval.type() == str_type)
+        {
+            // The longpollid is the best block hash followed by nTransactionsUpdated
+            std::string lpstr = lpval.get_str();
+            hashWatchedChain.SetHex(lpstr.substr(0, 64));
+            nTransactionsUpdatedLastLP = lpstr.size() > 64 ? atoi64(lpstr.substr(64)) : 0;
+        }
+        else
+        {
+            // Not in the specification, but handy for testing: wait for the next change from now
+            boost::mutex::scoped_lock lock(csBestBlock);
+            hashWatchedChain = hashBestChain;
+            nTransactionsUpdatedLastLP = nLongPollTransactionsUpdated;
+        }
 
-    // Update block
+        int64 nCheckTxTime = GetTime() + 60;
+        boost::mutex::scoped_lock lock(csBestBlock);
+        nLongPollWaiters++;
+        while (hashBestChain == hashWatchedChain)
+        {
+            if (GetTime() >= nCheckTxTime && nLongPollTransactionsUpdated != nTransactionsUpdatedLastLP)
+                break;
+            if (ShutdownRequested())
+            {
+                nLongPollWaiters--;
+                throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+            }
+            // The timeout only serves to notice shutdown
+            cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+        }
+        nLongPollWaiters--;
+    }
+
+    LOCK(cs_main);
+
+    // Update block. The template and its transaction list are shared by all callers,
+    // so the many miners woken by a new block do not each build their own.
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
     static int64 nStart;
     static CBlockTemplate* pblocktemplate;
+    static Array transactions;
     if (pindexPrev != pindexBest ||
         (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
@@ -488,48 +563,48 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+        transactions.clear();
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        BOOST_FOREACH (CTransaction& tx, pblocktemplate->block.vtx)
+        {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-    // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
+            if (tx.IsCoinBase())
+                continue;
 
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+            Object entry;
 
-        if (tx.IsCoinBase())
-            continue;
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
-        Object entry;
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            Array deps;
+            BOOST_FOREACH (const CTxIn &in, tx.vin)
+            {
+                if (setTxIndex.count(in.prevout.hash))
+                    deps.push_back(setTxIndex[in.prevout.hash]);
+            }
+            entry.push_back(Pair("depends", deps));
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            int index_in_template = i - 1;
+            entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
+            entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
 
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
+            transactions.push_back(entry);
         }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
 
-        transactions.push_back(entry);
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexPrev = pindexPrevNew;
     }
+    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+
+    // Update nTime
+    pblock->UpdateTime(pindexPrev);
+    pblock->nNonce = 0;
 
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
@@ -550,6 +625,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTransactionsUpdatedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
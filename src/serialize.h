@@ -1092,6 +1092,64 @@ public:
 };
 
 
+/** Read-only stream over a range of memory it does not own.
+ *
+ * Unlike CDataStream, nothing is copied in and consumed data is left in
+ * place, so pointers into the range (see pos()) stay valid while the caller
+ * deserializes from it.
+ */
+class CBufferReader
+{
+private:
+    const char* pbegin;
+    const char* pcur;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pcur(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    const char* begin() const   { return pbegin; }
+    const char* pos() const     { return pcur; }
+    const char* end() const     { return pend; }
+    size_t size() const         { return pend - pcur; }
+    bool empty() const          { return pcur == pend; }
+    bool eof() const            { return pcur == pend; }
+
+    int GetType()               { return nType; }
+    int GetVersion()            { return nVersion; }
+
+    CBufferReader& read(char* pch, int nSize)
+    {
+        assert(nSize >= 0);
+        if ((size_t)nSize > size())
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CBufferReader& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if ((size_t)nSize > size())
+            throw std::ios_base::failure("CBufferReader::ignore() : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
 
 
 
@@ -0,0 +1,601 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "bitcoinrpc.h"
+#include "init.h"
+#include "netbase.h"
+#include "wallet.h"
+
+#include <deque>
+#include <list>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace json_spirit;
+using namespace std;
+
+bool CreateStratumJob(CStratumJob &job, const string &strId, const CScript &scriptPubKey)
+{
+    CBlockTemplate *pblocktemplate;
+    {
+        LOCK(cs_main);
+        job.pindexPrev = pindexBest;
+        pblocktemplate = CreateNewBlock(scriptPubKey);
+    }
+    if (!pblocktemplate)
+        return false;
+    job.block = pblocktemplate->block;
+    delete pblocktemplate;
+    job.strId = strId;
+    job.nCreated = GetTime();
+    job.setShares.clear();
+
+    // The height, then a single push of the two extranonces, then the usual flags
+    CTransaction &txCoinbase = job.block.vtx[0];
+    CScript scriptHeight = CScript() << (job.pindexPrev->nHeight + 1);
+    vector<unsigned char> vchExtraNonce(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    txCoinbase.vin[0].scriptSig = (CScript(scriptHeight) << vchExtraNonce) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txCoinbase;
+    unsigned int nOffset = sizeof(txCoinbase.nVersion) + GetSizeOfCompactSize(txCoinbase.vin.size()) +
+                           ::GetSerializeSize(txCoinbase.vin[0].prevout, SER_NETWORK, PROTOCOL_VERSION) +
+                           GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+    job.vchCoinbase1.assign(ss.begin(), ss.begin() + nOffset);
+    job.vchCoinbase2.assign(ss.begin() + nOffset + vchExtraNonce.size(), ss.end());
+
+    job.block.hashMerkleRoot = job.block.BuildMerkleTree();
+    job.vMerkleBranch = job.block.GetMerkleBranch(0);
+    return true;
+}
+
+bool GetStratumShare(const CStratumJob &job, const vector<unsigned char> &vchExtraNonce,
+                     unsigned int nTime, unsigned int nNonce, CTransaction &txCoinbase, CBlockHeader &header)
+{
+    vector<unsigned char> vchCoinbase(job.vchCoinbase1);
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vchCoinbase.insert(vchCoinbase.end(), job.vchCoinbase2.begin(), job.vchCoinbase2.end());
+    try {
+        CDataStream ss(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+        ss >> txCoinbase;
+    } catch (std::exception &e) {
+        return false;
+    }
+
+    header = job.block.GetBlockHeader();
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    return true;
+}
+
+uint256 GetStratumTarget(double dDifficulty)
+{
+    static const CBigNum bnDiff1 = CBigNum().SetCompact(0x1f00ffff);
+    dDifficulty = std::max(STRATUM_MIN_DIFFICULTY, std::min(dDifficulty, STRATUM_MAX_DIFFICULTY));
+    CBigNum bnTarget = bnDiff1 * 1000000 / CBigNum((int64)(dDifficulty * 1000000));
+    if (bnTarget > CBigNum(~uint256(0)))
+        return ~uint256(0);
+    return bnTarget.getuint256();
+}
+
+
+//
+// Server
+//
+
+// A connected miner
+class CStratumClient
+{
+public:
+    SOCKET hSocket;
+    CService addr;
+    string strRecv;
+    string strSend;
+    bool fDisconnect;
+
+    vector<unsigned char> vchExtraNonce1;
+    bool fSubscribed;
+    string strWorker;
+
+    // The difficulty vardiff wants, and the last two sent. Shares are accepted at the lower of
+    // those two, as miners may still be working on a job sent before the last change.
+    double dDifficulty;
+    double dSentDifficulty;
+    double dPrevSentDifficulty;
+    int64 nLastRetarget;
+    unsigned int nSharesSinceRetarget;
+    uint64 nAccepted;
+    uint64 nRejected;
+
+    CStratumClient(SOCKET hSocketIn, const CService &addrIn, unsigned int nExtraNonce1) :
+        hSocket(hSocketIn), addr(addrIn), fDisconnect(false), fSubscribed(false),
+        nLastRetarget(GetTime()), nSharesSinceRetarget(0), nAccepted(0), nRejected(0)
+    {
+        dDifficulty = STRATUM_DEFAULT_DIFFICULTY;
+        if (mapArgs.count("-stratumdifficulty"))
+            dDifficulty = std::max(STRATUM_MIN_DIFFICULTY, std::min(atof(mapArgs["-stratumdifficulty"].c_str()), STRATUM_MAX_DIFFICULTY));
+        dSentDifficulty = dPrevSentDifficulty = dDifficulty;
+        vchExtraNonce1.resize(STRATUM_EXTRANONCE1_SIZE);
+        memcpy(&vchExtraNonce1[0], &nExtraNonce1, STRATUM_EXTRANONCE1_SIZE);
+    }
+
+    ~CStratumClient()
+    {
+        if (hSocket != INVALID_SOCKET)
+            closesocket(hSocket);
+    }
+
+    void Send(const Value &val)
+    {
+        strSend += write_string(val, false) + "\n";
+    }
+
+    void Reply(const Value &id, const Value &result, const Value &error = Value::null)
+    {
+        Object reply;
+        reply.push_back(Pair("id", id));
+        reply.push_back(Pair("result", result));
+        reply.push_back(Pair("error", error));
+        Send(reply);
+    }
+
+    void Notify(const string &strMethod, const Array &params)
+    {
+        Object notification;
+        notification.push_back(Pair("id", Value::null));
+        notification.push_back(Pair("method", strMethod));
+        notification.push_back(Pair("params", params));
+        Send(notification);
+    }
+};
+
+static boost::thread *pthreadStratum = NULL;
+static SOCKET hStratumListenSocket = INVALID_SOCKET;
+static CScript scriptStratumPayout;
+
+// Only used by the server thread
+static list<CStratumClient*> vStratumClients;
+static map<string, CStratumJob> mapStratumJobs;
+static deque<string> vStratumJobIds;      // oldest first
+static unsigned int nStratumJobId = 0;
+static unsigned int nStratumExtraNonce1 = 0;
+
+// Set from mainSignals, so the server thread learns about new work without polling for it
+static boost::mutex csStratumUpdates;
+static bool fStratumTipUpdated = false;
+static bool fStratumMempoolUpdated = false;
+
+static void StratumUpdatedBlockTip(CBlockIndex *pindexNew)
+{
+    boost::mutex::scoped_lock lock(csStratumUpdates);
+    fStratumTipUpdated = true;
+}
+
+static void StratumUpdatedMempool()
+{
+    boost::mutex::scoped_lock lock(csStratumUpdates);
+    fStratumMempoolUpdated = true;
+}
+
+static Array StratumError(int nCode, const string &strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+// The previous block hash as Stratum sends it: the header bytes, with each 32-bit word byte-swapped
+static string StratumPrevHash(const uint256 &hash)
+{
+    vector<unsigned char> vch(hash.begin(), hash.end());
+    for (unsigned int i = 0; i < vch.size(); i += 4)
+        std::reverse(vch.begin() + i, vch.begin() + i + 4);
+    return HexStr(vch);
+}
+
+static void SendJob(CStratumClient *pclient, const CStratumJob &job, bool fClean)
+{
+    if (pclient->dDifficulty != pclient->dSentDifficulty || fClean) {
+        Array params;
+        params.push_back(pclient->dDifficulty);
+        pclient->Notify("mining.set_difficulty", params);
+        pclient->dPrevSentDifficulty = pclient->dSentDifficulty;
+        pclient->dSentDifficulty = pclient->dDifficulty;
+    }
+
+    Array branch;
+    BOOST_FOREACH(const uint256 &hash, job.vMerkleBranch)
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+    Array params;
+    params.push_back(job.strId);
+    params.push_back(StratumPrevHash(job.block.hashPrevBlock));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", job.block.nVersion));
+    params.push_back(strprintf("%08x", job.block.nBits));
+    params.push_back(strprintf("%08x", job.block.nTime));
+    params.push_back(fClean);
+    pclient->Notify("mining.notify", params);
+}
+
+// Make a new job when the best block changed, or now and then when there are new transactions
+static void UpdateStratumJob()
+{
+    if (vStratumClients.empty())
+        return;
+    bool fTipUpdated, fMempoolUpdated;
+    {
+        boost::mutex::scoped_lock lock(csStratumUpdates);
+        fTipUpdated = fStratumTipUpdated;
+        fMempoolUpdated = fStratumMempoolUpdated;
+    }
+    bool fClean = vStratumJobIds.empty() || fTipUpdated;
+    if (!fClean && (!fMempoolUpdated || GetTime() - mapStratumJobs[vStratumJobIds.back()].nCreated < STRATUM_JOB_REFRESH_TIME))
+        return;
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            return;
+    }
+
+    // Changes signalled from here on are not in the new job, and make another one
+    {
+        boost::mutex::scoped_lock lock(csStratumUpdates);
+        fStratumTipUpdated = false;
+        fStratumMempoolUpdated = false;
+    }
+    string strId = strprintf("%x", ++nStratumJobId);
+    CStratumJob &job = mapStratumJobs[strId];
+    if (!CreateStratumJob(job, strId, scriptStratumPayout)) {
+        mapStratumJobs.erase(strId);
+        return;
+    }
+    if (fClean) {
+        BOOST_FOREACH(const string &strOld, vStratumJobIds)
+            mapStratumJobs.erase(strOld);
+        vStratumJobIds.clear();
+    }
+    vStratumJobIds.push_back(strId);
+    while (vStratumJobIds.size() > STRATUM_MAX_JOBS) {
+        mapStratumJobs.erase(vStratumJobIds.front());
+        vStratumJobIds.pop_front();
+    }
+
+    BOOST_FOREACH(CStratumClient *pclient, vStratumClients)
+        if (pclient->fSubscribed)
+            SendJob(pclient, job, fClean);
+}
+
+// Move the difficulty towards one share per STRATUM_VARDIFF_SHARE_TIME, by at most a factor of four
+static void RetargetStratumClient(CStratumClient *pclient)
+{
+    int64 nElapsed = GetTime() - pclient->nLastRetarget;
+    if (pclient->nSharesSinceRetarget < STRATUM_VARDIFF_RETARGET_SHARES && nElapsed < STRATUM_VARDIFF_RETARGET_TIME)
+        return;
+    double dFactor = (double)pclient->nSharesSinceRetarget * STRATUM_VARDIFF_SHARE_TIME / std::max(nElapsed, (int64)1);
+    dFactor = std::max(0.25, std::min(4.0, dFactor));
+    pclient->dDifficulty = std::max(STRATUM_MIN_DIFFICULTY, std::min(pclient->dDifficulty * dFactor, STRATUM_MAX_DIFFICULTY));
+    pclient->nLastRetarget = GetTime();
+    pclient->nSharesSinceRetarget = 0;
+
+    // The new difficulty goes out with a copy of the current job
+    if (!vStratumJobIds.empty() && pclient->dDifficulty != pclient->dSentDifficulty)
+        SendJob(pclient, mapStratumJobs[vStratumJobIds.back()], false);
+}
+
+static Value HandleStratumSubmit(CStratumClient *pclient, const Array &params)
+{
+    if (params.size() < 5)
+        return StratumError(20, "Invalid parameters");
+    for (unsigned int i = 0; i < 5; i++)
+        if (params[i].type() != str_type)
+            return StratumError(20, "Invalid parameters");
+
+    map<string, CStratumJob>::iterator it = mapStratumJobs.find(params[1].get_str());
+    if (it == mapStratumJobs.end())
+        return StratumError(21, "Job not found");
+    CStratumJob &job = it->second;
+
+    vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE)
+        return StratumError(20, "Invalid extranonce2 size");
+    vector<unsigned char> vchExtraNonce(pclient->vchExtraNonce1);
+    vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    unsigned int nTime = strtoul(params[3].get_str().c_str(), NULL, 16);
+    unsigned int nNonce = strtoul(params[4].get_str().c_str(), NULL, 16);
+    if (nTime < job.block.nTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        return StratumError(20, "Time out of range");
+
+    CTransaction txCoinbase;
+    CBlockHeader header;
+    if (!GetStratumShare(job, vchExtraNonce, nTime, nNonce, txCoinbase, header))
+        return StratumError(20, "Invalid coinbase");
+
+    // Only shares meeting the target are remembered, so junk cannot grow the set
+    uint256 hashPoW;
+    scrypt_1024_1_1_256(BEGIN(header.nVersion), BEGIN(hashPoW));
+    if (hashPoW > GetStratumTarget(std::min(pclient->dSentDifficulty, pclient->dPrevSentDifficulty)))
+        return StratumError(23, "Low difficulty share");
+    if (!job.setShares.insert(header.GetHash()).second)
+        return StratumError(22, "Duplicate share");
+    pclient->nSharesSinceRetarget++;
+
+    if (hashPoW <= CBigNum().SetCompact(header.nBits).getuint256()) {
+        CBlock block(header);
+        block.vtx = job.block.vtx;
+        block.vtx[0] = txCoinbase;
+        printf("Stratum: block %s found by %s (%s)\n", block.GetHash().ToString().c_str(),
+               pclient->strWorker.c_str(), pclient->addr.ToString().c_str());
+        LOCK(cs_main);
+        CValidationState state;
+        if (!ProcessBlock(state, NULL, &block))
+            printf("Stratum: block %s not accepted\n", block.GetHash().ToString().c_str());
+    }
+    return true;
+}
+
+static void HandleStratumRequest(CStratumClient *pclient, const string &strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type) {
+        pclient->fDisconnect = true;
+        return;
+    }
+    const Object &request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value valMethod = find_value(request, "method");
+    Value valParams = find_value(request, "params");
+    if (valMethod.type() != str_type) {
+        pclient->Reply(id, Value::null, StratumError(20, "Missing method"));
+        return;
+    }
+    const string &strMethod = valMethod.get_str();
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    if (strMethod == "mining.subscribe") {
+        Array subscription, subscriptions;
+        subscription.push_back("mining.notify");
+        subscription.push_back(HexStr(pclient->vchExtraNonce1));
+        subscriptions.push_back(subscription);
+        Array result;
+        result.push_back(subscriptions);
+        result.push_back(HexStr(pclient->vchExtraNonce1));
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        pclient->Reply(id, result);
+        pclient->fSubscribed = true;
+        if (!vStratumJobIds.empty())
+            SendJob(pclient, mapStratumJobs[vStratumJobIds.back()], true);
+    } else if (strMethod == "mining.authorize") {
+        // Anyone reaching the port may mine; the worker name is only used in the log
+        if (params.size() > 0 && params[0].type() == str_type)
+            pclient->strWorker = params[0].get_str().substr(0, 64);
+        pclient->Reply(id, true);
+    } else if (strMethod == "mining.submit") {
+        if (!pclient->fSubscribed) {
+            pclient->Reply(id, Value::null, StratumError(25, "Not subscribed"));
+            return;
+        }
+        Value result = HandleStratumSubmit(pclient, params);
+        if (result.type() == bool_type) {
+            pclient->nAccepted++;
+            pclient->Reply(id, true);
+        } else {
+            pclient->nRejected++;
+            pclient->Reply(id, false, result);
+        }
+        RetargetStratumClient(pclient);
+    } else {
+        pclient->Reply(id, Value::null, StratumError(20, "Method not supported"));
+    }
+}
+
+static void AcceptStratumClient()
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hStratumListenSocket, (struct sockaddr*)&sockaddr, &len);
+    if (hSocket == INVALID_SOCKET)
+        return;
+    CService addr;
+    addr.SetSockAddr((const struct sockaddr*)&sockaddr);
+    if (vStratumClients.size() >= STRATUM_MAX_CONNECTIONS) {
+        closesocket(hSocket);
+        return;
+    }
+#ifdef WIN32
+    u_long nOne = 1;
+    ioctlsocket(hSocket, FIONBIO, &nOne);
+#else
+    fcntl(hSocket, F_SETFL, O_NONBLOCK);
+#endif
+    vStratumClients.push_back(new CStratumClient(hSocket, addr, ++nStratumExtraNonce1));
+    printf("Stratum: accepted connection from %s\n", addr.ToString().c_str());
+}
+
+static void ReceiveStratumClient(CStratumClient *pclient)
+{
+    char pchBuf[4096];
+    int nBytes = recv(pclient->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes <= 0) {
+        int nErr = WSAGetLastError();
+        if (nBytes == 0 || (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS))
+            pclient->fDisconnect = true;
+        return;
+    }
+    pclient->strRecv.append(pchBuf, nBytes);
+
+    size_t nPos;
+    while (!pclient->fDisconnect && (nPos = pclient->strRecv.find('\n')) != string::npos) {
+        string strLine = pclient->strRecv.substr(0, nPos);
+        pclient->strRecv.erase(0, nPos + 1);
+        if (!strLine.empty())
+            HandleStratumRequest(pclient, strLine);
+    }
+    if (pclient->strRecv.size() > STRATUM_MAX_LINE)
+        pclient->fDisconnect = true;
+}
+
+static void SendStratumClient(CStratumClient *pclient)
+{
+    int nBytes = send(pclient->hSocket, pclient->strSend.data(), pclient->strSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nBytes > 0) {
+        pclient->strSend.erase(0, nBytes);
+    } else if (nBytes < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            pclient->fDisconnect = true;
+    }
+}
+
+static void ClearStratumClients()
+{
+    BOOST_FOREACH(CStratumClient *pclient, vStratumClients)
+        delete pclient;
+    vStratumClients.clear();
+    mapStratumJobs.clear();
+    vStratumJobIds.clear();
+}
+
+static void ThreadStratumServer()
+{
+    RenameThread("isracoin-stratum");
+    try {
+        while (true)
+        {
+            boost::this_thread::interruption_point();
+            UpdateStratumJob();
+
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 100000;
+            fd_set fdsetRecv, fdsetSend;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            FD_SET(hStratumListenSocket, &fdsetRecv);
+            SOCKET hSocketMax = hStratumListenSocket;
+            BOOST_FOREACH(CStratumClient *pclient, vStratumClients) {
+                FD_SET(pclient->hSocket, &fdsetRecv);
+                if (!pclient->strSend.empty())
+                    FD_SET(pclient->hSocket, &fdsetSend);
+                hSocketMax = std::max(hSocketMax, pclient->hSocket);
+            }
+            if (select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout) == SOCKET_ERROR)
+                continue;
+
+            if (FD_ISSET(hStratumListenSocket, &fdsetRecv))
+                AcceptStratumClient();
+            BOOST_FOREACH(CStratumClient *pclient, vStratumClients) {
+                if (FD_ISSET(pclient->hSocket, &fdsetRecv))
+                    ReceiveStratumClient(pclient);
+                if (!pclient->fDisconnect && !pclient->strSend.empty())
+                    SendStratumClient(pclient);
+            }
+
+            for (list<CStratumClient*>::iterator it = vStratumClients.begin(); it != vStratumClients.end(); ) {
+                CStratumClient *pclient = *it;
+                if (pclient->fDisconnect) {
+                    printf("Stratum: %s disconnected (%"PRI64u" shares accepted, %"PRI64u" rejected)\n",
+                           pclient->addr.ToString().c_str(), pclient->nAccepted, pclient->nRejected);
+                    delete pclient;
+                    it = vStratumClients.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    } catch (boost::thread_interrupted&) {
+        ClearStratumClients();
+        throw;
+    } catch (std::exception& e) {
+        // Stop serving, but do not take the node down with us
+        ClearStratumClients();
+        PrintExceptionContinue(&e, "ThreadStratumServer()");
+    }
+}
+
+bool StartStratumServer(string &strError)
+{
+    // Pay to -stratumaddress, or else to a new key of the wallet
+    if (mapArgs.count("-stratumaddress")) {
+        CBitcoinAddress address(mapArgs["-stratumaddress"]);
+        if (!address.IsValid()) {
+            strError = strprintf(_("Invalid -stratumaddress: '%s'"), mapArgs["-stratumaddress"].c_str());
+            return false;
+        }
+        scriptStratumPayout.SetDestination(address.Get());
+    } else {
+        CPubKey pubkey;
+        if (!pwalletMain || !pwalletMain->GetKeyFromPool(pubkey, false)) {
+            strError = _("-stratum needs -stratumaddress, or a wallet with keys left in its key pool");
+            return false;
+        }
+        scriptStratumPayout.SetDestination(pubkey.GetID());
+    }
+
+    CService addrBind;
+    if (!Lookup(GetArg("-stratumbind", "127.0.0.1").c_str(), addrBind, GetArg("-stratumport", DEFAULT_STRATUM_PORT), false)) {
+        strError = strprintf(_("Cannot resolve -stratumbind address: '%s'"), GetArg("-stratumbind", "127.0.0.1").c_str());
+        return false;
+    }
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    int nOne = 1;
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len) ||
+        (hStratumListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET) {
+        strError = strprintf(_("Couldn't open socket for Stratum connections on %s"), addrBind.ToString().c_str());
+        return false;
+    }
+#ifndef WIN32
+    setsockopt(hStratumListenSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+    fcntl(hStratumListenSocket, F_SETFL, O_NONBLOCK);
+#else
+    ioctlsocket(hStratumListenSocket, FIONBIO, (u_long*)&nOne);
+#endif
+    if (::bind(hStratumListenSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR ||
+        listen(hStratumListenSocket, SOMAXCONN) == SOCKET_ERROR) {
+        strError = strprintf(_("Unable to bind to %s for Stratum connections (error %d)"), addrBind.ToString().c_str(), WSAGetLastError());
+        closesocket(hStratumListenSocket);
+        return false;
+    }
+    printf("Stratum server listening on %s, paying to %s\n", addrBind.ToString().c_str(),
+           scriptStratumPayout.ToString().c_str());
+
+    mainSignals.UpdatedBlockTip.connect(&StratumUpdatedBlockTip);
+    mainSignals.UpdatedMempool.connect(&StratumUpdatedMempool);
+    pthreadStratum = new boost::thread(&ThreadStratumServer);
+    return true;
+}
+
+void StopStratumServer()
+{
+    if (pthreadStratum == NULL)
+        return;
+    mainSignals.UpdatedBlockTip.disconnect(&StratumUpdatedBlockTip);
+    mainSignals.UpdatedMempool.disconnect(&StratumUpdatedMempool);
+    pthreadStratum->interrupt();
+    pthreadStratum->join();
+    delete pthreadStratum;
+    pthreadStratum = NULL;
+    closesocket(hStratumListenSocket);
+}
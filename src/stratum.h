@@ -0,0 +1,62 @@
+// Copyright (c) 2013-2014 Isracoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+/** Default port of the Stratum mining server */
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+/** Size of the extranonce the server gives each connection, and of the one the miner rolls */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Share difficulty a new connection starts at, and the range vardiff keeps it in */
+static const double STRATUM_DEFAULT_DIFFICULTY = 1.0;
+static const double STRATUM_MIN_DIFFICULTY = 1.0 / 1024;
+static const double STRATUM_MAX_DIFFICULTY = 1e9; // well below where the target calculation overflows
+/** Vardiff aims at one share per this many seconds, and adjusts after this many shares or seconds */
+static const int64 STRATUM_VARDIFF_SHARE_TIME = 15;
+static const unsigned int STRATUM_VARDIFF_RETARGET_SHARES = 8;
+static const int64 STRATUM_VARDIFF_RETARGET_TIME = 90;
+/** Seconds before the transactions of the current job are refreshed, if the memory pool changed */
+static const int64 STRATUM_JOB_REFRESH_TIME = 30;
+/** Number of jobs on the current best block whose shares are still accepted */
+static const unsigned int STRATUM_MAX_JOBS = 8;
+/** Limits on connections and on the length of a request line */
+static const unsigned int STRATUM_MAX_CONNECTIONS = 256;
+static const unsigned int STRATUM_MAX_LINE = 16 * 1024;
+
+/** Work handed to Stratum miners: a block template with its coinbase split around the extranonces */
+struct CStratumJob
+{
+    std::string strId;
+    CBlock block;                       // the coinbase holds zero extranonces
+    CBlockIndex *pindexPrev;
+    int64 nCreated;
+    std::vector<unsigned char> vchCoinbase1, vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    std::set<uint256> setShares;        // headers submitted so far, to reject duplicates
+
+    CStratumJob() : pindexPrev(NULL), nCreated(0) {}
+};
+
+/** Fill job with a new block template paying to scriptPubKey */
+bool CreateStratumJob(CStratumJob &job, const std::string &strId, const CScript &scriptPubKey);
+/** The coinbase and block header a share stands for. vchExtraNonce is extranonce1 followed by
+ *  extranonce2. Fails if the coinbase does not deserialize. */
+bool GetStratumShare(const CStratumJob &job, const std::vector<unsigned char> &vchExtraNonce,
+                     unsigned int nTime, unsigned int nNonce, CTransaction &txCoinbase, CBlockHeader &header);
+/** Share target for a difficulty. Difficulty 1 is 0x0000ffff << 224, as used by other scrypt pools. */
+uint256 GetStratumTarget(double dDifficulty);
+
+/** Start the Stratum server (-stratum, -stratumport, -stratumbind, -stratumaddress) */
+bool StartStratumServer(std::string &strError);
+/** Disconnect all miners and stop the Stratum server thread */
+void StopStratumServer();
+
+#endif // BITCOIN_STRATUM_H
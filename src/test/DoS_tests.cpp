@@ -16,10 +16,10 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx);
+extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
 
 CService ip(uint32_t i)
 {
@@ -130,11 +130,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -156,7 +156,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -173,7 +173,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // This really-big orphan should be ignored:
@@ -197,7 +197,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx));
+        BOOST_CHECK(!AddOrphanTx(tx, i));
     }
 
     // Test LimitOrphanTxSize() function:
@@ -210,6 +210,51 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+static CTransaction OrphanTx()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_peers)
+{
+    // Indexed by the outpoint they are missing
+    CTransaction tx = OrphanTx();
+    BOOST_CHECK(AddOrphanTx(tx, 2));
+    BOOST_CHECK(!AddOrphanTx(tx, 1));
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(tx.vin[0].prevout));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions[tx.GetHash()].fromPeer, 2);
+
+    // A peer's orphans go when it disconnects
+    for (int i = 0; i < 3; i++)
+        AddOrphanTx(OrphanTx(), 1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 4U);
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1U);
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 1U);
+
+    // When full, the peer sending the most loses its orphans first
+    for (int i = 0; i < 5; i++)
+        AddOrphanTx(OrphanTx(), 1);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(3), 3U);
+    BOOST_CHECK(mapOrphanTransactions.count(tx.GetHash()));
+
+    // And all of them expire
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS), 3U);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
 {
     // Test signature caching code (see key.cpp Verify() methods)
@@ -234,7 +279,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // Create a transaction that depends on orphans:
@@ -0,0 +1,202 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static std::vector<CAddressIndexUpdate> Updates(const CAddressIndexUpdate &update)
+{
+    return std::vector<CAddressIndexUpdate>(1, update);
+}
+
+// The history and unspent entries of an address, one per line
+static std::string DescribeAddress(CBlockTreeDB &db, unsigned char nAddressType, const uint160 &hashAddress)
+{
+    std::vector<std::pair<CAddressIndexKey, int64> > vHistory;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(db.ReadAddressHistory(nAddressType, hashAddress, vHistory));
+    BOOST_CHECK(db.ReadAddressUnspent(nAddressType, hashAddress, vUnspent));
+    std::string str;
+    for (unsigned int i = 0; i < vHistory.size(); i++) {
+        const CAddressIndexKey &key = vHistory[i].first;
+        str += strprintf("history %u %u %s %u %d %"PRI64d"\n", key.nHeight, key.nTxPos, key.txhash.ToString().c_str(),
+                         key.nIndex, key.fSpending, vHistory[i].second);
+    }
+    for (unsigned int i = 0; i < vUnspent.size(); i++) {
+        const CAddressUnspentValue &value = vUnspent[i].second;
+        str += strprintf("unspent %s %u %"PRI64d" %d\n", vUnspent[i].first.txhash.ToString().c_str(),
+                         vUnspent[i].first.nIndex, value.nValue, value.nHeight);
+    }
+    return str;
+}
+
+BOOST_AUTO_TEST_CASE(key_order)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 hashAddress(1), hashOther(2);
+
+    // Written out of order, with heights that sort differently as little endian numbers
+    CAddressIndexUpdate update;
+    update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_PUBKEYHASH, hashAddress, 256, 0, 3, 0, false), 3));
+    update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_PUBKEYHASH, hashAddress, 1, 5, 2, 0, false), 2));
+    update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_PUBKEYHASH, hashAddress, 1, 2, 1, 1, true), 1));
+    update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_PUBKEYHASH, hashAddress, 65536, 0, 4, 0, false), 4));
+    update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_PUBKEYHASH, hashOther, 2, 0, 5, 0, false), 5));
+    update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_SCRIPTHASH, hashAddress, 2, 0, 6, 0, false), 6));
+    BOOST_CHECK(db.WriteAddressIndex(Updates(update), 7));
+
+    // Only the entries of the address, by height and then position in the block
+    std::vector<std::pair<CAddressIndexKey, int64> > vEntries;
+    BOOST_CHECK(db.ReadAddressHistory(ADDRESS_PUBKEYHASH, hashAddress, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 4U);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK_EQUAL(vEntries[i].second, (int64)i + 1);
+    BOOST_CHECK_EQUAL(vEntries[0].first.nTxPos, 2U);
+    BOOST_CHECK(vEntries[0].first.fSpending);
+    BOOST_CHECK_EQUAL(vEntries[3].first.nHeight, 65536U);
+    BOOST_CHECK(vEntries[3].first.txhash == 4);
+
+    uint256 hashTip;
+    BOOST_CHECK(db.ReadAddressIndexTip(hashTip));
+    BOOST_CHECK(hashTip == 7);
+}
+
+BOOST_AUTO_TEST_CASE(pagination)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 hashAddress(3);
+
+    CAddressIndexUpdate update;
+    for (unsigned int i = 0; i < 10; i++) {
+        update.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_PUBKEYHASH, hashAddress, i + 1, 0, i + 1, 0, false), (int64)i));
+        update.vUnspent.push_back(std::make_pair(CAddressUnspentKey(ADDRESS_PUBKEYHASH, hashAddress, i + 1, 0), CAddressUnspentValue(i, CScript(), i + 1)));
+    }
+    BOOST_CHECK(db.WriteAddressIndex(Updates(update), 0));
+
+    // A page in the middle, the last partial page, and one past the end
+    std::vector<std::pair<CAddressIndexKey, int64> > vEntries;
+    BOOST_CHECK(db.ReadAddressHistory(ADDRESS_PUBKEYHASH, hashAddress, vEntries, 3, 4));
+    BOOST_CHECK_EQUAL(vEntries.size(), 4U);
+    BOOST_CHECK_EQUAL(vEntries.front().second, 3);
+    BOOST_CHECK_EQUAL(vEntries.back().second, 6);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressHistory(ADDRESS_PUBKEYHASH, hashAddress, vEntries, 8, 4));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+    BOOST_CHECK_EQUAL(vEntries.back().second, 9);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadAddressHistory(ADDRESS_PUBKEYHASH, hashAddress, vEntries, 10, 4));
+    BOOST_CHECK(vEntries.empty());
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(db.ReadAddressUnspent(ADDRESS_PUBKEYHASH, hashAddress, vUnspent, 2, 3));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 3U);
+    BOOST_CHECK_EQUAL(vUnspent.front().second.nValue, 2);
+    BOOST_CHECK_EQUAL(vUnspent.back().second.nHeight, 5);
+}
+
+BOOST_AUTO_TEST_CASE(connect_disconnect)
+{
+    bool fAddressIndex_stored = fAddressIndex;
+    fAddressIndex = true;
+    LOCK(cs_main);
+
+    CCoinsViewCache view(*pcoinsTip, true);
+    CBlockIndex *pindexPrev = view.GetBestBlock();
+
+    // A coin paying to a script hash whose redeem script needs no signature. Its height is
+    // not 0, which the undo data uses for the outputs of partly spent transactions.
+    const int nFundingHeight = 1;
+    CScript scriptRedeem = CScript() << OP_TRUE;
+    CScript scriptFunding;
+    scriptFunding.SetDestination(scriptRedeem.GetID());
+    CTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vout.resize(1);
+    txFunding.vout[0].nValue = 5 * COIN;
+    txFunding.vout[0].scriptPubKey = scriptFunding;
+    view.SetCoins(txFunding.GetHash(), CCoins(txFunding, nFundingHeight));
+
+    // A block spending it to one key hash, with its coinbase paying to another
+    CKeyID keyPaid(uint160(7)), keyMined(uint160(8));
+    CBlock block;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->nTime + 1;
+    block.nBits = pindexPrev->nBits;
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = COIN;
+    block.vtx[0].vout[0].scriptPubKey.SetDestination(keyMined);
+    block.vtx[1].vin.resize(1);
+    block.vtx[1].vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    block.vtx[1].vin[0].scriptSig = CScript() << std::vector<unsigned char>(scriptRedeem.begin(), scriptRedeem.end());
+    block.vtx[1].vout.resize(1);
+    block.vtx[1].vout[0].nValue = 4 * COIN;
+    block.vtx[1].vout[0].scriptPubKey.SetDestination(keyPaid);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    uint256 hashBlock = block.GetHash();
+
+    CBlockIndex index(block);
+    index.phashBlock = &hashBlock;
+    index.pprev = pindexPrev;
+    index.nHeight = pindexPrev->nHeight + 1;
+
+    // The undo data ConnectBlock would have written, as it does not write any when only checking
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(txFunding.vout[0], false, nFundingHeight, txFunding.nVersion));
+    CDiskBlockPos pos(999, 0);
+    BOOST_CHECK(blockundo.WriteToDisk(pos, pindexPrev->GetBlockHash()));
+    index.nFile = pos.nFile;
+    index.nUndoPos = pos.nPos;
+    index.nStatus |= BLOCK_HAVE_UNDO;
+
+    std::vector<CAddressIndexUpdate> vUpdates;
+    CValidationState state;
+    BOOST_CHECK(block.ConnectBlock(state, &index, view, true, &vUpdates));
+    view.SetBestBlock(&index);
+    bool fClean = false;
+    BOOST_CHECK(block.DisconnectBlock(state, &index, view, &fClean, &vUpdates));
+    BOOST_CHECK(fClean);
+    BOOST_CHECK_EQUAL(vUpdates.size(), 2U);
+
+    // The funding coin indexed as if its block was connected before
+    CBlockTreeDB db(1 << 20, true);
+    uint160 hashScript = scriptRedeem.GetID();
+    CAddressIndexUpdate updateFunding;
+    updateFunding.vHistoryAdd.push_back(std::make_pair(CAddressIndexKey(ADDRESS_SCRIPTHASH, hashScript, nFundingHeight, 0, txFunding.GetHash(), 0, false), 5 * COIN));
+    updateFunding.vUnspent.push_back(std::make_pair(CAddressUnspentKey(ADDRESS_SCRIPTHASH, hashScript, txFunding.GetHash(), 0),
+                                                    CAddressUnspentValue(5 * COIN, scriptFunding, nFundingHeight)));
+    BOOST_CHECK(db.WriteAddressIndex(Updates(updateFunding), pindexPrev->GetBlockHash()));
+    std::string strScriptBefore = DescribeAddress(db, ADDRESS_SCRIPTHASH, hashScript);
+
+    // Connecting spends the coin and indexes both outputs of the block
+    BOOST_CHECK(db.WriteAddressIndex(Updates(vUpdates[0]), hashBlock));
+    std::string strScriptConnected = DescribeAddress(db, ADDRESS_SCRIPTHASH, hashScript);
+    std::string strPaidConnected = DescribeAddress(db, ADDRESS_PUBKEYHASH, keyPaid);
+    BOOST_CHECK(strScriptConnected.find("unspent") == std::string::npos);
+    BOOST_CHECK(strScriptConnected.find(strprintf("%"PRI64d"\n", -5 * COIN)) != std::string::npos);
+    BOOST_CHECK(strPaidConnected.find("unspent") != std::string::npos);
+    BOOST_CHECK(DescribeAddress(db, ADDRESS_PUBKEYHASH, keyMined) != "");
+
+    // Disconnecting leaves the index as it was
+    BOOST_CHECK(db.WriteAddressIndex(Updates(vUpdates[1]), pindexPrev->GetBlockHash()));
+    BOOST_CHECK_EQUAL(DescribeAddress(db, ADDRESS_SCRIPTHASH, hashScript), strScriptBefore);
+    BOOST_CHECK_EQUAL(DescribeAddress(db, ADDRESS_PUBKEYHASH, keyPaid), "");
+    BOOST_CHECK_EQUAL(DescribeAddress(db, ADDRESS_PUBKEYHASH, keyMined), "");
+
+    // Written in one batch, as after a reorganisation back and forth, the last change wins
+    vUpdates.push_back(vUpdates[0]);
+    BOOST_CHECK(db.WriteAddressIndex(vUpdates, hashBlock));
+    BOOST_CHECK_EQUAL(DescribeAddress(db, ADDRESS_SCRIPTHASH, hashScript), strScriptConnected);
+    BOOST_CHECK_EQUAL(DescribeAddress(db, ADDRESS_PUBKEYHASH, keyPaid), strPaidConnected);
+
+    fAddressIndex = fAddressIndex_stored;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
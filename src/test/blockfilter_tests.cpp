@@ -0,0 +1,120 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockfilter.h"
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors from the SipHash paper, key 00 01 .. 0f
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK(hasher.Finalize() == 0x726fdb47dd0e0e31ULL);
+    unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK(hasher.Finalize() == 0x74f839c593dc67fdULL);
+    unsigned char t1[7] = {1,2,3,4,5,6,7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK(hasher.Finalize() == 0x93f5f5799a932462ULL);
+
+    unsigned char t2[15];
+    for (int i = 0; i < 15; i++)
+        t2[i] = i;
+    BOOST_CHECK(CSipHasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL).Write(t2, 15).Finalize() == 0xa129ca6149be45e5ULL);
+}
+
+BOOST_AUTO_TEST_CASE(gcs_match)
+{
+    CGolombCodedSet::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        CGolombCodedSet::Element element1(32, 0);
+        element1[0] = i;
+        included.insert(element1);
+
+        CGolombCodedSet::Element element2(32, 1);
+        element2[0] = i;
+        excluded.insert(element2);
+    }
+
+    CGolombCodedSet filter(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    BOOST_FOREACH(const CGolombCodedSet::Element& element, included) {
+        BOOST_CHECK(filter.Match(element));
+        CGolombCodedSet::ElementSet query(excluded);
+        query.insert(element);
+        BOOST_CHECK(filter.MatchAny(query));
+    }
+    BOOST_CHECK(!filter.MatchAny(excluded));
+
+    // Decoding the encoded set gives the same matches
+    CGolombCodedSet decoded(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 100U);
+    BOOST_CHECK(decoded.MatchAny(included));
+    BOOST_CHECK(!decoded.MatchAny(excluded));
+
+    // Truncated or padded encodings are rejected
+    std::vector<unsigned char> vchBad(filter.GetEncoded().begin(), filter.GetEncoded().end() - 1);
+    BOOST_CHECK_THROW(CGolombCodedSet(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, vchBad), std::ios_base::failure);
+    vchBad = filter.GetEncoded();
+    vchBad.push_back(0);
+    BOOST_CHECK_THROW(CGolombCodedSet(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, vchBad), std::ios_base::failure);
+
+    CGolombCodedSet empty;
+    BOOST_CHECK_EQUAL(empty.GetN(), 0U);
+    BOOST_CHECK(!empty.MatchAny(included));
+}
+
+BOOST_AUTO_TEST_CASE(basic_filter_vector)
+{
+    // BIP158 test vector: Bitcoin testnet genesis block, whose only element is its coinbase output script
+    uint256 hashBlock("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+    std::vector<unsigned char> vchScript = ParseHex("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac");
+
+    CBlockFilter filter(hashBlock, ParseHex("019dfca8"));
+    BOOST_CHECK(filter.GetFilter().Match(vchScript));
+    BOOST_CHECK(filter.ComputeHeader(0) == uint256("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750"));
+
+    // Building the set gives the same encoding; the SipHash key is the first 16 bytes of the block hash
+    CGolombCodedSet::ElementSet elements;
+    elements.insert(vchScript);
+    CGolombCodedSet gcs(0x719526f8d77f4943ULL, 0xaec3ced90fa3f408ULL, BASIC_FILTER_P, BASIC_FILTER_M, elements);
+    BOOST_CHECK(gcs.GetEncoded() == ParseHex("019dfca8"));
+}
+
+BOOST_AUTO_TEST_CASE(block_filter_elements)
+{
+    CBlock genesis;
+    BOOST_CHECK(genesis.ReadFromDisk(pindexGenesisBlock));
+
+    // The genesis block filter only holds the coinbase output script
+    CBlockFilter filter(genesis, NULL);
+    BOOST_CHECK(filter.GetBlockHash() == genesis.GetHash());
+    BOOST_CHECK_EQUAL(filter.GetFilter().GetN(), 1U);
+    const CScript& script = genesis.vtx[0].vout[0].scriptPubKey;
+    BOOST_CHECK(filter.GetFilter().Match(CGolombCodedSet::Element(script.begin(), script.end())));
+
+    // Spent output scripts are added, empty and OP_RETURN scripts are not
+    CBlock block(genesis);
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(4, 0);
+    block.vtx.push_back(tx);
+    CScript scriptSpent = CScript() << OP_TRUE;
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, scriptSpent)));
+
+    CBlockFilter filter2(block, &blockundo);
+    BOOST_CHECK_EQUAL(filter2.GetFilter().GetN(), 2U);
+    BOOST_CHECK(filter2.GetFilter().Match(CGolombCodedSet::Element(scriptSpent.begin(), scriptSpent.end())));
+
+    // Reloading from the encoding gives the same filter
+    CBlockFilter filter3(filter2.GetBlockHash(), filter2.GetEncoded());
+    BOOST_CHECK(filter3.GetHash() == filter2.GetHash());
+    BOOST_CHECK(filter3.ComputeHeader(filter.ComputeHeader(0)) == filter2.ComputeHeader(filter.ComputeHeader(0)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockimport.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+BOOST_AUTO_TEST_CASE(checkblock_cached)
+{
+    CBlock genesis;
+    BOOST_CHECK(genesis.ReadFromDisk(pindexGenesisBlock));
+    BOOST_CHECK(!genesis.fChecked);
+
+    CValidationState state;
+    BOOST_CHECK(genesis.CheckBlock(state, true, false));
+    BOOST_CHECK(!genesis.fChecked);
+    BOOST_CHECK(genesis.CheckBlock(state));
+    BOOST_CHECK(genesis.fChecked);
+
+    // A copy keeps the result, a block deserialized into the same object does not
+    CBlock copy(genesis);
+    BOOST_CHECK(copy.fChecked);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << genesis;
+    ss >> copy;
+    BOOST_CHECK(!copy.fChecked);
+}
+
+BOOST_AUTO_TEST_CASE(import_known_blocks)
+{
+    CBlock genesis;
+    BOOST_CHECK(genesis.ReadFromDisk(pindexGenesisBlock));
+
+    // Garbage around two copies of a block that is already known
+    boost::filesystem::path path = GetDataDir() / "import_test.dat";
+    {
+        CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        fileout << FLATDATA("garbage");
+        for (int i = 0; i < 2; i++)
+            fileout << FLATDATA(pchMessageStart) << (unsigned int)fileout.GetSerializeSize(genesis) << genesis;
+        fileout << FLATDATA(pchMessageStart);
+    }
+
+    std::vector<CImportFile> vFiles;
+    vFiles.push_back(CImportFile(path));
+    vFiles.push_back(CImportFile(GetDataDir() / "nonexistent"));
+    BOOST_CHECK_EQUAL(ImportBlocks(vFiles), 0);
+    BOOST_CHECK(mapBlockIndex.count(genesis.GetHash()));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(import_progress)
+{
+    CImportProgress progress(100);
+    BOOST_CHECK_EQUAL(progress.GetWatermark(), 100U);
+    progress.Found(100, 200);
+    progress.Found(250, 300);
+    progress.Found(300, 400);
+    BOOST_CHECK_EQUAL(progress.GetWatermark(), 100U);
+
+    // A block done before the ones in front of it does not move the watermark
+    progress.Done(250);
+    BOOST_CHECK_EQUAL(progress.GetWatermark(), 100U);
+    progress.Done(100);
+    BOOST_CHECK_EQUAL(progress.GetWatermark(), 300U);
+
+    // Interrupted here, a resumed import finds the block still pending again
+    CImportProgress resumed(progress.GetWatermark());
+    resumed.Found(300, 400);
+    resumed.Done(300);
+    BOOST_CHECK_EQUAL(resumed.GetWatermark(), 400U);
+}
+
+static void WriteBlockRecord(CAutoFile &fileout, const CBlock &block)
+{
+    fileout << FLATDATA(pchMessageStart) << (unsigned int)fileout.GetSerializeSize(block) << block;
+}
+
+BOOST_AUTO_TEST_CASE(reindex_resume)
+{
+    CBlock genesis;
+    BOOST_CHECK(genesis.ReadFromDisk(pindexGenesisBlock));
+    CBlock blockInvalid(genesis);
+    blockInvalid.nNonce++;
+
+    // A block file as if being reindexed, with a block failing its checks and a known one
+    const int nFile = 900;
+    boost::filesystem::path path = GetDataDir() / "reindex_test.dat";
+    {
+        CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        WriteBlockRecord(fileout, blockInvalid);
+        WriteBlockRecord(fileout, genesis);
+    }
+    uint64 nEnd = boost::filesystem::file_size(path);
+    std::vector<CImportFile> vFiles(1, CImportFile(path, nFile));
+
+    // Once every block is done with, the file is reindexed up to its end
+    CBlockImporter importer;
+    uint64 nPos = 0;
+    BOOST_CHECK(!pblocktree->ReadReindexPos(nFile, nPos));
+    BOOST_CHECK_EQUAL(importer.Import(vFiles), 0);
+    BOOST_CHECK(pblocktree->ReadReindexPos(nFile, nPos));
+    BOOST_CHECK_EQUAL(nPos, nEnd);
+
+    // Resumed, with the same checker threads, the reindex goes on from there
+    {
+        CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+        fileout << FLATDATA("garbage");
+        WriteBlockRecord(fileout, genesis);
+    }
+    BOOST_CHECK_EQUAL(importer.Import(vFiles), 0);
+    BOOST_CHECK(pblocktree->ReadReindexPos(nFile, nPos));
+    BOOST_CHECK_EQUAL(nPos, boost::filesystem::file_size(path));
+
+    // Files imported from elsewhere have no watermark
+    BOOST_CHECK_EQUAL(importer.Import(std::vector<CImportFile>(1, CImportFile(path))), 0);
+    BOOST_CHECK(!pblocktree->ReadReindexPos(-1, nPos));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(blockstore_tests)
+
+static CDiskBlockPos WriteRecord(int nFile, const CBlock &block)
+{
+    CDiskBlockPos pos(nFile, 0);
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+    boost::filesystem::create_directories(path.parent_path());
+    CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK((FILE*)fileout != NULL);
+    fileout << FLATDATA(pchMessageStart) << (unsigned int)fileout.GetSerializeSize(block);
+    pos.nPos = ftell(fileout);
+    fileout << block;
+    return pos;
+}
+
+BOOST_AUTO_TEST_CASE(mapped_file)
+{
+    boost::filesystem::path path = GetDataDir() / "mapped_file_test";
+    FILE* file = fopen(path.string().c_str(), "wb");
+    fwrite("isracoin", 1, 8, file);
+    fclose(file);
+
+    CMappedFile mapped;
+    BOOST_CHECK(mapped.Open(path));
+    BOOST_CHECK_EQUAL(mapped.size(), 8U);
+    BOOST_CHECK(std::string(mapped.begin(), mapped.end()) == "isracoin");
+    mapped.Close();
+    BOOST_CHECK(!mapped.IsOpen());
+
+    BOOST_CHECK(!mapped.Open(GetDataDir() / "nonexistent"));
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(mapped_block_reads)
+{
+    CBlock genesis;
+    BOOST_CHECK(genesis.ReadFromDisk(pindexGenesisBlock));
+
+    int nLastBlockFileSaved = nLastBlockFile;
+    CBlockFileMapCache cache(1);
+
+    // Files at or after nLastBlockFile are still being written to, and are never mapped
+    CDiskBlockPos pos = WriteRecord(nLastBlockFileSaved + 1, genesis);
+    const char *pbegin = NULL, *pend = NULL;
+    BOOST_CHECK(!cache.MapBlock(pos, pbegin, pend));
+
+    nLastBlockFile = nLastBlockFileSaved + 3;
+    CDiskBlockPos pos2 = WriteRecord(nLastBlockFileSaved + 2, genesis);
+    boost::shared_ptr<CMappedFile> pmapped = cache.MapBlock(pos, pbegin, pend);
+    BOOST_CHECK(pmapped);
+    CBufferReader ss(pbegin, pend, SER_DISK, CLIENT_VERSION);
+    CBlock block;
+    ss >> block;
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+    BOOST_CHECK(ss.empty());
+
+    // Only one mapping is kept; switching files evicts the other one, but not from under its readers
+    BOOST_CHECK(cache.MapBlock(pos2, pbegin, pend));
+    BOOST_CHECK(pmapped->IsOpen());
+    pmapped.reset();
+    BOOST_CHECK(cache.MapBlock(pos, pbegin, pend));
+
+    // Positions not pointing at a record are not served
+    CDiskBlockPos posBad(pos.nFile, pos.nPos + 1);
+    BOOST_CHECK(!cache.MapBlock(posBad, pbegin, pend));
+
+    // Reads through the block index deserialize from the mapping
+    CBlock blockRead;
+    BOOST_CHECK(blockRead.ReadFromDisk(pos2));
+    BOOST_CHECK(blockRead.GetHash() == genesis.GetHash());
+
+    cache.Clear();
+    blockfilemaps.Invalidate(pos2.nFile);
+    nLastBlockFile = nLastBlockFileSaved;
+    boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nLastBlockFileSaved + 1));
+    boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nLastBlockFileSaved + 2));
+}
+
+BOOST_AUTO_TEST_CASE(commit_chain_state)
+{
+    BOOST_CHECK(pcoinsTip->SetCoins(GetRandHash(), CCoins()));
+    BOOST_CHECK(pcoinsTip->GetCacheSize() > 0);
+
+    // A forced commit writes the coin cache out, whether or not a commit is due
+    CValidationState state;
+    BOOST_CHECK(CommitChainState(state, true));
+    BOOST_CHECK_EQUAL(pcoinsTip->GetCacheSize(), 0U);
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == pindexBest);
+    BOOST_CHECK(CommitChainState(state));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
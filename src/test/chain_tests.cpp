@@ -0,0 +1,136 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+BOOST_AUTO_TEST_CASE(chain_set_tip)
+{
+    // A main branch of 100 blocks, and a side branch forking off at height 49
+    std::vector<CBlockIndex> vMain(100), vSide(20);
+    for (unsigned int i = 0; i < vMain.size(); i++) {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = i > 0 ? &vMain[i - 1] : NULL;
+    }
+    for (unsigned int i = 0; i < vSide.size(); i++) {
+        vSide[i].nHeight = 50 + i;
+        vSide[i].pprev = i > 0 ? &vSide[i - 1] : &vMain[49];
+    }
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK(chain.Genesis() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+
+    BOOST_CHECK(chain.SetTip(&vMain[99]) == NULL);
+    BOOST_CHECK(chain.Genesis() == &vMain[0]);
+    BOOST_CHECK(chain.Tip() == &vMain[99]);
+    BOOST_CHECK_EQUAL(chain.Height(), 99);
+    for (unsigned int i = 0; i < vMain.size(); i++) {
+        BOOST_CHECK(chain[i] == &vMain[i]);
+        BOOST_CHECK(chain.Contains(&vMain[i]));
+        BOOST_CHECK(chain.Next(&vMain[i]) == (i < 99 ? &vMain[i + 1] : NULL));
+    }
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain[100] == NULL);
+    BOOST_CHECK(!chain.Contains(&vSide[0]));
+    BOOST_CHECK(chain.Next(&vSide[0]) == NULL);
+
+    // Reorganise to the side branch: the fork point is returned, and the
+    // entries of the old branch above the new tip are dropped
+    BOOST_CHECK(chain.SetTip(&vSide[19]) == &vMain[49]);
+    BOOST_CHECK(chain.Tip() == &vSide[19]);
+    BOOST_CHECK_EQUAL(chain.Height(), 69);
+    BOOST_CHECK(chain.Contains(&vMain[49]));
+    BOOST_CHECK(!chain.Contains(&vMain[50]));
+    BOOST_CHECK(!chain.Contains(&vMain[80]));
+    BOOST_CHECK(chain.Next(&vMain[49]) == &vSide[0]);
+    BOOST_CHECK(chain[60] == &vSide[10]);
+
+    // And back again
+    BOOST_CHECK(chain.SetTip(&vMain[99]) == &vMain[49]);
+    BOOST_CHECK(chain[60] == &vMain[60]);
+
+    // Disconnecting the tip only
+    BOOST_CHECK(chain.SetTip(&vMain[98]) == &vMain[98]);
+    BOOST_CHECK(chain.Tip() == &vMain[98]);
+    BOOST_CHECK(!chain.Contains(&vMain[99]));
+
+    BOOST_CHECK(chain.SetTip(NULL) == NULL);
+    BOOST_CHECK(chain.Tip() == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_ancestors)
+{
+    std::vector<CBlockIndex> vIndex(30000);
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+        vIndex[i].BuildSkip();
+    }
+
+    for (unsigned int i = 1; i < vIndex.size(); i++) {
+        BOOST_CHECK(vIndex[i].pskip != NULL);
+        BOOST_CHECK(vIndex[i].pskip->nHeight < vIndex[i].nHeight);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int nFrom = insecure_rand() % vIndex.size();
+        int nTo = insecure_rand() % (nFrom + 1);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nTo) == &vIndex[nTo]);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nFrom) == &vIndex[nFrom]);
+    }
+    BOOST_CHECK(vIndex[100].GetAncestor(101) == NULL);
+    BOOST_CHECK(vIndex[100].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(last_common_ancestor)
+{
+    // Two branches of 2000 blocks on top of a common trunk of 5000 blocks
+    std::vector<CBlockIndex> vTrunk(5000), vA(2000), vB(2000);
+    for (unsigned int i = 0; i < vTrunk.size(); i++) {
+        vTrunk[i].nHeight = i;
+        vTrunk[i].pprev = i > 0 ? &vTrunk[i - 1] : NULL;
+        vTrunk[i].BuildSkip();
+    }
+    for (unsigned int i = 0; i < vA.size(); i++) {
+        vA[i].nHeight = vB[i].nHeight = 5000 + i;
+        vA[i].pprev = i > 0 ? &vA[i - 1] : &vTrunk[4999];
+        vB[i].pprev = i > 0 ? &vB[i - 1] : &vTrunk[4999];
+        vA[i].BuildSkip();
+        vB[i].BuildSkip();
+    }
+
+    BOOST_CHECK(LastCommonAncestor(&vA[1999], &vB[1999]) == &vTrunk[4999]);
+    BOOST_CHECK(LastCommonAncestor(&vA[10], &vB[1500]) == &vTrunk[4999]);
+    BOOST_CHECK(LastCommonAncestor(&vA[1999], &vA[700]) == &vA[700]);
+    BOOST_CHECK(LastCommonAncestor(&vTrunk[1234], &vB[3]) == &vTrunk[1234]);
+    BOOST_CHECK(LastCommonAncestor(&vA[5], NULL) == NULL);
+
+    // Blocks without a common genesis have no common ancestor
+    CBlockIndex orphan;
+    BOOST_CHECK(LastCommonAncestor(&vA[5], &orphan) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(block_map)
+{
+    BlockHasher hasher;
+    uint256 hash = GetRandHash();
+    BOOST_CHECK_EQUAL(hasher(hash), hasher(hash));
+    BOOST_CHECK(hasher(hash) != hasher(hash ^ 1));
+
+    // Keys stay where they are when the table grows, so phashBlock can point at them
+    std::vector<CBlockIndex> vIndex(5000);
+    BlockMap map;
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        BlockMap::iterator mi = map.insert(std::make_pair(uint256(i), &vIndex[i])).first;
+        vIndex[i].phashBlock = &mi->first;
+    }
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        BOOST_CHECK(vIndex[i].GetBlockHash() == uint256(i));
+        BOOST_CHECK(map[uint256(i)] == &vIndex[i]);
+    }
+    BOOST_CHECK(map.find(uint256(vIndex.size())) == map.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,105 @@
+#include <boost/test/unit_test.hpp>
+
+#include "leveldb.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+BOOST_AUTO_TEST_SUITE(leveldb_tests)
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    CLatencyHistogram hist;
+    hist.Add(0);
+    hist.Add(1);
+    hist.Add(3);
+    hist.Add(4);
+    hist.Add((int64)1 << 40);
+    BOOST_CHECK_EQUAL(hist.nCount, 5U);
+    BOOST_CHECK_EQUAL(hist.vBuckets[0], 1U); // < 1us
+    BOOST_CHECK_EQUAL(hist.vBuckets[1], 1U); // < 2us
+    BOOST_CHECK_EQUAL(hist.vBuckets[2], 1U); // < 4us
+    BOOST_CHECK_EQUAL(hist.vBuckets[3], 1U); // < 8us
+    BOOST_CHECK_EQUAL(hist.vBuckets[CLatencyHistogram::BUCKETS - 1], 1U);
+}
+
+BOOST_AUTO_TEST_CASE(profile_options)
+{
+    mapMultiArgs["-dbopt"].push_back("chainstate:maxopenfiles=500");
+    mapMultiArgs["-dbopt"].push_back("chainstate:bloombits=0");
+    mapMultiArgs["-dbopt"].push_back("index:compression=1");
+    mapMultiArgs["-dbopt"].push_back("chainstate:compactionthreads=4");
+    mapMultiArgs["-dbopt"].push_back("index:subcompactions=100");
+    mapMultiArgs["-dbopt"].push_back("chainstate:unknown=1");
+    mapMultiArgs["-dbopt"].push_back("malformed");
+
+    CLevelDBProfile profile = GetLevelDBProfile("chainstate");
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, 500);
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 0);
+    BOOST_CHECK(!profile.fCompression);
+    BOOST_CHECK_EQUAL(profile.nBlockCachePercent, CLevelDBProfile().nBlockCachePercent);
+    BOOST_CHECK_EQUAL(profile.nCompactionThreads, 4);
+    BOOST_CHECK_EQUAL(profile.nSubcompactions, DEFAULT_DB_COMPACTION_THREADS);
+
+    profile = GetLevelDBProfile("index");
+    BOOST_CHECK(profile.fCompression);
+    BOOST_CHECK_EQUAL(profile.nCompactionThreads, DEFAULT_DB_COMPACTION_THREADS);
+    BOOST_CHECK_EQUAL(profile.nSubcompactions, 16);
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, CLevelDBProfile().nMaxOpenFiles);
+
+    mapMultiArgs.erase("-dbopt");
+}
+
+BOOST_AUTO_TEST_CASE(database_stats)
+{
+    CLevelDB db(GetDataDir() / "statstest", 1 << 20, true);
+    BOOST_CHECK(db.Write('k', 1));
+    int nValue = 0;
+    BOOST_CHECK(db.Read('k', nValue));
+    BOOST_CHECK(!db.Exists('x'));
+
+    CLevelDBStats stats = db.GetStats();
+    BOOST_CHECK(stats.strName == "statstest");
+    BOOST_CHECK_EQUAL(stats.histRead.nCount, 2U);
+    BOOST_CHECK_EQUAL(stats.histWrite.nCount, 1U);
+    BOOST_CHECK(!stats.strStats.empty());
+
+    bool fFound = false;
+    BOOST_FOREACH(const CLevelDBStats &statsOpen, GetLevelDBStats())
+        fFound |= statsOpen.strName == "statstest";
+    BOOST_CHECK(fFound);
+}
+
+BOOST_AUTO_TEST_CASE(read_values)
+{
+    CLevelDB db(GetDataDir() / "readtest", 1 << 20, true);
+    std::vector<unsigned char> vch(1000, 0x5a);
+    BOOST_CHECK(db.Write('v', vch));
+    BOOST_CHECK(db.Write('s', (unsigned char)1));
+
+    std::vector<unsigned char> vchRead;
+    BOOST_CHECK(db.Read('v', vchRead));
+    BOOST_CHECK(vchRead == vch);
+
+    // A value too short for the requested type fails to read instead of running past the end
+    uint256 hash;
+    BOOST_CHECK(!db.Read('s', hash));
+    BOOST_CHECK(!db.Read('x', hash));
+}
+
+BOOST_AUTO_TEST_CASE(compact)
+{
+    CLevelDB db(GetDataDir() / "compacttest", 1 << 20, true);
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK(db.Write(std::make_pair((unsigned char)(i % 256), i), std::vector<unsigned char>(100, i)));
+    BOOST_CHECK(db.Erase(std::make_pair((unsigned char)0xff, 255)));
+
+    db.Compact();
+    for (int i = 0; i < 1000; i++) {
+        std::vector<unsigned char> vch;
+        BOOST_CHECK_EQUAL(db.Read(std::make_pair((unsigned char)(i % 256), i), vch), i != 255);
+        BOOST_CHECK(i == 255 || vch == std::vector<unsigned char>(100, i));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,218 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction spending output n of each of vParents, or a made-up output if there are none
+static CTransaction MakeTx(const std::vector<CTransaction> &vParents, int64 nValue, unsigned int n = 0)
+{
+    CTransaction tx;
+    if (vParents.empty()) {
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    }
+    for (unsigned int i = 0; i < vParents.size(); i++)
+        tx.vin.push_back(CTxIn(COutPoint(vParents[i].GetHash(), n)));
+    tx.vout.resize(2);
+    tx.vout[0].nValue = tx.vout[1].nValue = nValue;
+    tx.vout[0].scriptPubKey = tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(ancestor_descendant_totals)
+{
+    CTxMemPool pool;
+    std::vector<CTransaction> vNone;
+
+    // A <- B <- C, and A <- D (spending the other output of A)
+    CTransaction txA = MakeTx(vNone, 1000);
+    CTransaction txB = MakeTx(std::vector<CTransaction>(1, txA), 900);
+    CTransaction txC = MakeTx(std::vector<CTransaction>(1, txB), 800);
+    CTransaction txD = MakeTx(std::vector<CTransaction>(1, txA), 700, 1);
+
+    BOOST_CHECK(pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 5000, 1, 1)));
+    BOOST_CHECK(pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 20000, 2, 1)));
+    BOOST_CHECK(pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 30000, 3, 1)));
+    BOOST_CHECK(pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 40000, 4, 1)));
+    BOOST_CHECK(!pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 40000, 4, 1)));
+    BOOST_CHECK(pool.CheckIndexes());
+
+    const CTxMemPoolEntry *pA = pool.lookupEntry(txA.GetHash());
+    const CTxMemPoolEntry *pC = pool.lookupEntry(txC.GetHash());
+    BOOST_CHECK_EQUAL(pA->nCountWithDescendants, 4U);
+    BOOST_CHECK_EQUAL(pA->nFeesWithDescendants, 95000);
+    BOOST_CHECK_EQUAL(pA->nCountWithAncestors, 1U);
+    BOOST_CHECK_EQUAL(pC->nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(pC->nFeesWithAncestors, 55000);
+    BOOST_CHECK_EQUAL(pC->nSizeWithAncestors, pA->nTxSize + pool.lookupEntry(txB.GetHash())->nTxSize + pC->nTxSize);
+
+    // Oldest first, and the package with the best fee rate first
+    BOOST_CHECK(*pool.setByTime.begin() == pA);
+    BOOST_CHECK((*pool.setByAncestorScore.begin())->hash == txD.GetHash());
+    BOOST_CHECK(*pool.setByDescendantScore.begin() == pA);
+
+    // Removing B without its child cuts C off from A
+    pool.remove(txB);
+    BOOST_CHECK(pool.CheckIndexes());
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK_EQUAL(pC->nCountWithAncestors, 1U);
+    BOOST_CHECK_EQUAL(pA->nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(pA->nFeesWithDescendants, 45000);
+
+    // B coming back (as after a reorganisation) is linked to its child again
+    BOOST_CHECK(pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 20000, 5, 1)));
+    BOOST_CHECK(pool.CheckIndexes());
+    BOOST_CHECK_EQUAL(pC->nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(pA->nCountWithDescendants, 4U);
+
+    // Recursive removal takes the descendants along
+    pool.remove(txA, true);
+    BOOST_CHECK(pool.CheckIndexes());
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(pool.setByTime.empty());
+    BOOST_CHECK(pool.mapNextTx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(trim_and_expire)
+{
+    CTxMemPool pool;
+    std::vector<CTransaction> vNone;
+
+    // A <- B pays well as a package, C alone pays a bit less, D pays nothing
+    CTransaction txA = MakeTx(vNone, 1000);
+    CTransaction txB = MakeTx(std::vector<CTransaction>(1, txA), 900);
+    CTransaction txC = MakeTx(vNone, 800);
+    CTransaction txD = MakeTx(vNone, 700);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 10000, 1, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 50000, 2, 1));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 20000, 3, 1));
+    pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 0, 4, 1));
+    BOOST_CHECK(pool.CheckIndexes());
+    BOOST_CHECK(pool.DynamicMemoryUsage() > 0);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), 0);
+
+    // Nothing to do while within the limit
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+
+    // D goes first, then C; A stays as B pays for it
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(!pool.exists(txD.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), (double)CTransaction::nMinRelayTxFee);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(txC.GetHash()));
+    BOOST_CHECK(pool.exists(txA.GetHash()) && pool.exists(txB.GetHash()));
+    BOOST_CHECK(pool.CheckIndexes());
+    double dMinFee = pool.GetMinFee(1000000);
+    BOOST_CHECK(dMinFee > CTransaction::nMinRelayTxFee);
+
+    // The minimum fee decays, faster while the pool is nearly empty
+    SetMockTime(GetTime() + ROLLING_FEE_HALFLIFE / 4);
+    BOOST_CHECK(pool.GetMinFee(1000000) < dMinFee * 0.51);
+    SetMockTime(GetTime() + ROLLING_FEE_HALFLIFE * 10);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), 0);
+    SetMockTime(0);
+
+    // Expiring A takes its child along
+    BOOST_CHECK_EQUAL(pool.Expire(2), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK(pool.CheckIndexes());
+}
+
+BOOST_AUTO_TEST_CASE(persist)
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::remove(path);
+
+    CTransaction tx = MakeTx(std::vector<CTransaction>(), 1000);
+    int64 nEntryTime = GetTime() - 60;
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, nEntryTime, 1));
+
+    // Nothing is written before the pool was loaded
+    BOOST_CHECK(!DumpMempool());
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK(DumpMempool());
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        uint64 nVersion, nCount;
+        CTransaction txRead;
+        int64 nTime;
+        filein >> nVersion >> nCount >> txRead >> nTime;
+        BOOST_CHECK_EQUAL(nVersion, MEMPOOL_DUMP_VERSION);
+        BOOST_CHECK_EQUAL(nCount, 1U);
+        BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+        BOOST_CHECK_EQUAL(nTime, nEntryTime);
+    }
+
+    // The transaction is checked again when loaded, and its inputs do not exist
+    mempool.clear();
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(accept_batch)
+{
+    // Anyone-can-spend outputs are only standard on testnet
+    bool fTestNet_stored = fTestNet;
+    fTestNet = true;
+
+    CTransaction txFunding = MakeTx(std::vector<CTransaction>(), 10 * CENT);
+    txFunding.vout[1].scriptPubKey = CScript() << OP_FALSE;
+    pcoinsTip->SetCoins(txFunding.GetHash(), CCoins(txFunding, 1));
+
+    // A child given before its parent, one spending an output whose script fails, and one with unknown inputs
+    CTransaction txParent = MakeTx(std::vector<CTransaction>(1, txFunding), 4 * CENT);
+    CTransaction txChild = MakeTx(std::vector<CTransaction>(1, txParent), 1 * CENT);
+    CTransaction txBad = MakeTx(std::vector<CTransaction>(1, txFunding), 4 * CENT, 1);
+    CTransaction txMissing = MakeTx(std::vector<CTransaction>(), 1 * CENT);
+
+    int64 nParentTime = GetTime() - 60;
+    std::vector<CMemPoolBatchTx> vBatch;
+    vBatch.push_back(CMemPoolBatchTx(txChild));
+    vBatch.push_back(CMemPoolBatchTx(txParent, nParentTime));
+    vBatch.push_back(CMemPoolBatchTx(txBad));
+    vBatch.push_back(CMemPoolBatchTx(txMissing));
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(AcceptToMemoryPoolBatch(vBatch, false));
+    }
+
+    BOOST_CHECK(vBatch[0].fAccepted && vBatch[1].fAccepted);
+    BOOST_CHECK(mempool.exists(txParent.GetHash()) && mempool.exists(txChild.GetHash()));
+    BOOST_CHECK_EQUAL(mempool.lookupEntry(txParent.GetHash())->nTime, nParentTime);
+    BOOST_CHECK_EQUAL(mempool.lookupEntry(txChild.GetHash())->nCountWithAncestors, 2U);
+
+    // Their fee and sigops were worked out on entry, for template building and ConnectBlock
+    int64 nFee = 0;
+    unsigned int nSigOps = 1;
+    BOOST_CHECK(mempool.lookupFeeAndSigOps(txParent.GetHash(), nFee, nSigOps));
+    BOOST_CHECK_EQUAL(nFee, 2 * CENT);
+    BOOST_CHECK_EQUAL(nSigOps, txParent.GetLegacySigOpCount());
+    BOOST_CHECK(!mempool.lookupFeeAndSigOps(txBad.GetHash(), nFee, nSigOps));
+
+    int nDoS = 0;
+    BOOST_CHECK(!vBatch[2].fAccepted && !vBatch[2].fMissingInputs);
+    BOOST_CHECK(vBatch[2].state.IsInvalid(nDoS) && nDoS == 100);
+    BOOST_CHECK(!vBatch[3].fAccepted && vBatch[3].fMissingInputs);
+    BOOST_CHECK(mempool.CheckIndexes());
+
+    mempool.clear();
+    pcoinsTip->SetCoins(txFunding.GetHash(), CCoins());
+    fTestNet = fTestNet_stored;
+}
+
+BOOST_AUTO_TEST_CASE(priority)
+{
+    CTransaction tx = MakeTx(std::vector<CTransaction>(), 1000);
+    CTxMemPoolEntry entry(tx, 0, 0, 100, 50.0, 2 * COIN);
+    BOOST_CHECK_EQUAL(entry.GetPriority(100), 50.0);
+    BOOST_CHECK_EQUAL(entry.GetPriority(110), 50.0 + 20.0 * COIN / entry.nTxSize);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -187,6 +187,13 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, tx);
     BOOST_CHECK(pblocktemplate = CreateNewBlockWithKey(reservekey));
+
+    // The next template extends the previous set of transactions, and picks the same ones
+    CBlockTemplate *pblocktemplate2;
+    BOOST_CHECK(pblocktemplate2 = CreateNewBlockWithKey(reservekey));
+    BOOST_CHECK_EQUAL(pblocktemplate2->block.vtx.size(), pblocktemplate->block.vtx.size());
+    BOOST_CHECK(pblocktemplate2->vTxFees == pblocktemplate->vTxFees);
+    delete pblocktemplate2;
     delete pblocktemplate;
     mempool.clear();
 
@@ -0,0 +1,121 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+BOOST_AUTO_TEST_SUITE(prune_tests)
+
+// Files of 100 MiB blocks and 10 MiB undo data, each holding 1000 blocks
+static std::vector<CBlockFileInfo> BlockFiles(int nFiles)
+{
+    std::vector<CBlockFileInfo> vinfo(nFiles);
+    for (int nFile = 0; nFile < nFiles; nFile++) {
+        vinfo[nFile].nBlocks = 1000;
+        vinfo[nFile].nSize = 100 << 20;
+        vinfo[nFile].nUndoSize = 10 << 20;
+        vinfo[nFile].nHeightFirst = nFile * 1000;
+        vinfo[nFile].nHeightLast = nFile * 1000 + 999;
+    }
+    return vinfo;
+}
+
+BOOST_AUTO_TEST_CASE(prune_target)
+{
+    std::vector<CBlockFileInfo> vinfo = BlockFiles(6);
+    std::set<int> setFiles;
+
+    // Below the target, with room for the next chunks, nothing goes
+    BOOST_CHECK_EQUAL(FindFilesToPrune(vinfo, 10000, 1000 << 20, setFiles), (uint64)660 << 20);
+    BOOST_CHECK(setFiles.empty());
+
+    // The oldest files go until the rest and the next chunks fit
+    BOOST_CHECK_EQUAL(FindFilesToPrune(vinfo, 10000, 300 << 20, setFiles), (uint64)220 << 20);
+    BOOST_CHECK_EQUAL(setFiles.size(), 4U);
+    BOOST_CHECK(setFiles.count(0) && setFiles.count(3));
+
+    // The file being written to stays, however low the target
+    setFiles.clear();
+    BOOST_CHECK_EQUAL(FindFilesToPrune(vinfo, 10000, 0, setFiles), (uint64)110 << 20);
+    BOOST_CHECK_EQUAL(setFiles.size(), 5U);
+    BOOST_CHECK(!setFiles.count(5));
+
+    // Files already pruned are skipped
+    vinfo[0].SetNull();
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 10000, 0, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 4U);
+    BOOST_CHECK(!setFiles.count(0));
+}
+
+BOOST_AUTO_TEST_CASE(keep_recent_blocks)
+{
+    std::vector<CBlockFileInfo> vinfo = BlockFiles(6);
+    std::set<int> setFiles;
+
+    // Nothing goes before the chain is longer than the blocks to keep
+    FindFilesToPrune(vinfo, MIN_BLOCKS_TO_KEEP, 0, setFiles);
+    BOOST_CHECK(setFiles.empty());
+
+    // A file goes once its last block is MIN_BLOCKS_TO_KEEP below the tip
+    FindFilesToPrune(vinfo, 2999 + MIN_BLOCKS_TO_KEEP - 1, 0, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(!setFiles.count(2));
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 2999 + MIN_BLOCKS_TO_KEEP, 0, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 3U);
+    BOOST_CHECK(setFiles.count(2));
+
+    // Recent blocks in an old file keep it, but not the files before it
+    vinfo[1].nHeightLast = 5999;
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 2999 + MIN_BLOCKS_TO_KEEP, 0, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(setFiles.count(0) && !setFiles.count(1));
+}
+
+BOOST_AUTO_TEST_CASE(clear_block_data)
+{
+    LOCK(cs_main);
+    bool fHavePruned_stored = fHavePruned;
+    fHavePruned = false;
+
+    // One block in a file that goes, one in a file that stays
+    CBlockIndex *pindexPruned = new CBlockIndex();
+    CBlockIndex *pindexKept = new CBlockIndex();
+    BlockMap::iterator miPruned = mapBlockIndex.insert(std::make_pair(uint256(1), pindexPruned)).first;
+    BlockMap::iterator miKept = mapBlockIndex.insert(std::make_pair(uint256(2), pindexKept)).first;
+    pindexPruned->phashBlock = &miPruned->first;
+    pindexKept->phashBlock = &miKept->first;
+    pindexPruned->nFile = 7;
+    pindexKept->nFile = 8;
+    pindexPruned->nStatus = pindexKept->nStatus = BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+    pindexPruned->nDataPos = pindexKept->nDataPos = 8;
+    pindexPruned->nUndoPos = pindexKept->nUndoPos = 8;
+    CBlockFileInfo info = BlockFiles(1)[0];
+    BOOST_CHECK(pblocktree->WriteBlockFileInfo(7, info));
+
+    std::set<int> setFiles;
+    setFiles.insert(7);
+    CValidationState state;
+    BOOST_CHECK(PruneBlockIndex(state, setFiles));
+
+    BOOST_CHECK(!(pindexPruned->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)));
+    BOOST_CHECK_EQUAL(pindexPruned->nDataPos, 0U);
+    BOOST_CHECK_EQUAL(pindexKept->nStatus, (unsigned int)(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO));
+    BOOST_CHECK_EQUAL(pindexKept->nFile, 8);
+    BOOST_CHECK(pblocktree->ReadBlockFileInfo(7, info));
+    BOOST_CHECK_EQUAL(info.nSize, 0U);
+    bool fPrunedFlag = false;
+    BOOST_CHECK(pblocktree->ReadFlag("prunedblockfiles", fPrunedFlag));
+    BOOST_CHECK(fPrunedFlag);
+    BOOST_CHECK(fHavePruned);
+
+    mapBlockIndex.erase(miPruned);
+    mapBlockIndex.erase(miKept);
+    delete pindexPruned;
+    delete pindexKept;
+    BOOST_CHECK(pblocktree->WriteFlag("prunedblockfiles", false));
+    fHavePruned = fHavePruned_stored;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
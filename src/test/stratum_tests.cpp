@@ -0,0 +1,51 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "stratum.h"
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(job_and_share)
+{
+    CStratumJob job;
+    BOOST_CHECK(CreateStratumJob(job, "1", CScript() << OP_TRUE));
+    BOOST_CHECK(job.block.hashPrevBlock == hashBestChain);
+    BOOST_CHECK_EQUAL(job.strId, "1");
+
+    // The two halves around zero extranonces make the template's coinbase
+    std::vector<unsigned char> vchExtraNonce(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    CTransaction txCoinbase;
+    CBlockHeader header;
+    BOOST_CHECK(GetStratumShare(job, vchExtraNonce, job.block.nTime + 1, 7, txCoinbase, header));
+    BOOST_CHECK(txCoinbase.GetHash() == job.block.vtx[0].GetHash());
+    BOOST_CHECK(header.hashMerkleRoot == job.block.hashMerkleRoot);
+    BOOST_CHECK(header.hashPrevBlock == job.block.hashPrevBlock);
+    BOOST_CHECK_EQUAL(header.nTime, job.block.nTime + 1);
+    BOOST_CHECK_EQUAL(header.nNonce, 7U);
+
+    // Other extranonces end up in the coinbase, and the merkle branch gives the block's merkle root
+    vchExtraNonce[0] = 0x11;
+    vchExtraNonce[vchExtraNonce.size() - 1] = 0x22;
+    BOOST_CHECK(GetStratumShare(job, vchExtraNonce, job.block.nTime, 0, txCoinbase, header));
+    const CScript &scriptSig = txCoinbase.vin[0].scriptSig;
+    BOOST_CHECK(std::search(scriptSig.begin(), scriptSig.end(), vchExtraNonce.begin(), vchExtraNonce.end()) != scriptSig.end());
+    CBlock block(header);
+    block.vtx = job.block.vtx;
+    block.vtx[0] = txCoinbase;
+    BOOST_CHECK(block.BuildMerkleTree() == header.hashMerkleRoot);
+    CValidationState state;
+    BOOST_CHECK(block.CheckBlock(state, false, true));
+}
+
+BOOST_AUTO_TEST_CASE(share_target)
+{
+    CBigNum bnDiff1 = CBigNum().SetCompact(0x1f00ffff);
+    BOOST_CHECK(GetStratumTarget(1) == bnDiff1.getuint256());
+    BOOST_CHECK(GetStratumTarget(2) == (bnDiff1 / 2).getuint256());
+    BOOST_CHECK(GetStratumTarget(0.5) == (bnDiff1 * 2).getuint256());
+    BOOST_CHECK(GetStratumTarget(0) == GetStratumTarget(STRATUM_MIN_DIFFICULTY));
+    BOOST_CHECK(GetStratumTarget(1e20) == GetStratumTarget(STRATUM_MAX_DIFFICULTY));
+    BOOST_CHECK(GetStratumTarget(STRATUM_MAX_DIFFICULTY) != 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -42,7 +42,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -88,6 +88,16 @@ bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo &info) {
     return Write(make_pair('f', nFile), info);
 }
 
+bool CBlockTreeDB::WritePrunedBlockFiles(const std::vector<CDiskBlockIndex> &vBlockIndex, const std::set<int> &setFiles) {
+    CLevelDBBatch batch;
+    BOOST_FOREACH(const CDiskBlockIndex &blockindex, vBlockIndex)
+        batch.Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+    BOOST_FOREACH(int nFile, setFiles)
+        batch.Write(make_pair('f', nFile), CBlockFileInfo());
+    batch.Write(std::make_pair('F', std::string("prunedblockfiles")), '1');
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
     return Read(make_pair('f', nFile), info);
 }
@@ -108,6 +118,28 @@ bool CBlockTreeDB::ReadReindexing(bool &fReindexing) {
     return true;
 }
 
+bool CBlockTreeDB::WriteReindexPos(int nFile, uint64 nPos) {
+    return Write(make_pair('r', nFile), nPos);
+}
+
+bool CBlockTreeDB::ReadReindexPos(int nFile, uint64 &nPos) {
+    return Read(make_pair('r', nFile), nPos);
+}
+
+// The tip recorded at a clean shutdown, after which the databases were known to be consistent.
+// It is synced both ways, and erased at startup so that it never survives an unclean exit.
+bool CBlockTreeDB::WriteVerifiedTip(const uint256 &hash) {
+    return Write('V', hash, true);
+}
+
+bool CBlockTreeDB::ReadVerifiedTip(uint256 &hash) {
+    return Read('V', hash);
+}
+
+bool CBlockTreeDB::EraseVerifiedTip() {
+    return Erase('V', true);
+}
+
 bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
@@ -124,12 +156,12 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CBufferReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
             if (chType == 'c') {
                 leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CBufferReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
                 CCoins coins;
                 ssValue >> coins;
                 uint256 txhash;
@@ -174,6 +206,77 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<CAddressIndexUpdate> &vUpdates, const uint256 &hashTip) {
+    // A batch applies its operations in order, so a block disconnected and connected again ends up indexed
+    CLevelDBBatch batch;
+    BOOST_FOREACH(const CAddressIndexUpdate &update, vUpdates) {
+        for (std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it=update.vHistoryAdd.begin(); it!=update.vHistoryAdd.end(); it++)
+            batch.Write(make_pair('a', it->first), it->second);
+        for (std::vector<CAddressIndexKey>::const_iterator it=update.vHistoryErase.begin(); it!=update.vHistoryErase.end(); it++)
+            batch.Erase(make_pair('a', *it));
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=update.vUnspent.begin(); it!=update.vUnspent.end(); it++) {
+            if (it->second.IsNull())
+                batch.Erase(make_pair('u', it->first));
+            else
+                batch.Write(make_pair('u', it->first), it->second);
+        }
+    }
+    batch.Write('A', hashTip);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressIndexTip(uint256 &hashTip) {
+    return Read('A', hashTip);
+}
+
+// Iterate over the entries of one address under prefix chPrefix, skipping the first nSkip
+template<typename K, typename V>
+bool static ReadAddressEntries(CBlockTreeDB &db, char chPrefix, unsigned char nAddressType, const uint160 &hashAddress,
+                               std::vector<std::pair<K, V> > &vEntries, unsigned int nSkip, unsigned int nMaxEntries)
+{
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(chPrefix, make_pair(nAddressType, hashAddress));
+    std::string strPrefix = ssKeySet.str();
+
+    leveldb::Iterator *pcursor = db.NewIterator();
+    pcursor->Seek(strPrefix);
+    for (; pcursor->Valid() && vEntries.size() < nMaxEntries; pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        if (nSkip > 0) {
+            nSkip--;
+            continue;
+        }
+        try {
+            CBufferReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            leveldb::Slice slValue = pcursor->value();
+            CBufferReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            std::pair<K, V> entry;
+            ssKey >> chType >> entry.first;
+            ssValue >> entry.second;
+            vEntries.push_back(entry);
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressHistory(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressIndexKey, int64> > &vEntries,
+                                      unsigned int nSkip, unsigned int nMaxEntries) {
+    return ReadAddressEntries(*this, 'a', nAddressType, hashAddress, vEntries, nSkip, nMaxEntries);
+}
+
+bool CBlockTreeDB::ReadAddressUnspent(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vEntries,
+                                      unsigned int nSkip, unsigned int nMaxEntries) {
+    return ReadAddressEntries(*this, 'u', nAddressType, hashAddress, vEntries, nSkip, nMaxEntries);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -186,6 +289,51 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "filter", nCacheSize, fMemory, fWipe) {
+}
+
+bool CBlockFilterDB::WriteFilter(const CBlockFilter &filter, const uint256 &hashHeader) {
+    CLevelDBBatch batch;
+    batch.Write(make_pair('f', filter.GetBlockHash()), filter.GetEncoded());
+    batch.Write(make_pair('h', filter.GetBlockHash()), hashHeader);
+    return WriteBatch(batch);
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256 &hashBlock, CBlockFilter &filter) {
+    std::vector<unsigned char> vchFilter;
+    if (!Read(make_pair('f', hashBlock), vchFilter))
+        return false;
+    try {
+        filter = CBlockFilter(hashBlock, vchFilter);
+    } catch (std::exception &e) {
+        return error("CBlockFilterDB::ReadFilter() : invalid filter for block %s", hashBlock.ToString().c_str());
+    }
+    return true;
+}
+
+bool CBlockFilterDB::ReadFilterHeader(const uint256 &hashBlock, uint256 &hashHeader) {
+    return Read(make_pair('h', hashBlock), hashHeader);
+}
+
+namespace {
+
+/** Deserializes a range of block index records and computes their hashes */
+void DeserializeBlockIndexRange(const std::vector<std::string>& vValues, std::vector<CDiskBlockIndex>& vIndex,
+                                std::vector<uint256>& vHash, size_t nBegin, size_t nEnd, char& fFailed)
+{
+    try {
+        for (size_t i = nBegin; i < nEnd; i++) {
+            CBufferReader ssValue(vValues[i].data(), vValues[i].data() + vValues[i].size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> vIndex[i];
+            vHash[i] = vIndex[i].GetBlockHash();
+        }
+    } catch (std::exception &e) {
+        fFailed = true;
+    }
+}
+
+} // anon namespace
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -194,49 +342,82 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
+    // Records are read from the database in batches; decoding them and hashing
+    // their headers is spread over several threads, linking them up is not
+    static const size_t nBatchSize = 16384;
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), 8));
+    std::vector<std::string> vValues;
+    vValues.reserve(nBatchSize);
+
     // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    bool fDone = false;
+    while (!fDone) {
         boost::this_thread::interruption_point();
-        try {
+        vValues.clear();
+        while (vValues.size() < nBatchSize) {
+            if (!pcursor->Valid()) {
+                fDone = true;
+                break;
+            }
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (slKey.size() == 0 || slKey.data()[0] != 'b') {
+                fDone = true; // past the block index records
+                break;
             }
-        } catch (std::exception &e) {
+            leveldb::Slice slValue = pcursor->value();
+            vValues.push_back(std::string(slValue.data(), slValue.size()));
+            pcursor->Next();
+        }
+        if (vValues.empty())
+            break;
+
+        std::vector<CDiskBlockIndex> vIndex(vValues.size());
+        std::vector<uint256> vHash(vValues.size());
+        std::vector<char> vFailed(nThreads, 0);
+        size_t nPerThread = (vValues.size() + nThreads - 1) / nThreads;
+        {
+            boost::thread_group threads;
+            for (int t = 1; t < nThreads; t++) {
+                size_t nBegin = std::min(vValues.size(), t * nPerThread);
+                size_t nEnd = std::min(vValues.size(), nBegin + nPerThread);
+                threads.create_thread(boost::bind(&DeserializeBlockIndexRange, boost::cref(vValues), boost::ref(vIndex), boost::ref(vHash),
+                                                  nBegin, nEnd, boost::ref(vFailed[t])));
+            }
+            DeserializeBlockIndexRange(vValues, vIndex, vHash, 0, std::min(vValues.size(), nPerThread), vFailed[0]);
+            threads.join_all();
+        }
+        if (std::find(vFailed.begin(), vFailed.end(), 1) != vFailed.end()) {
+            delete pcursor;
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
+
+        for (size_t i = 0; i < vIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = vIndex[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vHash[i]);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && vHash[i] == hashGenesisBlock)
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex()) {
+                delete pcursor;
+                return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+            }
+        }
     }
     delete pcursor;
 
@@ -8,6 +8,129 @@
 
 #include "main.h"
 #include "leveldb.h"
+#include "blockfilter.h"
+
+/** Address types in the address index (-addressindex) */
+enum AddressIndexType
+{
+    ADDRESS_PUBKEYHASH = 1,
+    ADDRESS_SCRIPTHASH = 2,
+};
+
+/** Key of an address history entry: an output paying to, or an input spending from, an address.
+ *  Height and position in the block are serialized big endian, so the entries of an
+ *  address are iterated in chain order. The value is the amount, negative when spending. */
+struct CAddressIndexKey
+{
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    unsigned int nHeight;
+    unsigned int nTxPos;   // position of the transaction in its block
+    uint256 txhash;
+    unsigned int nIndex;   // output index, or input index when spending
+    bool fSpending;
+
+    CAddressIndexKey() : nAddressType(0), hashAddress(0), nHeight(0), nTxPos(0), txhash(0), nIndex(0), fSpending(false) {}
+    CAddressIndexKey(unsigned char nAddressTypeIn, const uint160 &hashAddressIn, unsigned int nHeightIn, unsigned int nTxPosIn,
+                     const uint256 &txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        nAddressType(nAddressTypeIn), hashAddress(hashAddressIn), nHeight(nHeightIn), nTxPos(nTxPosIn),
+        txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nAddressType, nType, nVersion);
+        ::Serialize(s, hashAddress, nType, nVersion);
+        WriteBE32(s, nHeight);
+        WriteBE32(s, nTxPos);
+        ::Serialize(s, txhash, nType, nVersion);
+        ::Serialize(s, nIndex, nType, nVersion);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion)
+    {
+        ::Unserialize(s, nAddressType, nType, nVersion);
+        ::Unserialize(s, hashAddress, nType, nVersion);
+        nHeight = ReadBE32(s);
+        nTxPos = ReadBE32(s);
+        ::Unserialize(s, txhash, nType, nVersion);
+        ::Unserialize(s, nIndex, nType, nVersion);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+
+private:
+    template<typename Stream>
+    static void WriteBE32(Stream &s, unsigned int n)
+    {
+        unsigned char pch[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((char*)pch, 4);
+    }
+
+    template<typename Stream>
+    static unsigned int ReadBE32(Stream &s)
+    {
+        unsigned char pch[4];
+        s.read((char*)pch, 4);
+        return ((unsigned int)pch[0] << 24) | ((unsigned int)pch[1] << 16) | ((unsigned int)pch[2] << 8) | pch[3];
+    }
+};
+
+/** Key of an unspent output in the address index */
+struct CAddressUnspentKey
+{
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : nAddressType(0), hashAddress(0), txhash(0), nIndex(0) {}
+    CAddressUnspentKey(unsigned char nAddressTypeIn, const uint160 &hashAddressIn, const uint256 &txhashIn, unsigned int nIndexIn) :
+        nAddressType(nAddressTypeIn), hashAddress(hashAddressIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nAddressType);
+        READWRITE(hashAddress);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+/** Unspent output in the address index. A null value marks an entry to be erased. */
+struct CAddressUnspentValue
+{
+    int64 nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+    CAddressUnspentValue(int64 nValueIn, const CScript &scriptPubKeyIn, int nHeightIn) :
+        nValue(nValueIn), scriptPubKey(scriptPubKeyIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    )
+
+    void SetNull() { nValue = -1; scriptPubKey.clear(); nHeight = -1; }
+    bool IsNull() const { return nValue == -1; }
+};
+
+/** Address index changes made by connecting or disconnecting a block */
+struct CAddressIndexUpdate
+{
+    std::vector<std::pair<CAddressIndexKey, int64> > vHistoryAdd;
+    std::vector<CAddressIndexKey> vHistoryErase;
+    // applied in order; null values erase the entry
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+};
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -24,6 +147,7 @@ public:
     bool SetBestBlock(CBlockIndex *pindex);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    void Compact() { db.Compact(); }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -40,15 +164,46 @@ public:
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo &fileinfo);
+    // Write the block indexes and emptied file infos of pruned files, and the pruned flag, in one synced batch
+    bool WritePrunedBlockFiles(const std::vector<CDiskBlockIndex> &vBlockIndex, const std::set<int> &setFiles);
     bool ReadLastBlockFile(int &nFile);
     bool WriteLastBlockFile(int nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    // Position up to which a block file was reindexed, to resume an interrupted reindex from
+    bool WriteReindexPos(int nFile, uint64 nPos);
+    bool ReadReindexPos(int nFile, uint64 &nPos);
+    bool WriteVerifiedTip(const uint256 &hash);
+    bool ReadVerifiedTip(uint256 &hash);
+    bool EraseVerifiedTip();
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // Write the changes of several blocks in order, in one batch, recording hashTip as the block they lead to
+    bool WriteAddressIndex(const std::vector<CAddressIndexUpdate> &vUpdates, const uint256 &hashTip);
+    bool ReadAddressIndexTip(uint256 &hashTip);
+    bool ReadAddressHistory(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressIndexKey, int64> > &vEntries,
+                            unsigned int nSkip = 0, unsigned int nMaxEntries = std::numeric_limits<unsigned int>::max());
+    bool ReadAddressUnspent(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vEntries,
+                            unsigned int nSkip = 0, unsigned int nMaxEntries = std::numeric_limits<unsigned int>::max());
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
 };
 
+/** Access to the block filter database (blocks/filter/), maintained with -blockfilterindex.
+ *  Entries are keyed by block hash, so the filters of blocks that were
+ *  disconnected stay valid and need not be erased on reorganisation. */
+class CBlockFilterDB : public CLevelDB
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+public:
+    bool WriteFilter(const CBlockFilter &filter, const uint256 &hashHeader);
+    bool ReadFilter(const uint256 &hashBlock, CBlockFilter &filter);
+    bool ReadFilterHeader(const uint256 &hashBlock, uint256 &hashHeader);
+};
+
 #endif // BITCOIN_TXDB_LEVELDB_H